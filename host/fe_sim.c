@@ -0,0 +1,398 @@
+/**
+ * fe_sim.c
+ *
+ * Runs the firmware on a PC, on the simulated plotter of hal_host.c, for
+ * benchmarks that don't need a cutter.
+ *
+ *     fe_sim [-b baud] [-s] [job ...]
+ *
+ * boots the firmware as main.c does, and has the host send each job (a file
+ * with HPGL or GP-GL) over the UART at the baud rate, with XON/XOFF, one
+ * after the other. With -s the jobs are stored in the DataFlash first, and
+ * cut from there. For each job it prints how long the cutter takes, from
+ * the first byte to the last step, and what the motors did.
+ *
+ *     fe_sim -p passes [job ...]
+ *
+ * only runs the parsers: each job is run through lang_block() and the
+ * commands with more than one point are worked out, as cli.c does, passes
+ * times. It prints how fast that goes on the PC.
+ *
+ * Without jobs on the command line, a few built-in ones are used.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "avrlib.h"
+#include "configs.h"
+#include "usb.h"
+#include "serial.h"
+#include "timer.h"
+#include "stepper.h"
+#include "planner.h"
+#include "flash.h"
+#include "catalog.h"
+#include "spool.h"
+#include "cli.h"
+#include "hpgl.h"
+#include "lang.h"
+#include "sim.h"
+
+#define MAX_JOBS    16
+#define JOB_SIZE    65536 // room for a built-in job
+#define HOME_Y      200 // carriage steps from the home switch at power up
+#define QUIET       (F_CPU * 5 / 2) // a job is done after this long without a step or a byte, longer than
+                                    // SPOOL_IDLE_TICKS and LANG_IDLE_TICKS
+#define TIMEOUT     (F_CPU * 3600ULL) // simulated time a job may take
+#define BLOCK       64 // bytes at a time through lang_block(), as cli.c
+
+struct job {
+    const char *name;
+    char *data;
+    uint32_t len;
+};
+
+static struct job jobs[MAX_JOBS];
+static int njobs;
+static uint8_t queue_empty; // stepper_queue_room() with nothing queued
+
+static void fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double seconds(uint64_t cycles) {
+    return cycles / (double) F_CPU;
+}
+
+static struct job *new_job(const char *name) {
+    struct job *j;
+
+    if (njobs == MAX_JOBS) {
+        fail("too many jobs");
+    }
+
+    j = &jobs[njobs++];
+    j->name = name;
+    j->len = 0;
+
+    if (!(j->data = malloc(JOB_SIZE))) {
+        fail("out of memory");
+    }
+
+    return j;
+}
+
+static void add(struct job *j, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(j->data + j->len, JOB_SIZE - j->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || j->len + n >= JOB_SIZE) {
+        fail("built-in job %s is too big", j->name);
+    }
+
+    j->len += n;
+}
+
+static void load(const char *path) {
+    struct job *j;
+    FILE *f;
+    long n;
+
+    if (njobs == MAX_JOBS) {
+        fail("too many jobs");
+    }
+
+    if (!(f = fopen(path, "rb")) || fseek(f, 0, SEEK_END) || (n = ftell(f)) < 0) {
+        fail("can't read %s", path);
+    }
+
+    rewind(f);
+    j = &jobs[njobs++];
+    j->name = path;
+    j->len = n;
+
+    if (!(j->data = malloc(n + 1)) || fread(j->data, 1, n, f) != (size_t) n) {
+        fail("can't read %s", path);
+    }
+
+    fclose(f);
+}
+
+/**
+ * Jobs like the ones the cutter gets: lines, arcs, curves, text, and the
+ * same squares again in GP-GL. HPGL units are steps, as IN leaves them
+ * (see scale.c), GP-GL units 0.05 mm.
+ */
+static void builtin_jobs(void) {
+    struct job *j;
+    int i, k, x, y;
+
+    j = new_job("squares");
+    add(j, "IN;SP1;");
+    for (i = 0; i < 8; ++i) {
+        for (k = 0; k < 8; ++k) {
+            x = 400 + 600 * i;
+            y = 400 + 600 * k;
+            add(j, "PU%d,%d;PD%d,%d,%d,%d,%d,%d,%d,%d;", x, y, x + 400, y, x + 400, y + 400, x, y + 400, x, y);
+        }
+    }
+    add(j, "PU0,0;");
+
+    j = new_job("circles");
+    add(j, "IN;SP1;");
+    for (i = 0; i < 6; ++i) {
+        for (k = 0; k < 6; ++k) {
+            add(j, "PU%d,%d;CI300;", 800 + 800 * i, 800 + 800 * k);
+        }
+    }
+    add(j, "PU0,0;");
+
+    j = new_job("curves");
+    add(j, "IN;SP1;");
+    for (k = 0; k < 8; ++k) {
+        y = 600 + 600 * k;
+        add(j, "PU400,%d;PD;BZ", y);
+        for (i = 0; i < 10; ++i) {
+            x = 400 + 400 * i;
+            add(j, "%s%d,%d,%d,%d,%d,%d", i ? "," : "", x + 100, y + 400, x + 300, y - 400, x + 400, y);
+        }
+        add(j, ";PU;");
+    }
+    add(j, "PU0,0;");
+
+    j = new_job("labels");
+    add(j, "IN;SP1;SI0.3,0.45;");
+    for (k = 0; k < 4; ++k) {
+        add(j, "PU400,%d;LBThe quick brown fox jumps\r\nover the lazy dog 0123456789\003", 4000 - 1000 * k);
+    }
+    add(j, "PU0,0;");
+
+    j = new_job("gpgl");
+    add(j, "H\n");
+    for (i = 0; i < 8; ++i) {
+        for (k = 0; k < 8; ++k) {
+            x = 200 + 300 * i;
+            y = 200 + 300 * k;
+            add(j, "M%d,%d\nD%d,%d,%d,%d,%d,%d,%d,%d\n", x, y, x + 200, y, x + 200, y + 200, x, y + 200, x, y);
+        }
+    }
+    add(j, "H\n");
+}
+
+/**
+ * The parsers only: bytes, points and commands a second on this PC.
+ */
+static void parse_bench(long passes) {
+    struct lang_batch b;
+    STEPPER_COORD x, y;
+    uint32_t i, points, cmds;
+    double t;
+    long pass;
+    int n;
+
+    printf("%-10s %8s %8s %8s %10s %10s\n", "job", "bytes", "points", "cmds", "MB/s", "Mpoints/s");
+
+    for (n = 0; n < njobs; ++n) {
+        points = cmds = 0;
+        t = now();
+
+        for (pass = 0; pass < passes; ++pass) {
+            lang_job();
+
+            for (i = 0; i < jobs[n].len; ) {
+                i += lang_block(jobs[n].data + i, (jobs[n].len - i > BLOCK) ? BLOCK : jobs[n].len - i, &b);
+                points += b.points;
+
+                if (b.cmd == CMD_CONT) {
+                    continue;
+                }
+
+                ++cmds;
+
+                while (lang_next(b.cmd, &x, &y) != CMD_CONT) {
+                    ++points;
+                }
+            }
+        }
+
+        t = now() - t;
+        printf("%-10s %8" PRIu32 " %8" PRIu32 " %8" PRIu32 " %10.2f %10.2f\n", jobs[n].name, jobs[n].len,
+               (uint32_t) (points / passes), (uint32_t) (cmds / passes),
+               jobs[n].len * (double) passes / t / 1e6, points / t / 1e6);
+    }
+}
+
+/**
+ * One pass of the main loop of main.c, and on to the next interrupt.
+ */
+static void main_loop(void) {
+    cli_poll();
+    stepper_prep();
+    flash_poll();
+
+    if (flag_25Hz) {
+        flag_25Hz = 0;
+        spool_tick();
+        lang_tick();
+    }
+
+    if (flag_Hz) {
+        flag_Hz = 0;
+    }
+
+    sim_wait();
+}
+
+static uint8_t busy(void) {
+    uint64_t last = (sim.last_move > sim.last_rx) ? sim.last_move : sim.last_rx;
+
+    return sim_unsent() || usb_haschar() || spool_playing() || stepper_queue_room() != queue_empty || sim_cycles - last < QUIET;
+}
+
+/**
+ * Run until the job is done, and the motors and the host have been quiet for
+ * a while. A stored job is cut by then, and the next job can be in another
+ * language.
+ */
+static void settle(void) {
+    uint64_t start = sim_cycles;
+
+    while (busy()) {
+        main_loop();
+
+        if (sim_cycles - start > TIMEOUT) {
+            fail("the cutter is still busy after %.0f s", seconds(sim_cycles - start));
+        }
+    }
+}
+
+static void boot(uint32_t baud, int store) {
+    sim_reset(HOME_Y);
+
+    usb_init();
+    timer_init();
+    planner_init();
+    stepper_init();
+    flash_init();
+    catalog_init();
+    hpgl_init();
+
+    sim_start();
+    queue_empty = stepper_queue_room();
+
+    if (baud != BAUD_RATE) {
+        if (!serial_baud_valid(baud)) {
+            fail("can't run at %lu baud", (unsigned long) baud);
+        }
+
+        usb_set_baud(baud); // as if the host had sent BD
+    }
+
+    if (store) {
+        spool_store_mode(1);
+    }
+
+    settle(); // homing
+}
+
+static void motion_bench(uint32_t baud, int store) {
+    struct sim_stats s;
+    uint64_t start;
+    double t;
+    int n;
+
+    boot(baud, store);
+
+    printf("%-10s %8s %9s %8s %8s %5s %8s %5s %8s\n", "job", "bytes", "time s", "steps x", "steps y", "pen", "cut mm", "xoff", "host s");
+
+    for (n = 0; n < njobs; ++n) {
+        s = sim;
+        start = sim_cycles;
+        t = now();
+
+        sim_send((const uint8_t *) jobs[n].data, jobs[n].len);
+        settle();
+
+        printf("%-10s %8" PRIu32 " %9.2f %8" PRIu32 " %8" PRIu32 " %5" PRIu32 " %8.0f %5" PRIu32 " %8.2f\n",
+               jobs[n].name, jobs[n].len,
+               seconds((sim.last_move > start ? sim.last_move : sim_cycles) - start),
+               sim.steps_x - s.steps_x, sim.steps_y - s.steps_y, sim.pen_downs - s.pen_downs,
+               (sim.cut - s.cut) / STEPS_PER_MM_X, sim.xoffs - s.xoffs, now() - t);
+    }
+
+    printf("%.0f s simulated, %" PRIu32 " step interrupts, %" PRIu32 " bytes in, %" PRIu32 " out, %" PRIu32
+           " flash pages programmed, %" PRIu32 " blocks erased\n", seconds(sim_cycles), sim.step_isrs, sim.rx_bytes,
+           sim.tx_bytes, sim.flash_programs, sim.flash_erases);
+}
+
+int main(int argc, char **argv) {
+    long passes = 0;
+    uint32_t baud = BAUD_RATE;
+    int store = 0;
+    int i;
+
+    // timer.h has its own usleep(), so no getopt() from unistd.h
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            baud = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            passes = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-s")) {
+            store = 1;
+        } else if (argv[i][0] == '-') {
+            fail("usage: %s [-b baud] [-s] [job ...]\n       %s -p passes [job ...]", argv[0], argv[0]);
+        } else {
+            load(argv[i]);
+        }
+    }
+
+    if (!njobs) {
+        builtin_jobs();
+    }
+
+    if (passes > 0) {
+        parse_bench(passes);
+    } else {
+        motion_bench(baud, store);
+    }
+
+    return 0;
+}
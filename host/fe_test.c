@@ -0,0 +1,409 @@
+/**
+ * fe_test.c
+ *
+ * Tests of the firmware parts that can be checked without a cutter, on the
+ * simulated plotter of hal_host.c.
+ *
+ *     fe_test [test ...]
+ *
+ * runs the named tests, or all of them, and exits with 1 when one fails.
+ * CMakeLists.txt has a ctest test for each, so "ctest" runs them all.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "configs.h"
+#include "number.h"
+#include "hpgl.h"
+#include "gpgl.h"
+#include "planner.h"
+#include "bincmd.h"
+#include "flash.h"
+#include "catalog.h"
+#include "sim.h"
+
+#define MAX_CMDS    16 // most commands parse() keeps
+#define JOBS        295 // put in the catalog, the log holds a few dozen
+
+struct cmd {
+    int8_t cmd;
+    STEPPER_COORD x, y;
+};
+
+static const char *test; // name of the test running
+static int failures;
+
+static void check(int ok, const char *fmt, ...) {
+    va_list ap;
+
+    if (ok) {
+        return;
+    }
+
+    fprintf(stderr, "%s: ", test);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    ++failures;
+}
+
+static void scan(const char *s) {
+    num_reset();
+
+    while (*s) {
+        num_char(*s++);
+    }
+}
+
+static void test_number(void) {
+    scan("123");
+    check(num_int() == 123 && num_fixed() == FIXED_FROM_INT(123), "123");
+
+    scan("-12.5");
+    check(num_int() == -13, "-12.5 rounds to %ld", (long) num_int());
+    check(num_fixed() == -(FIXED_FROM_INT(12) + FIXED_ONE / 2), "-12.5 in Q16.16");
+    check(num_double() == -12.5, "-12.5 as a double");
+
+    scan("12.49");
+    check(num_int() == 12, "12.49 rounds to %ld", (long) num_int());
+
+    scan("1.23456"); // four decimals are kept
+    check(num_fixed() == FIXED_ONE + (2345L * FIXED_ONE + 5000) / 10000, "1.23456 in Q16.16");
+
+    scan("+7");
+    check(num_int() == 7, "+7");
+
+    scan(".5");
+    check(num_int() == 1 && num_fixed() == FIXED_ONE / 2, ".5");
+
+    scan("123456789");
+    check(num_int() == 99999999L, "123456789 saturates to %ld", (long) num_int());
+
+    scan("40000");
+    check(num_int() == 40000 && num_fixed() == 0x7fffffffL, "40000 saturates in Q16.16");
+
+    scan("-40000");
+    check(num_fixed() == -0x7fffffffL, "-40000 saturates in Q16.16");
+
+    scan("");
+    check(num_int() == 0 && num_fixed() == 0, "nothing is 0");
+}
+
+/**
+ * Run 's' through a parser, and keep the commands that come out. A pen
+ * command comes out for every character until it has a point, as cli.c
+ * sees it, only the points are kept.
+ */
+static int parse(int8_t (*parser)(char, STEPPER_COORD *, STEPPER_COORD *, uint8_t *), const char *s,
+                 struct cmd *cmds) {
+    STEPPER_COORD x, y;
+    uint8_t lb;
+    int8_t cmd;
+    int n = 0;
+
+    for (; *s; ++s) {
+        cmd = parser(*s, &x, &y, &lb);
+
+        if ((cmd == CMD_PU || cmd == CMD_PD) && x == -1 && y == -1) {
+            continue;
+        }
+
+        if (cmd != CMD_CONT && n < MAX_CMDS) {
+            cmds[n].cmd = cmd;
+            cmds[n].x = x;
+            cmds[n].y = y;
+            ++n;
+        }
+    }
+
+    return n;
+}
+
+static void expect(const struct cmd *cmds, int n, const struct cmd *want, int wanted) {
+    int i;
+
+    check(n == wanted, "%d commands, not %d", n, wanted);
+
+    for (i = 0; i < n && i < wanted; ++i) {
+        check(cmds[i].cmd == want[i].cmd && cmds[i].x == want[i].x && cmds[i].y == want[i].y,
+              "command %d is %d (%ld, %ld), not %d (%ld, %ld)", i, cmds[i].cmd, (long) cmds[i].x, (long) cmds[i].y,
+              want[i].cmd, (long) want[i].x, (long) want[i].y);
+    }
+}
+
+static void test_hpgl(void) {
+    // without IP and SC a plotter unit is a step
+    static const struct cmd want[] = {
+        { CMD_INIT, -1, -1 },
+        { CMD_PU, 400, 800 },
+        { CMD_PD, 800, 800 },
+        { CMD_PD, 800, 1200 },
+        { CMD_PD, 840, 1160 }, // PR
+        { CMD_PD, 10, 11 }, // 10.4 rounds down, 10.5 up
+        { CMD_PU, -40, 40 },
+    };
+    struct cmd cmds[MAX_CMDS];
+
+    hpgl_init();
+    expect(cmds, parse(hpgl_char, "IN;PU400,800;PD800,800,800,1200;PR40,-40;PA10.4,10.5;PU-40,+40;", cmds),
+           want, sizeof(want) / sizeof(want[0]));
+    check(hpgl_between(), "not between commands at the end");
+}
+
+static void test_gpgl(void) {
+    // 20 GP-GL units to the mm
+    static const struct cmd want[] = {
+        { CMD_PU, 79, 157 }, // (5 mm, 10 mm)
+        { CMD_PD, 236, 157 },
+        { CMD_PD, 236, 315 },
+        { CMD_PD, 236, 472 }, // E, from (300, 400)
+        { CMD_PU, 79, 157 },
+    };
+    struct cmd cmds[MAX_CMDS];
+
+    gpgl_init();
+    expect(cmds, parse(gpgl_char, "M100,200\003D300,200,300,400\003E0,200\003M100,200\003", cmds),
+           want, sizeof(want) / sizeof(want[0]));
+    check(gpgl_between(), "not between commands at the end");
+}
+
+static void test_planner(void) {
+    static const uint16_t lines[] = { 0, 1, 3, 4, 7, 40, 333, 1000, 4000, 65535 };
+    static const uint8_t speeds[] = { 0, 1, 17, 100, 200, ACCEL_TABLE_SIZE - 1 };
+    struct profile p;
+    uint8_t i, e, x, n, top;
+
+    planner_init();
+
+    for (i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+        uint16_t steps = lines[i];
+        int span = steps / ACCEL_STEPS_RAMP;
+
+        for (e = 0; e < sizeof(speeds); ++e) {
+            for (x = 0; x < sizeof(speeds); ++x) {
+                for (n = 0; n < sizeof(speeds); ++n) {
+                    uint8_t entry = speeds[e];
+                    uint8_t exit = speeds[x];
+
+                    planner_profile(&p, steps, entry, exit, speeds[n]);
+
+                    top = speeds[n];
+                    top = (top < entry) ? entry : top;
+                    top = (top < exit) ? exit : top;
+
+                    check(p.entry == entry, "%u steps %u -> %u: starts at %u", steps, entry, exit, p.entry);
+                    check(p.accel_until <= p.decel_after && p.decel_after <= steps,
+                          "%u steps: accelerates to %u, decelerates after %u", steps, p.accel_until, p.decel_after);
+                    check(p.nominal >= p.entry && p.nominal >= p.exit && p.nominal <= top,
+                          "%u steps %u -> %u: cruises at %u", steps, entry, exit, p.nominal);
+                    check(p.accel_until == (p.nominal - p.entry) * ACCEL_STEPS_RAMP
+                          && steps - p.decel_after == (p.nominal - p.exit) * ACCEL_STEPS_RAMP,
+                          "%u steps %u -> %u: ramps don't match the speeds", steps, entry, exit);
+
+                    if (abs(entry - exit) <= span) {
+                        check(p.exit == exit, "%u steps %u -> %u: ends at %u", steps, entry, exit, p.exit);
+                    }
+
+                    if ((top - entry) + (top - exit) <= span) {
+                        check(p.nominal == top, "%u steps %u -> %u: cruises at %u, not %u", steps, entry, exit,
+                              p.nominal, top);
+                    }
+                }
+            }
+        }
+    }
+
+    check(planner_junction(100, 0, 100, 0) == ACCEL_TABLE_SIZE - 1, "slows down going straight on");
+    check(planner_junction(100, 0, -100, 0) == 0, "doesn't stop to turn back");
+    check(planner_junction(100, 0, 0, 100) < planner_junction(100, 0, 100, 50), "no slower at a gentler corner");
+    check(planner_junction(0, 0, 100, 0) == 0, "no direction from a line without steps");
+}
+
+static void test_bincmd(void) {
+    static const int32_t values[] = { 0, 1, -1, 63, -64, 64, 1000, -1000, 123456, -654321, (1L << 27) - 1, -(1L << 27) };
+    uint8_t buf[BIN_RECORD_MAX];
+    uint8_t type, n, m, i, j;
+    int32_t a, b;
+
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        for (j = 0; j < sizeof(values) / sizeof(values[0]); ++j) {
+            for (type = BIN_MOVE; type <= BIN_DRAW; ++type) {
+                n = bincmd_encode(buf, type, values[i], values[j]);
+                m = bincmd_decode(buf, n, &type, &a, &b);
+
+                check(n <= BIN_RECORD_MAX, "%u bytes for (%ld, %ld)", n, (long) values[i], (long) values[j]);
+                check(m == n && a == values[i] && b == values[j], "(%ld, %ld) comes back as (%ld, %ld)",
+                      (long) values[i], (long) values[j], (long) a, (long) b);
+                check(bincmd_decode(buf, n - 1, &type, &a, &b) == 0, "(%ld, %ld) decodes without its last byte",
+                      (long) values[i], (long) values[j]);
+            }
+        }
+    }
+
+    for (type = BIN_SPEED; type <= BIN_PAGE; ++type) {
+        n = bincmd_encode(buf, type, 300, 0);
+        m = bincmd_decode(buf, n, &i, &a, &b);
+        check(m == n && i == type && a == 300 && b == 0, "record %u with 300 comes back as %u with %ld", type, i,
+              (long) a);
+    }
+
+    check(bincmd_encode(buf, BIN_EXIT, 0, 0) == 1 && buf[0] == BIN_EXIT, "EXIT is one byte");
+    check(bincmd_decode(buf, 0, &type, &a, &b) == 0, "nothing decodes");
+}
+
+static struct cat_entry job(uint16_t page, uint32_t length, const char *name) {
+    struct cat_entry e;
+
+    memset(&e, 0, sizeof(e));
+    e.page = page;
+    e.length = length;
+    e.crc = length ^ 0x5a5a;
+    e.max_x = length / 10;
+    e.max_y = length / 20;
+    strncpy(e.name, name, CAT_NAME_LEN);
+
+    return e;
+}
+
+/**
+ * Read the catalog back from the flash, and compare it with what was in RAM.
+ */
+static void reload(const char *when) {
+    struct cat_entry before[CAT_SLOTS];
+    const struct cat_entry *e;
+    uint8_t last = catalog_last();
+    uint16_t next = catalog_next_page();
+    uint8_t i;
+
+    for (i = 0; i < CAT_SLOTS; ++i) {
+        e = catalog_get(i);
+        memset(&before[i], 0, sizeof(before[i]));
+        if (e) {
+            before[i] = *e;
+        }
+    }
+
+    catalog_init();
+
+    check(catalog_last() == last, "%s: newest job in slot %u, was %u", when, catalog_last(), last);
+
+    // after a job was clobbered, the next one goes after the last job in the log
+    if (last != CAT_NO_SLOT) {
+        check(catalog_next_page() == next, "%s: next job at %u, was %u", when, catalog_next_page(), next);
+    }
+
+    for (i = 0; i < CAT_SLOTS; ++i) {
+        e = catalog_get(i);
+        check(e ? !memcmp(e, &before[i], sizeof(*e)) : !before[i].length, "%s: slot %u is not what it was", when, i);
+    }
+}
+
+static void test_catalog(void) {
+    struct cat_entry e;
+    uint16_t page;
+    int i;
+
+    sim_reset(0);
+    flash_init();
+    catalog_init();
+
+    check(catalog_last() == CAT_NO_SLOT && catalog_next_page() == DF_RESERVED_PAGES, "erased flash has jobs");
+
+    for (i = 0; i < CAT_SLOTS; ++i) {
+        check(!catalog_get(i), "slot %d is not empty", i);
+    }
+
+    e = job(catalog_next_page(), 5000, "first");
+    catalog_put(3, &e);
+    check(catalog_last() == 3 && catalog_get(3) && catalog_get(3)->length == 5000, "slot 3 not stored");
+    reload("one job");
+
+    // enough jobs to fill the log, so it is compacted a few times, and
+    // the newest job is not always in the last slot
+    for (i = 0; i < JOBS; ++i) {
+        e = job(catalog_next_page(), 300 + i * 7, (i & 1) ? "odd" : "even");
+        catalog_put(i * 3 % CAT_SLOTS, &e);
+        reload("after a job");
+    }
+
+    check(catalog_last() == (JOBS - 1) * 3 % CAT_SLOTS, "newest job in slot %u", catalog_last());
+
+    // write over the newest job
+    page = catalog_get(catalog_last())->page;
+    catalog_clobber(page, 1);
+    check(!catalog_get((JOBS - 1) * 3 % CAT_SLOTS) && catalog_last() == CAT_NO_SLOT, "clobbered job still there");
+    reload("clobbered");
+
+    // something else in the log block is taken as no catalog
+    flash_erase_block(0);
+    flash_program_bytes(0, 0, (const uint8_t *) "junk", 4);
+    catalog_init();
+    check(catalog_last() == CAT_NO_SLOT, "junk read as a job");
+    reload("after junk");
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    { "number", test_number },
+    { "hpgl", test_hpgl },
+    { "gpgl", test_gpgl },
+    { "planner", test_planner },
+    { "bincmd", test_bincmd },
+    { "catalog", test_catalog },
+};
+
+int main(int argc, char **argv) {
+    unsigned n;
+    int i, found;
+
+    for (n = 0; n < sizeof(tests) / sizeof(tests[0]); ++n) {
+        found = argc < 2;
+
+        for (i = 1; i < argc; ++i) {
+            found |= !strcmp(argv[i], tests[n].name);
+        }
+
+        if (found) {
+            test = tests[n].name;
+            tests[n].run();
+        }
+    }
+
+    for (i = 1; i < argc; ++i) {
+        for (n = 0; n < sizeof(tests) / sizeof(tests[0]) && strcmp(argv[i], tests[n].name); ++n) {
+        }
+
+        if (n == sizeof(tests) / sizeof(tests[0])) {
+            fprintf(stderr, "no test %s\n", argv[i]);
+            ++failures;
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d failed\n", failures);
+    }
+
+    return failures ? 1 : 0;
+}
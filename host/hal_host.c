@@ -0,0 +1,545 @@
+/**
+ * hal_host.c
+ *
+ * hal.h for the host build: a simulated plotter for the firmware to run on.
+ *
+ * The motors are followed through the coil patterns stepper.c writes, and
+ * the carriage closes the home switch at y 0. Timer0 and Timer2 interrupt
+ * at the periods the firmware sets. The host on the other end of UART1
+ * sends what it was given with sim_send() at the baud rate, and stops on
+ * XOFF until XON. The DataFlash is an AT45DB041 with its commands, page
+ * buffers and busy times, clocked through the bit banged pins.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "avrlib.h"
+#include "hal.h"
+#include "sim.h"
+
+#define NEVER           UINT64_MAX
+#define TICK_CYCLES     64000 // Timer2 interrupt, 250 Hz
+#define TCNT2_CYCLES    256 // Timer2 counts at 62.5 kHz
+
+#define XON             0x11
+#define XOFF            0x13
+
+#define DF_PAGES        2048
+#define DF_PAGE_SIZE    264
+#define DF_PAGE_BITS    9
+#define DF_BLOCK_PAGES  8
+#define DF_STATUS       0x1c // 264 byte pages, bit 7 is set when ready
+#define DF_PROGRAM      (F_CPU / 1000 * 3) // page program, 3 ms
+#define DF_ERASE_PROGRAM (F_CPU / 1000 * 20) // page program with built-in erase
+#define DF_BLOCK_ERASE  (F_CPU / 1000 * 45)
+
+uint64_t sim_cycles;
+struct sim_stats sim;
+
+static uint8_t running; // interrupts are on
+static uint8_t in_isr; // interrupts don't nest
+
+// coil pattern of each motor phase, as in stepper.c
+static const uint8_t phases[16] = {
+    0x02, 0x06, 0x0a, 0x09, 0x08, 0x18, 0x28, 0x24,
+    0x20, 0x60, 0xa0, 0x90, 0x80, 0x81, 0x82, 0x42,
+};
+
+static int8_t phase_x, phase_y; // -1 with the motor off
+static uint8_t pen;
+
+static uint64_t next_step, next_tick;
+static uint32_t step_cycles; // Timer0 period
+
+static uint8_t uart_on;
+static uint8_t udrie; // data register empty interrupt
+static uint8_t tx_sent; // TXC
+static uint32_t byte_cycles; // 10 bits at the baud rate
+static uint64_t next_rx, next_tx;
+static uint64_t tx_free; // the last byte has left
+static const uint8_t *send_data;
+static uint32_t send_len, send_pos;
+static uint8_t paused; // by XOFF
+static uint8_t rx_data;
+
+static uint8_t df_mem[DF_PAGES][DF_PAGE_SIZE];
+static uint8_t df_buf[2][DF_PAGE_SIZE];
+static uint8_t df_cs, df_sck, df_mosi, df_miso;
+static uint8_t df_bit, df_in, df_out;
+static uint32_t df_bytes; // bytes since CS went low
+static uint8_t df_op;
+static uint32_t df_addr;
+static uint16_t df_page, df_byte;
+static uint64_t df_ready; // cycle the chip is ready again
+
+static uint64_t next_event(void) {
+    uint64_t t = next_tick;
+
+    if (next_step < t) {
+        t = next_step;
+    }
+
+    if (next_rx < t) {
+        t = next_rx;
+    }
+
+    if (next_tx < t) {
+        t = next_tx;
+    }
+
+    return t;
+}
+
+static void schedule_rx(void) {
+    if (uart_on && !paused && send_pos < send_len && next_rx == NEVER) {
+        next_rx = sim_cycles + byte_cycles;
+    }
+}
+
+static void schedule_tx(void) {
+    if (udrie && next_tx == NEVER) {
+        next_tx = (tx_free > sim_cycles) ? tx_free : sim_cycles;
+    }
+}
+
+/**
+ * Run the interrupts that are due, in the order of their vectors.
+ */
+static void dispatch(void) {
+    uint64_t t;
+
+    if (!running || in_isr) {
+        return;
+    }
+
+    in_isr = 1;
+
+    while ((t = next_event()) <= sim_cycles) {
+        if (next_tick == t) {
+            next_tick += TICK_CYCLES;
+            hal_tick_isr();
+        } else if (next_step == t) {
+            ++sim.step_isrs;
+            hal_step_isr();
+            next_step = t + step_cycles; // the compare match restarted Timer0 at t
+        } else if (next_rx == t) {
+            next_rx = NEVER;
+            rx_data = send_data[send_pos++];
+            ++sim.rx_bytes;
+            sim.last_rx = t;
+            hal_uart_rx_isr();
+            schedule_rx();
+        } else {
+            next_tx = NEVER;
+            hal_uart_tx_isr();
+
+            if (udrie && next_tx == NEVER) {
+                next_tx = (tx_free > t) ? tx_free : t + byte_cycles;
+            }
+        }
+    }
+
+    in_isr = 0;
+}
+
+/**
+ * The time an access to the hardware takes, about the instructions for it.
+ */
+static void spend(uint32_t cycles) {
+    sim_cycles += cycles;
+    dispatch();
+}
+
+/**
+ * Power up, with the carriage home_y steps from the home switch.
+ */
+void sim_reset(int32_t home_y) {
+    memset(&sim, 0, sizeof(sim));
+    sim.y = home_y;
+    sim_cycles = 0;
+    running = in_isr = 0;
+    phase_x = phase_y = -1;
+    pen = 0;
+    next_step = next_tick = next_rx = next_tx = NEVER;
+    uart_on = udrie = tx_sent = paused = 0;
+    tx_free = 0;
+    byte_cycles = 10 * 16 * (F_CPU / 16 / 9600);
+    send_len = send_pos = 0;
+    memset(df_mem, 0xff, sizeof(df_mem));
+    df_cs = 1;
+    df_sck = df_mosi = df_miso = 0;
+    df_ready = 0;
+}
+
+/**
+ * Interrupts on, as sei() in main.c.
+ */
+void sim_start(void) {
+    running = 1;
+    dispatch();
+}
+
+/**
+ * Bytes for the host to send. They have to stay around until they are sent.
+ */
+void sim_send(const uint8_t *data, uint32_t len) {
+    send_data = data;
+    send_len = len;
+    send_pos = 0;
+    schedule_rx();
+}
+
+uint32_t sim_unsent(void) {
+    return send_len - send_pos;
+}
+
+/**
+ * Nothing to do until the next interrupt.
+ */
+void sim_wait(void) {
+    uint64_t t = next_event();
+
+    if (running && !in_isr && t != NEVER && t > sim_cycles) {
+        sim_cycles = t;
+    }
+
+    spend(1);
+}
+
+void hal_wdt_reset(void) {
+    spend(1);
+}
+
+void hal_idle(void) {
+    sim_wait();
+}
+
+void hal_stepper_init(void) {
+    spend(4);
+}
+
+/**
+ * A motor moves from one phase to the next one in a step, or holds where it
+ * is when it gets power again.
+ */
+static int8_t motor(int8_t *phase, uint8_t coils) {
+    int8_t p, d;
+
+    for (p = 0; p < 16 && phases[p] != coils; ++p) {
+        // NOOP
+    }
+
+    if (p == 16) {
+        *phase = -1; // off
+        return 0;
+    }
+
+    d = (*phase < 0) ? 0 : ((p - *phase) & 15);
+    *phase = p;
+
+    return (d >= 8) ? d - 16 : d;
+}
+
+void hal_motors(uint8_t x, uint8_t y) {
+    int8_t dx = motor(&phase_x, x);
+    int8_t dy = motor(&phase_y, y);
+
+    spend(2);
+
+    if (dx || dy) {
+        sim.x += dx;
+        sim.y += dy;
+        sim.steps_x += abs(dx);
+        sim.steps_y += abs(dy);
+        sim.last_move = sim_cycles;
+
+        if (pen) {
+            sim.cut += hypot(dx, dy);
+        }
+    }
+}
+
+void hal_pen_up(void) {
+    spend(1);
+    pen = 0;
+}
+
+void hal_pen_down(void) {
+    spend(1);
+
+    if (!pen) {
+        ++sim.pen_downs;
+    }
+
+    pen = 1;
+}
+
+uint8_t hal_pen_is_down(void) {
+    spend(1);
+    return pen;
+}
+
+uint8_t hal_at_home(void) {
+    spend(1);
+    return sim.y <= 0;
+}
+
+void hal_timer_init(void) {
+    spend(20);
+    step_cycles = 100 * 64;
+    next_step = sim_cycles + step_cycles;
+    next_tick = sim_cycles + TICK_CYCLES;
+}
+
+void hal_step_timer(uint8_t slow, uint8_t top) {
+    spend(2);
+    step_cycles = (top + 1) * (slow ? 256 : 64);
+}
+
+uint8_t hal_tick_count(void) {
+    spend(1);
+    return sim_cycles / TCNT2_CYCLES % (TICK_CYCLES / TCNT2_CYCLES);
+}
+
+void hal_pen_pwm(uint16_t duty) {
+    spend(2);
+}
+
+void hal_beeper_on(uint16_t top) {
+    spend(3);
+}
+
+void hal_beeper_off(void) {
+    spend(1);
+}
+
+void hal_uart_init(void) {
+    spend(3);
+    uart_on = 1;
+    schedule_rx();
+}
+
+void hal_uart_baud(uint16_t ubrr, uint8_t x2) {
+    spend(4);
+    byte_cycles = 10 * (x2 ? 8 : 16) * (ubrr + 1);
+}
+
+uint8_t hal_uart_tx_on(void) {
+    spend(1);
+    return uart_on;
+}
+
+uint8_t hal_uart_tx_done(void) {
+    spend(1);
+    return tx_sent && sim_cycles >= tx_free;
+}
+
+void hal_uart_tx_start(void) {
+    spend(1);
+    udrie = 1;
+    schedule_tx();
+}
+
+void hal_uart_tx_stop(void) {
+    spend(1);
+    udrie = 0;
+    next_tx = NEVER;
+}
+
+void hal_uart_tx_clear(void) {
+    spend(2);
+    tx_sent = 0;
+}
+
+/**
+ * A byte to the host. It only looks at XON and XOFF.
+ */
+void hal_uart_put(uint8_t c) {
+    spend(1);
+    tx_free = ((tx_free > sim_cycles) ? tx_free : sim_cycles) + byte_cycles;
+    tx_sent = 1;
+    ++sim.tx_bytes;
+
+    if (c == XOFF && !paused) {
+        paused = 1;
+        ++sim.xoffs;
+    } else if (c == XON && paused) {
+        paused = 0;
+        schedule_rx();
+    }
+}
+
+uint8_t hal_uart_get(void) {
+    spend(1);
+    return rx_data;
+}
+
+void hal_flash_init(void) {
+    spend(4);
+    df_cs = 1;
+    df_sck = df_mosi = 0;
+}
+
+/**
+ * Next byte the chip shifts out.
+ */
+static uint8_t df_next_out(void) {
+    uint8_t c;
+
+    if (df_op == 0xd7 && df_bytes >= 1) {
+        return DF_STATUS | ((sim_cycles >= df_ready) ? 0x80 : 0);
+    }
+
+    if (df_op == 0xe8 && df_bytes >= 8) {
+        // continuous read, after the address and 4 don't care bytes
+        c = df_mem[df_page][df_byte];
+
+        if (++df_byte == DF_PAGE_SIZE) {
+            df_byte = 0;
+            df_page = (df_page + 1) % DF_PAGES;
+        }
+
+        return c;
+    }
+
+    return 0xff;
+}
+
+/**
+ * Byte the chip has shifted in.
+ */
+static void df_next_in(uint8_t c) {
+    if (df_bytes == 0) {
+        df_op = c;
+        df_addr = 0;
+    } else if (df_bytes <= 3) {
+        df_addr = (df_addr << 8) | c;
+
+        if (df_bytes == 3) {
+            df_page = (df_addr >> DF_PAGE_BITS) % DF_PAGES;
+            df_byte = (df_addr & ((1 << DF_PAGE_BITS) - 1)) % DF_PAGE_SIZE;
+        }
+    } else if (df_op == 0x84 || df_op == 0x87) {
+        // buffer write, wraps around in the buffer
+        df_buf[df_op == 0x87][df_byte] = c;
+        df_byte = (df_byte + 1) % DF_PAGE_SIZE;
+    }
+
+    ++df_bytes;
+}
+
+/**
+ * CS high starts programming and erasing.
+ */
+static void df_end(void) {
+    uint16_t i, first;
+    uint8_t *buf;
+
+    if (df_bytes < 4) {
+        return;
+    }
+
+    switch (df_op) {
+        case 0x83: // buffer 1 to page, with erase
+        case 0x86:
+            memcpy(df_mem[df_page], df_buf[df_op == 0x86], DF_PAGE_SIZE);
+            df_ready = sim_cycles + DF_ERASE_PROGRAM;
+            ++sim.flash_programs;
+            break;
+
+        case 0x88: // buffer 1 to page, without erase, bits can only be cleared
+        case 0x89:
+            buf = df_buf[df_op == 0x89];
+
+            for (i = 0; i < DF_PAGE_SIZE; ++i) {
+                df_mem[df_page][i] &= buf[i];
+            }
+
+            df_ready = sim_cycles + DF_PROGRAM;
+            ++sim.flash_programs;
+            break;
+
+        case 0x50: // block erase
+            first = df_page - df_page % DF_BLOCK_PAGES;
+            memset(df_mem[first], 0xff, DF_BLOCK_PAGES * DF_PAGE_SIZE);
+            df_ready = sim_cycles + DF_BLOCK_ERASE;
+            ++sim.flash_erases;
+            break;
+    }
+}
+
+void hal_flash_select(void) {
+    spend(1);
+    df_cs = 0;
+    df_bytes = 0;
+    df_bit = 0;
+    df_op = 0;
+}
+
+void hal_flash_deselect(void) {
+    spend(1);
+
+    if (!df_cs) {
+        df_end();
+    }
+
+    df_cs = 1;
+}
+
+/**
+ * SCK toggles. The chip takes MOSI in, and puts the next bit on MISO, on the
+ * rising edge.
+ */
+void hal_flash_sck(void) {
+    spend(1);
+    df_sck ^= 1;
+
+    if (df_cs || !df_sck) {
+        return;
+    }
+
+    if (!df_bit) {
+        df_out = df_next_out();
+    }
+
+    df_in = (df_in << 1) | df_mosi;
+    df_miso = (df_out >> (7 - df_bit)) & 1;
+
+    if (++df_bit == 8) {
+        df_bit = 0;
+        df_next_in(df_in);
+    }
+}
+
+void hal_flash_mosi_toggle(void) {
+    spend(1);
+    df_mosi ^= 1;
+}
+
+uint8_t hal_flash_mosi(void) {
+    spend(1);
+    return df_mosi ? 0x80 : 0;
+}
+
+uint8_t hal_flash_miso(void) {
+    spend(2);
+    return df_miso;
+}
@@ -0,0 +1,13 @@
+/**
+ * avr/interrupt.h for the host build
+ *
+ * The simulator runs the interrupt handlers (see hal_host.c), it does not
+ * need them switched on and off.
+ */
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define sei() do { } while(0)
+#define cli() do { } while(0)
+
+#endif
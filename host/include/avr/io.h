@@ -0,0 +1,12 @@
+/**
+ * avr/io.h for the host build
+ *
+ * There are no registers on the host. Hardware is reached through hal.h,
+ * and code that still writes a register directly does not build here.
+ */
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <inttypes.h>
+
+#endif
@@ -0,0 +1,29 @@
+/**
+ * avr/pgmspace.h for the host build
+ *
+ * Flash and RAM are the same address space on the host, so the _P functions
+ * are the plain ones and PROGMEM data is read directly.
+ */
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P               const char *
+#define PSTR(s)             (s)
+#define pgm_read_byte(a)    (*(const uint8_t *) (a))
+#define pgm_read_word(a)    (*(const uint16_t *) (a))
+#define pgm_read_dword(a)   (*(const uint32_t *) (a))
+
+#define printf_P            printf
+#define sprintf_P           sprintf
+#define snprintf_P          snprintf
+#define strcpy_P            strcpy
+#define strcmp_P            strcmp
+#define strlen_P            strlen
+#define memcpy_P            memcpy
+
+#endif
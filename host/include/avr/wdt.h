@@ -0,0 +1,9 @@
+/**
+ * avr/wdt.h for the host build, there is no watchdog.
+ */
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+
+#define wdt_reset() do { } while(0)
+
+#endif
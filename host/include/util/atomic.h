@@ -0,0 +1,17 @@
+/**
+ * util/atomic.h for the host build
+ *
+ * The simulator only runs interrupt handlers inside HAL calls (see
+ * hal_host.c), so a block runs once, as it is.
+ */
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+#include <inttypes.h>
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#define ATOMIC_BLOCK(type) for (uint8_t atomic_done_ = 0; !atomic_done_; atomic_done_ = 1)
+
+#endif
@@ -0,0 +1,16 @@
+/**
+ * util/crc16.h for the host build, the C version from the avr-libc manual.
+ */
+#ifndef HOST_UTIL_CRC16_H
+#define HOST_UTIL_CRC16_H
+
+#include <inttypes.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data) {
+    data ^= crc & 0xff;
+    data ^= data << 4;
+
+    return ((((uint16_t) data << 8) | (crc >> 8)) ^ (uint8_t) (data >> 4) ^ ((uint16_t) data << 3));
+}
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * sim.h
+ *
+ * The simulated plotter behind hal_host.c, as seen by the simulator.
+ *
+ * Time is counted in CPU cycles at F_CPU. It moves on by about what the
+ * instructions take at every HAL call, and straight to the next interrupt
+ * in hal_idle() and between two passes of the main loop. Code that does not
+ * touch the hardware takes no time, so the motion time is what the cutter
+ * takes when the main loop keeps up with the motors.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include <inttypes.h>
+
+struct sim_stats {
+    int32_t  x, y; // motor positions in steps, y from the home switch
+    uint32_t steps_x, steps_y; // steps made
+    uint32_t pen_downs;
+    double   cut; // length cut, in steps
+    uint32_t step_isrs; // Timer0 interrupts
+    uint64_t last_move; // cycle of the last step
+    uint64_t last_rx; // cycle of the last byte from the host
+    uint32_t rx_bytes, tx_bytes; // over the UART
+    uint32_t xoffs; // times the host was stopped by XOFF
+    uint32_t flash_programs, flash_erases; // pages programmed, blocks erased
+};
+
+extern uint64_t sim_cycles; // simulated time
+extern struct sim_stats sim;
+
+void     sim_reset(int32_t home_y);
+void     sim_start(void);
+void     sim_send(const uint8_t *data, uint32_t len);
+uint32_t sim_unsent(void);
+void     sim_wait(void);
+
+#endif
@@ -0,0 +1,64 @@
+/**
+ * stubs.c
+ *
+ * The display, keypad and dials for the host build. There is no one to
+ * press STOP, and what goes to the display is dropped.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+
+#include "display.h"
+#include "keypad.h"
+#include "dial.h"
+
+en_language Lang = HPGL;
+
+void display_init(void) {
+}
+
+void display_puts(char *s) {
+}
+
+void display_println(char *s) {
+}
+
+void display_print(char *s) {
+}
+
+void display_update(void) {
+}
+
+void keypad_init(void) {
+}
+
+int keypad_poll(void) {
+    return 0;
+}
+
+void keypad_set_leds(uint16_t mask) {
+}
+
+char keypad_stop_pressed(void) {
+    return 0;
+}
+
+void dial_init(void) {
+}
+
+void dial_poll(void) {
+}
@@ -0,0 +1,217 @@
+/**
+ * arc.c
+ *
+ * Arcs and circles (HPGL AA, AR and CI) are turned into chords here, so the
+ * host can send a whole circle as one short command instead of hundreds of
+ * PD points.
+ *
+ * The start of the arc is taken relative to the center, and scaled to steps
+ * once, per axis, as a vector (ax, bx) along user X and (ay, by) along user
+ * Y. A point at angle t from the start is then
+ *
+ *     x = cx + ax * cos(t) - ay * sin(t)
+ *     y = cy + bx * sin(t) + by * cos(t)
+ *
+ * which still holds when IP/SC scale the two axes differently. cos(t) and
+ * sin(t) are rotated on by the chord angle for every chord, in Q30, so a
+ * chord costs a few integer multiplies and no trigonometry. The floating
+ * point is only used to set up the arc. The last point is worked out in
+ * full, so the arc ends exactly where HPGL says it does.
+ *
+ * The chord angle is the one the host gave, but never finer than what makes
+ * a difference: a chord that leaves the true arc by less than ARC_TOLERANCE
+ * steps is as good as it gets. Without a chord angle the arc gets the
+ * coarsest chords within ARC_TOLERANCE, up to ARC_CHORD_MAX.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <math.h>
+
+#include "configs.h"
+#include "arc.h"
+#include "hpgl.h"
+#include "scale.h"
+
+#define Q30     0x40000000L // 1.0 for cos and sin
+#define VEC_Q   8 // fraction bits of the start vector
+
+static STEPPER_COORD cx, cy; // center
+static int32_t ax, ay, bx, by; // start vector, in steps with VEC_Q fraction bits
+static int32_t c, s; // cos and sin of the angle so far
+static int32_t dc, ds; // cos and sin of the chord angle
+static STEPPER_COORD end_x, end_y;
+static uint16_t left; // chords to go
+static int8_t pen; // CMD_PD or CMD_PU for the chords
+static uint8_t lead; // move to the start first (circle)
+static uint8_t trail; // move back to the center after (circle)
+
+static int32_t mul30(int32_t a, int32_t b) {
+    return ((int64_t) a * b + (Q30 >> 1)) >> 30;
+}
+
+/**
+ * o + p * cq + q * sq, with cq and sq in Q30, rounded to a step.
+ */
+static STEPPER_COORD along(STEPPER_COORD o, int32_t p, int32_t cq, int32_t q, int32_t sq) {
+    return o + (STEPPER_COORD) (((int64_t) p * cq + (int64_t) q * sq + (1LL << (29 + VEC_Q))) >> (30 + VEC_Q));
+}
+
+/**
+ * Set up 'angle' degrees around 'center', starting at (vx, vy) from it, all
+ * in user units. Returns the angle in radians.
+ */
+static double setup(USER_POINT center, double vx, double vy, FIXED angle, FIXED chord) {
+    FIXED xscale, yscale;
+    double sweep = angle / (double) FIXED_ONE;
+    double sx, sy, r, step, want, t;
+
+    userscale(center.x, center.y, &cx, &cy);
+    userscale_factors(&xscale, &yscale);
+
+    sx = xscale / (double) FIXED_ONE * (1 << VEC_Q);
+    sy = yscale / (double) FIXED_ONE * (1 << VEC_Q);
+    ax = lround(vx * sx);
+    ay = lround(vy * sx);
+    bx = lround(vx * sy);
+    by = lround(vy * sy);
+
+    // more than one turn cuts the same circle again
+    if (sweep > 360) {
+        sweep = 360;
+    } else if (sweep < -360) {
+        sweep = -360;
+    }
+
+    // chord angle where the middle of a chord is ARC_TOLERANCE inside the arc
+    r = fmax(hypot(ax, ay), hypot(bx, by)) / (1 << VEC_Q);
+    step = (r > ARC_TOLERANCE) ? 2 * acos(1 - ARC_TOLERANCE / r) * (180 / M_PI) : 180;
+
+    if (chord > 0) {
+        want = chord / (double) FIXED_ONE;
+        if (want > step) {
+            step = (want > 180) ? 180 : want;
+        }
+    } else if (step > ARC_CHORD_MAX) {
+        step = ARC_CHORD_MAX;
+    }
+
+    if (step < ARC_CHORD_MIN) {
+        step = ARC_CHORD_MIN;
+    }
+
+    left = ceil(fabs(sweep) / step);
+    sweep *= M_PI / 180;
+
+    t = left ? sweep / left : 0;
+    c = Q30;
+    s = 0;
+    dc = lround(cos(t) * Q30);
+    ds = lround(sin(t) * Q30);
+
+    end_x = cx + lround((ax * cos(sweep) - ay * sin(sweep)) / (1 << VEC_Q));
+    end_y = cy + lround((bx * sin(sweep) + by * cos(sweep)) / (1 << VEC_Q));
+
+    return sweep;
+}
+
+/**
+ * Start an arc of 'angle' degrees around 'center', counterclockwise for a
+ * positive angle, from the pen position 'from'. 'chord' is the chord angle
+ * in degrees, 0 or less when not given. With the pen up it is a single move
+ * to the end. Returns the end in user units.
+ */
+USER_POINT arc_start(USER_POINT center, USER_POINT from, FIXED angle, FIXED chord, uint8_t draw) {
+    double vx = from.x - center.x;
+    double vy = from.y - center.y;
+    double t = setup(center, vx, vy, angle, chord);
+    USER_POINT end;
+
+    end.x = center.x + lround(vx * cos(t) - vy * sin(t));
+    end.y = center.y + lround(vx * sin(t) + vy * cos(t));
+
+    pen = draw ? CMD_PD : CMD_PU;
+    lead = trail = 0;
+
+    if (!draw && left) {
+        left = 1;
+    }
+
+    return end;
+}
+
+/**
+ * Start an arc of 'angle' degrees on a circle of 'radius' around 'center',
+ * from the point at 'start' degrees. The pen goes up to the start first, and
+ * after the arc back up to the center when 'back' is set, as HPGL CI does
+ * it. Returns the end in user units.
+ */
+USER_POINT arc_circle(USER_POINT center, USER_COORD radius, double start, FIXED angle, FIXED chord, uint8_t back) {
+    double vx = radius * cos(start * (M_PI / 180));
+    double vy = radius * sin(start * (M_PI / 180));
+    double t = setup(center, vx, vy, angle, chord);
+    USER_POINT end = center;
+
+    if (!back) {
+        end.x += lround(vx * cos(t) - vy * sin(t));
+        end.y += lround(vx * sin(t) + vy * cos(t));
+    }
+
+    pen = CMD_PD;
+    lead = 1;
+    trail = back;
+
+    return end;
+}
+
+/**
+ * Next point of the arc, and CMD_PD or CMD_PU for how to get there.
+ * CMD_CONT when the arc is done.
+ */
+int8_t arc_next(STEPPER_COORD *x, STEPPER_COORD *y) {
+    int32_t t;
+
+    if (lead) {
+        lead = 0;
+        *x = along(cx, ax, c, -ay, s);
+        *y = along(cy, by, c, bx, s);
+        return CMD_PU;
+    }
+
+    if (left) {
+        if (--left) {
+            t = mul30(c, dc) - mul30(s, ds);
+            s = mul30(s, dc) + mul30(c, ds);
+            c = t;
+            *x = along(cx, ax, c, -ay, s);
+            *y = along(cy, by, c, bx, s);
+        } else {
+            *x = end_x;
+            *y = end_y;
+        }
+        return pen;
+    }
+
+    if (trail) {
+        trail = 0;
+        *x = cx;
+        *y = cy;
+        return CMD_PU;
+    }
+
+    return CMD_CONT;
+}
@@ -0,0 +1,33 @@
+/**
+ * arc.h
+ *
+ * Arc and circle interpolation for HPGL AA, AR and CI, see arc.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef ARC_H
+#define ARC_H
+
+#include <inttypes.h>
+
+#include "shvars.h"
+
+USER_POINT arc_start(USER_POINT center, USER_POINT from, FIXED angle, FIXED chord, uint8_t draw);
+USER_POINT arc_circle(USER_POINT center, USER_COORD radius, double start, FIXED angle, FIXED chord, uint8_t back);
+int8_t arc_next(STEPPER_COORD *x, STEPPER_COORD *y);
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * bezier.c
+ *
+ * Cubic Bezier curves (HPGL/2 BZ and BR, GP-GL BZ) are turned into chords
+ * here, so the host can send a curve as its four control points instead of
+ * dozens of short lines.
+ *
+ * The curve is walked by adaptive forward differencing. With the curve as
+ * the polynomial B(t) = P0 + c t + b t^2 + a t^3, the first, second and
+ * third differences over a step h give the next point with three adds per
+ * axis. Doubling or halving h is a few shifts and adds as well:
+ *
+ *     double: d1 = 2 d1 + d2    d2 = 4 d2 + 4 d3    d3 = 8 d3
+ *     halve:  d3 = d3 / 8       d2 = d2 / 4 - d3    d1 = (d1 - d2) / 2
+ *
+ * h is 1/2^BEZIER_DEPTH at the finest, and the differences have 3 times
+ * that many fraction bits, so they are exact at every step size and no
+ * error builds up along the curve. The step is halved while a chord would
+ * leave the curve by more than ARC_TOLERANCE steps (about d2 / 8), and
+ * doubled again on the flat parts. The last point is P3 itself.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+
+#include "configs.h"
+#include "bezier.h"
+#include "hpgl.h"
+#include "scale.h"
+
+#define BZ_Q    (3 * BEZIER_DEPTH) // fraction bits of the differences
+#define BZ_END  (1 << BEZIER_DEPTH) // t at the end of the curve
+#define BZ_FLAT ((int64_t) (8 * ARC_TOLERANCE * (1LL << BZ_Q))) // largest d2 of a chord
+
+static STEPPER_COORD x0, y0; // start
+static STEPPER_COORD end_x, end_y;
+static int64_t fx, fy; // point, from the start
+static int64_t d1x, d1y, d2x, d2y, d3x, d3y; // differences over a step
+static uint16_t t; // parameter, in finest steps
+static uint8_t k; // a step is 2^k finest steps
+static int8_t pen; // CMD_PD or CMD_PU for the chords
+static uint8_t lead; // move to the start first
+
+static int64_t abs64(int64_t v) {
+    return (v < 0) ? -v : v;
+}
+
+/**
+ * A chord with second differences d2 and d2 + d3 at its ends stays close
+ * enough to the curve.
+ */
+static uint8_t flat(int64_t ax, int64_t ay, int64_t bx, int64_t by) {
+    return abs64(ax) + abs64(ay) <= BZ_FLAT && abs64(ax + bx) + abs64(ay + by) <= BZ_FLAT;
+}
+
+static void twice(void) {
+    d1x = 2 * d1x + d2x;
+    d1y = 2 * d1y + d2y;
+    d2x = 4 * (d2x + d3x);
+    d2y = 4 * (d2y + d3y);
+    d3x *= 8;
+    d3y *= 8;
+    ++k;
+}
+
+static void half(void) {
+    d3x >>= 3;
+    d3y >>= 3;
+    d2x = (d2x >> 2) - d3x;
+    d2y = (d2y >> 2) - d3y;
+    d1x = (d1x - d2x) >> 1;
+    d1y = (d1y - d2y) >> 1;
+    --k;
+}
+
+/**
+ * Differences of one axis over the finest step, from the control points
+ * relative to the start.
+ */
+static void setup(int32_t p1, int32_t p2, int32_t p3, int64_t *d1, int64_t *d2, int64_t *d3) {
+    int64_t c = 3 * (int64_t) p1;
+    int64_t b = 3 * ((int64_t) p2 - 2 * (int64_t) p1);
+    int64_t a = (int64_t) p3 + 3 * ((int64_t) p1 - p2);
+
+    *d1 = a + b * (1LL << BEZIER_DEPTH) + c * (1LL << (2 * BEZIER_DEPTH));
+    *d2 = 6 * a + 2 * b * (1LL << BEZIER_DEPTH);
+    *d3 = 6 * a;
+}
+
+/**
+ * Start the curve with the control points p[0] to p[3], in user units. With
+ * the pen up it is a single move to the end. With 'move' set, the pen goes
+ * up to p[0] first, otherwise the curve starts at the pen.
+ */
+void bezier_start(const USER_POINT *p, uint8_t draw, uint8_t move) {
+    STEPPER_COORD x1, y1, x2, y2;
+
+    userscale(p[0].x, p[0].y, &x0, &y0);
+    userscale(p[1].x, p[1].y, &x1, &y1);
+    userscale(p[2].x, p[2].y, &x2, &y2);
+    userscale(p[3].x, p[3].y, &end_x, &end_y);
+
+    setup(x1 - x0, x2 - x0, end_x - x0, &d1x, &d2x, &d3x);
+    setup(y1 - y0, y2 - y0, end_y - y0, &d1y, &d2y, &d3y);
+
+    fx = fy = 0;
+    t = 0;
+    k = 0;
+    pen = draw ? CMD_PD : CMD_PU;
+    lead = move;
+
+    if (!draw) {
+        t = BZ_END - 1; // straight to the end
+    }
+}
+
+/**
+ * Next point of the curve, and CMD_PD or CMD_PU for how to get there.
+ * CMD_CONT when the curve is done.
+ */
+int8_t bezier_next(STEPPER_COORD *x, STEPPER_COORD *y) {
+    if (lead) {
+        lead = 0;
+        *x = x0;
+        *y = y0;
+        return CMD_PU;
+    }
+
+    if (t >= BZ_END) {
+        return CMD_CONT;
+    }
+
+    // as long a step as stays flat, on a multiple of its own length
+    while (k < BEZIER_DEPTH && !(t & ((2 << k) - 1)) && flat(4 * (d2x + d3x), 4 * (d2y + d3y), 8 * d3x, 8 * d3y)) {
+        twice();
+    }
+
+    while (k && !flat(d2x, d2y, d3x, d3y)) {
+        half();
+    }
+
+    t += 1 << k;
+
+    if (t >= BZ_END) {
+        *x = end_x;
+        *y = end_y;
+        return pen;
+    }
+
+    fx += d1x;
+    fy += d1y;
+    d1x += d2x;
+    d1y += d2y;
+    d2x += d3x;
+    d2y += d3y;
+
+    *x = x0 + (STEPPER_COORD) ((fx + (1LL << (BZ_Q - 1))) >> BZ_Q);
+    *y = y0 + (STEPPER_COORD) ((fy + (1LL << (BZ_Q - 1))) >> BZ_Q);
+
+    return pen;
+}
@@ -0,0 +1,32 @@
+/**
+ * bezier.h
+ *
+ * Cubic Bezier curves for HPGL/2 BZ and BR and GP-GL BZ, see bezier.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef BEZIER_H
+#define BEZIER_H
+
+#include <inttypes.h>
+
+#include "shvars.h"
+
+void bezier_start(const USER_POINT *p, uint8_t draw, uint8_t move);
+int8_t bezier_next(STEPPER_COORD *x, STEPPER_COORD *y);
+
+#endif
@@ -0,0 +1,324 @@
+/**
+ * bincmd.c
+ *
+ * Binary framed command stream. HPGL "BN;" switches to it, and a BIN_EXIT
+ * record switches back.
+ *
+ * A frame is a sequence number, a list of records and a CRC-CCITT (as in
+ * util/crc16.h, start 0xffff, low byte first), closed by BIN_END. Every
+ * record starts with a varint holding (argument << 3) | type. MOVE and DRAW
+ * have a zigzag encoded dx as argument, and another varint with dy. They are
+ * relative to the previous point, starting from (0, 0), and are in steps,
+ * so they go straight to the stepper queue without any scaling.
+ *
+ * A short line takes 2 to 4 bytes this way, against 10 or more in HPGL.
+ *
+ * Stored jobs (spool.c) use the same records, without the framing. They are
+ * converted from HPGL while they are stored, so cutting one again costs no
+ * parsing or scaling.
+ *
+ * Frames are only executed when the CRC is good and the sequence number is
+ * the one we expect. Those get BIN_FRAME_ACK <seq>. A bad frame, or a gap,
+ * gets BIN_FRAME_NAK <expected seq>, and we drop everything until the sender
+ * has gone back to that frame. Frames we have already executed are only
+ * acknowledged again.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <util/crc16.h>
+
+#include "bincmd.h"
+#include "keypad.h"
+#include "stepper.h"
+#include "planner.h"
+#include "usb.h"
+
+static uint8_t frame[BIN_FRAME_MAX];
+static uint8_t frame_len;
+static uint8_t frame_esc; // last byte was BIN_ESC
+static uint8_t frame_bad; // too long, or bad escape
+static uint8_t expect_seq; // sequence number of the next frame to execute
+static uint8_t nak_sent; // only ask once for a resend
+static STEPPER_COORD bin_x, bin_y; // end of the last MOVE or DRAW
+
+void bincmd_init(void) {
+    frame_len = 0;
+    frame_esc = 0;
+    frame_bad = 0;
+    expect_seq = 0;
+    nak_sent = 0;
+    bincmd_origin();
+}
+
+/**
+ * Make the next MOVE or DRAW relative to (0, 0) again.
+ */
+void bincmd_origin(void) {
+    bin_x = bin_y = 0;
+}
+
+/**
+ * Send ETB or NAK with its sequence number, in one piece so no credit
+ * reply ends up between the two.
+ */
+static void reply(uint8_t code, uint8_t seq) {
+    usb_putpair(code, seq);
+}
+
+/**
+ * Read a varint from a record. Returns 0 when it runs past 'end'.
+ */
+static uint8_t get_varint(const uint8_t **p, const uint8_t *end, uint32_t *v) {
+    uint8_t shift = 0;
+
+    *v = 0;
+
+    while (*p < end && shift < 32) {
+        uint8_t b = *(*p)++;
+
+        *v |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 1;
+        }
+        shift += 7;
+    }
+
+    return 0;
+}
+
+static uint8_t put_varint(uint8_t *out, uint32_t v) {
+    uint8_t n = 0;
+
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+
+    out[n++] = v;
+
+    return n;
+}
+
+static int32_t unzigzag(uint32_t v) {
+    return (v & 1) ? -(int32_t) (v >> 1) - 1 : (int32_t) (v >> 1);
+}
+
+static uint32_t zigzag(int32_t v) {
+    return (v < 0) ? ((uint32_t) ~v << 1) | 1 : (uint32_t) v << 1;
+}
+
+/**
+ * Decode the record at 'p' without running it. Returns its length, or 0 when
+ * it is not complete in the 'bytes' there are. MOVE and DRAW give dx in 'a'
+ * and dy in 'b', the others their argument in 'a'.
+ */
+uint8_t bincmd_decode(const uint8_t *p, uint8_t bytes, uint8_t *type, int32_t *a, int32_t *b) {
+    const uint8_t *start = p;
+    const uint8_t *end = p + bytes;
+    uint32_t v, d;
+
+    if (!get_varint(&p, end, &v)) {
+        return 0;
+    }
+
+    *type = v & 7;
+
+    if (*type == BIN_MOVE || *type == BIN_DRAW) {
+        if (!get_varint(&p, end, &d)) {
+            return 0;
+        }
+
+        *a = unzigzag(v >> 3);
+        *b = unzigzag(d);
+    } else {
+        *a = v >> 3;
+        *b = 0;
+    }
+
+    return p - start;
+}
+
+/**
+ * Execute the record at 'p'. Returns its length, or 0 when it is not complete
+ * in the 'bytes' there are.
+ */
+uint8_t bincmd_record(const uint8_t *p, uint8_t bytes) {
+    uint8_t type, n;
+    int32_t a, b;
+
+    n = bincmd_decode(p, bytes, &type, &a, &b);
+
+    if (!n) {
+        return 0;
+    }
+
+    switch (type) {
+        case BIN_MOVE:
+        case BIN_DRAW:
+            bin_x += a;
+            bin_y += b;
+
+            if (type == BIN_MOVE) {
+                stepper_move(bin_x, bin_y);
+            } else {
+                stepper_draw(bin_x, bin_y);
+            }
+            break;
+
+        case BIN_SPEED:
+            stepper_speed(a);
+            break;
+
+        case BIN_PRESSURE:
+            stepper_pressure(a);
+            break;
+
+        case BIN_EXIT:
+            Lang = HPGL;
+            usb_putc(BIN_EOT);
+            break;
+
+        case BIN_FEED:
+            planner_feed(a);
+            break;
+
+        case BIN_ACCEL:
+            planner_accel_mode(a ? ACCEL_ACCEL : ACCEL_FIXMEDIUM);
+            break;
+
+        case BIN_PAGE:
+            stepper_page();
+            break;
+    }
+
+    return n;
+}
+
+/**
+ * Write a record to 'out', and return its length (at most BIN_RECORD_MAX).
+ * MOVE and DRAW take dx in 'a' and dy in 'b', the others their argument in 'a'.
+ */
+uint8_t bincmd_encode(uint8_t *out, uint8_t type, int32_t a, int32_t b) {
+    uint8_t n;
+
+    if (type == BIN_MOVE || type == BIN_DRAW) {
+        n = put_varint(out, zigzag(a) << 3 | type);
+        return n + put_varint(out + n, zigzag(b));
+    }
+
+    return put_varint(out, (uint32_t) a << 3 | type);
+}
+
+/**
+ * Execute the records of a good frame. Anything after BIN_EXIT is dropped.
+ */
+static void run_frame(const uint8_t *p, const uint8_t *end) {
+    uint8_t n;
+
+    while (p < end && Lang == BINARY) {
+        n = bincmd_record(p, end - p);
+
+        if (!n) {
+            return;
+        }
+
+        p += n;
+    }
+}
+
+/**
+ * A frame has been closed by BIN_END.
+ */
+static void end_frame(void) {
+    uint16_t crc = 0xffff;
+    uint8_t i, seq;
+
+    for (i = 0; i < frame_len; ++i) {
+        crc = _crc_ccitt_update(crc, frame[i]);
+    }
+
+    // the CRC over the frame including its own CRC comes out as 0
+    if (frame_bad || frame_len < 3 || crc != 0) {
+        if (!nak_sent) {
+            reply(BIN_FRAME_NAK, expect_seq);
+            nak_sent = 1;
+        }
+        return;
+    }
+
+    seq = frame[0];
+
+    if (seq == expect_seq) {
+        ++expect_seq;
+        nak_sent = 0;
+        reply(BIN_FRAME_ACK, seq);
+        run_frame(frame + 1, frame + frame_len - 2);
+    } else if ((uint8_t) (expect_seq - seq) <= 128) {
+        reply(BIN_FRAME_ACK, seq); // we had this one already, the ACK got lost
+    } else if (!nak_sent) {
+        reply(BIN_FRAME_NAK, expect_seq); // lost something in between
+        nak_sent = 1;
+    }
+}
+
+/**
+ * Handle the next byte of the stream.
+ */
+void bincmd_byte(uint8_t c) {
+    if (c == BIN_END) {
+        if (frame_len || frame_bad) {
+            end_frame();
+        }
+
+        frame_len = 0;
+        frame_esc = 0;
+        frame_bad = 0;
+        return;
+    }
+
+    if (frame_esc) {
+        frame_esc = 0;
+
+        switch (c) {
+            case BIN_ESC_END:
+                c = BIN_END;
+                break;
+
+            case BIN_ESC_ESC:
+                c = BIN_ESC;
+                break;
+
+            case BIN_ESC_ENQ:
+                c = 0x05;
+                break;
+
+            default:
+                frame_bad = 1;
+                return;
+        }
+    } else if (c == BIN_ESC) {
+        frame_esc = 1;
+        return;
+    }
+
+    if (frame_len < BIN_FRAME_MAX) {
+        frame[frame_len++] = c;
+    } else {
+        frame_bad = 1;
+    }
+}
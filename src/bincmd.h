@@ -0,0 +1,61 @@
+/**
+ * bincmd.h
+ *
+ * Binary framed command stream, see bincmd.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef BINCMD_H
+#define BINCMD_H
+
+#include <inttypes.h>
+
+// framing, SLIP style. ENQ is escaped too, the RX interrupt takes it out of the stream.
+#define BIN_END         0xC0    // end of frame
+#define BIN_ESC         0xDB    // next byte is escaped
+#define BIN_ESC_END     0xDC    // escaped BIN_END
+#define BIN_ESC_ESC     0xDD    // escaped BIN_ESC
+#define BIN_ESC_ENQ     0xDE    // escaped ENQ (0x05)
+
+#define BIN_FRAME_MAX   128     // sequence number, records and CRC
+#define BIN_RECORD_MAX  10      // longest record, two 5 byte varints
+
+// replies, followed by a sequence number
+#define BIN_FRAME_ACK   0x17    // ETB: frame executed (or seen before)
+#define BIN_FRAME_NAK   0x15    // NAK: resend starting at this frame
+#define BIN_EOT         0x04    // back to HPGL
+
+// record types, in the low 3 bits of the first varint of a record
+enum {
+    BIN_MOVE = 0, // zigzag dx, zigzag dy
+    BIN_DRAW, // zigzag dx, zigzag dy
+    BIN_SPEED, // speed setting
+    BIN_PRESSURE, // pen pressure
+    BIN_EXIT, // leave binary mode
+    BIN_FEED, // feed in mm/s, 0 for the speed setting (HPGL VS)
+    BIN_ACCEL, // 0 runs at the fixed rates (HPGL AS)
+    BIN_PAGE, // page feed (HPGL PG)
+};
+
+void bincmd_init(void);
+void bincmd_origin(void);
+void bincmd_byte(uint8_t c);
+uint8_t bincmd_decode(const uint8_t *p, uint8_t bytes, uint8_t *type, int32_t *a, int32_t *b);
+uint8_t bincmd_record(const uint8_t *p, uint8_t bytes);
+uint8_t bincmd_encode(uint8_t *out, uint8_t type, int32_t a, int32_t b);
+
+#endif
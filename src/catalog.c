@@ -0,0 +1,264 @@
+/**
+ * catalog.c
+ *
+ * Catalog of the jobs stored in the dataflash, so they can be cut again
+ * from the keypad without the host.
+ *
+ * The catalog lives in the reserved block in front of the spool ring. It is
+ * a log: every change to a slot is a record added after the last one, with
+ * a plain program (no erase), and the newest record for a slot wins. Only
+ * when the block is full is it erased, and the live slots written back.
+ *
+ * catalog_init() reads the log once, which is a few kB, and keeps the
+ * slots in RAM. Finding a job never has to look at the spool ring itself.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <string.h>
+
+#include "catalog.h"
+#include "flash.h"
+
+#define CAT_MAGIC   0xCB // start of a record, erased flash reads 0xff. 0xCA was for jobs stored as HPGL text
+
+struct cat_record {
+    uint8_t magic;
+    uint8_t slot;
+    struct cat_entry entry;
+};
+
+static struct cat_entry slots[CAT_SLOTS];
+static uint8_t last = CAT_NO_SLOT; // slot of the newest job
+static uint16_t next_page = DF_RESERVED_PAGES; // first page after the newest job
+static uint16_t log_page; // where the next record goes
+static uint8_t log_index;
+
+static uint8_t records_per_page(void) {
+    return flash_page_size() / sizeof(struct cat_record);
+}
+
+/**
+ * First page of the block after a job.
+ */
+static uint16_t page_after(const struct cat_entry *e) {
+    uint16_t pages = (e->length + flash_page_size() - 1) / flash_page_size();
+    uint16_t page = e->page + (pages + DF_BLOCK_PAGES - 1) / DF_BLOCK_PAGES * DF_BLOCK_PAGES;
+
+    if (page >= DF_RESERVED_PAGES + flash_ring_pages()) {
+        page -= flash_ring_pages();
+    }
+
+    return page;
+}
+
+/**
+ * Erase the catalog, and write back the slots that are in use. They go in
+ * the order they are in the ring after next_page, so the newest job is
+ * written last, as it was in the log, and catalog_init() finds it again.
+ */
+static void compact(void) {
+    struct cat_record r;
+    uint16_t written = 0; // bit per slot
+    uint16_t ahead, nearest;
+    uint8_t i, pick;
+
+    flash_erase_block(0);
+    log_page = 0;
+    log_index = 0;
+
+    for (;;) {
+        pick = CAT_NO_SLOT;
+        nearest = 0xffff;
+
+        for (i = 0; i < CAT_SLOTS; ++i) {
+            ahead = flash_ring_distance(next_page, slots[i].page);
+
+            if (slots[i].length && !(written & (1 << i)) && ahead < nearest) {
+                nearest = ahead;
+                pick = i;
+            }
+        }
+
+        if (pick == CAT_NO_SLOT) {
+            return;
+        }
+
+        written |= 1 << pick;
+        r.magic = CAT_MAGIC;
+        r.slot = pick;
+        r.entry = slots[pick];
+        flash_program_bytes(log_page, log_index * sizeof(r), (const uint8_t *) &r, sizeof(r));
+
+        if (++log_index == records_per_page()) {
+            log_index = 0;
+            ++log_page;
+        }
+    }
+}
+
+/**
+ * Add a record for a slot to the log.
+ */
+static void append(uint8_t slot) {
+    struct cat_record r;
+
+    if (log_page == DF_RESERVED_PAGES) {
+        compact(); // this already has the slot in it
+        return;
+    }
+
+    r.magic = CAT_MAGIC;
+    r.slot = slot;
+    r.entry = slots[slot];
+    flash_program_bytes(log_page, log_index * sizeof(r), (const uint8_t *) &r, sizeof(r));
+
+    if (++log_index == records_per_page()) {
+        log_index = 0;
+        ++log_page;
+    }
+}
+
+/**
+ * Read the log into RAM. Anything that doesn't look like a record, before
+ * the end of the log, means the block holds something else, it is erased.
+ */
+void catalog_init(void) {
+    struct cat_record r;
+
+    memset(slots, 0, sizeof(slots));
+    last = CAT_NO_SLOT;
+    next_page = DF_RESERVED_PAGES;
+
+    for (log_page = 0; log_page < DF_RESERVED_PAGES; ++log_page) {
+        flash_start_read(log_page);
+
+        for (log_index = 0; log_index < records_per_page(); ++log_index) {
+            flash_read_block((uint8_t *) &r, sizeof(r));
+
+            if (r.magic != CAT_MAGIC || r.slot >= CAT_SLOTS) {
+                flash_end_read();
+
+                if (r.magic != 0xff) {
+                    memset(slots, 0, sizeof(slots));
+                    last = CAT_NO_SLOT;
+                    next_page = DF_RESERVED_PAGES;
+                    compact();
+                }
+                return;
+            }
+
+            slots[r.slot] = r.entry;
+
+            if (r.entry.length) {
+                last = r.slot;
+                next_page = page_after(&r.entry);
+            } else if (last == r.slot) {
+                last = CAT_NO_SLOT;
+            }
+        }
+
+        flash_end_read();
+    }
+}
+
+/**
+ * The job in a slot, or 0 when it is empty.
+ */
+const struct cat_entry *catalog_get(uint8_t slot) {
+    return (slot < CAT_SLOTS && slots[slot].length) ? &slots[slot] : 0;
+}
+
+/**
+ * Put a job that has just been stored in a slot. Whatever was in the slot
+ * before is forgotten.
+ */
+void catalog_put(uint8_t slot, const struct cat_entry *entry) {
+    slots[slot] = *entry;
+    last = slot;
+    next_page = page_after(entry);
+    append(slot);
+}
+
+/**
+ * A job has been written over these pages of the ring, empty the slots of
+ * the jobs that were there.
+ */
+void catalog_clobber(uint16_t page, uint16_t pages) {
+    uint8_t i;
+
+    for (i = 0; i < CAT_SLOTS; ++i) {
+        struct cat_entry *e = &slots[i];
+        uint16_t used = (e->length + flash_page_size() - 1) / flash_page_size();
+
+        if (e->length && (flash_ring_distance(page, e->page) < pages || flash_ring_distance(e->page, page) < used)) {
+            e->length = 0;
+
+            if (last == i) {
+                last = CAT_NO_SLOT;
+            }
+
+            append(i);
+        }
+    }
+
+    next_page = page + pages;
+
+    if (next_page >= DF_RESERVED_PAGES + flash_ring_pages()) {
+        next_page -= flash_ring_pages();
+    }
+}
+
+/**
+ * Slot of the newest job, CAT_NO_SLOT if it is gone.
+ */
+uint8_t catalog_last(void) {
+    return last;
+}
+
+/**
+ * Where the next job goes: the block after the newest one. The ring is
+ * used in order, so the oldest jobs are written over first.
+ */
+uint16_t catalog_next_page(void) {
+    return next_page;
+}
+
+/**
+ * First page of the job that comes next in the ring after catalog_next_page(),
+ * which is as far as it is safe to erase ahead. FLASH_KEEP_NONE when there
+ * are no jobs.
+ */
+uint16_t catalog_keep_page(void) {
+    uint16_t keep = FLASH_KEEP_NONE;
+    uint16_t best = 0xffff;
+    uint16_t d;
+    uint8_t i;
+
+    for (i = 0; i < CAT_SLOTS; ++i) {
+        if (slots[i].length) {
+            d = flash_ring_distance(next_page, slots[i].page);
+
+            if (d < best) {
+                best = d;
+                keep = slots[i].page;
+            }
+        }
+    }
+
+    return keep;
+}
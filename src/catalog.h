@@ -0,0 +1,50 @@
+/**
+ * catalog.h
+ *
+ * Catalog of stored jobs, see catalog.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <inttypes.h>
+
+#include "shvars.h"
+
+#define CAT_SLOTS       10      // one per digit key
+#define CAT_NAME_LEN    14      // picture name from HPGL BP, not 0 terminated when it is this long
+#define CAT_NO_SLOT     0xff
+
+struct cat_entry {
+    uint16_t page; // first page of the job in the spool ring
+    uint32_t length; // bytes, 0 for an empty slot
+    uint16_t crc; // CRC-CCITT of the job
+    STEPPER_COORD min_x, min_y; // bounding box of the pen moves, in steps
+    STEPPER_COORD max_x, max_y;
+    char name[CAT_NAME_LEN];
+};
+
+void catalog_init(void);
+const struct cat_entry *catalog_get(uint8_t slot);
+void catalog_put(uint8_t slot, const struct cat_entry *entry);
+void catalog_clobber(uint16_t page, uint16_t pages);
+uint8_t catalog_last(void);
+uint16_t catalog_next_page(void);
+uint16_t catalog_keep_page(void);
+
+#endif
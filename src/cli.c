@@ -5,9 +5,11 @@
  *
  * Passes data to the Language parser & interprets the results
  *
+ * Data comes from the host, in HPGL or GP-GL (see lang.c). Jobs stored in
+ * the dataflash (spool.c) are already converted to step records, and go to
+ * the stepper queue directly.
+ *
  * TODO: Re-implement scaling
- * TODO: Implement store - or - cut feature
- * TODO: Implement retrieve and cut feature
  *
  * This file is part of FreeExpression.
  *
@@ -36,6 +38,7 @@
 #include <setjmp.h>
 #include <math.h>
 
+#include "configs.h"
 #include "timer.h"
 #include "cli.h"
 #include "usb.h"
@@ -45,52 +48,170 @@
 #include "hpgl.h"
 #include "display.h"
 #include "keypad.h"
+#include "planner.h"
+#include "bincmd.h"
+#include "spool.h"
+#include "knife.h"
+#include "lang.h"
 
-void cli_poll(void) {
-    STEPPER_COORD dstx, dsty;
-    char          c;
-    int8_t        cmd;
-    uint8_t       labelchar;
+#define CLI_BLOCK 64 // bytes read from the host at a time
 
-    while ((c = (char) usb_getc()) != SERIAL_NO_DATA) {
-        switch (Lang) {
-        case HPGL:
-            cmd = hpgl_char(c, &dstx, &dsty, &labelchar);
-            break;
+static void cli_cmd(int8_t cmd, STEPPER_COORD dstx, STEPPER_COORD dsty) {
+    int8_t pen;
 
-        default:
-            continue; // just consume everything and do nothing
+    switch (cmd) {
+    case CMD_PU:
+        if (dstx >= 0 && dsty >= 0) {
+            // filter out illegal moves
+            stepper_move(dstx, dsty);
         }
+        break;
 
-        switch (cmd) {
-        case CMD_PU:
-            if (dstx >= 0 && dsty >= 0) {
-                // filter out illegal moves
-                stepper_move(dstx, dsty);
+    case CMD_PD:
+        if (dstx >= 0 && dsty >= 0) {
+            // filter out illegal moves
+            stepper_draw(dstx, dsty);
+        }
+        break;
+
+    case CMD_ARCABS:
+    case CMD_BEZIER:
+    case CMD_LB:
+        while ((pen = lang_next(cmd, &dstx, &dsty)) != CMD_CONT) {
+            if (dstx < 0 || dsty < 0) {
+                continue;
             }
-            break;
 
-        case CMD_PD:
-            if (dstx >= 0 && dsty >= 0) {
-                // filter out illegal moves
+            if (pen == CMD_PD) {
                 stepper_draw(dstx, dsty);
+            } else {
+                stepper_move(dstx, dsty);
             }
-            break;
+        }
+        break;
 
-        case CMD_INIT:
-            // 1. Home
-            // 2. Initialize scale and stuff.
-            // Typically happens at start and end of each document;
-            dstx = dsty = 0;
-            stepper_move(dstx, dsty);
+    case CMD_INIT:
+        // 1. Home
+        // 2. Initialize scale and stuff.
+        // Typically happens at start and end of each document;
+        dstx = dsty = 0;
+        planner_feed(0);
+        stepper_move(dstx, dsty);
+        // the blade starts the next job like after power up
+        stepper_get_offset(&dstx, &dsty);
+        knife_reset(dstx, dsty);
+        break;
+
+    case CMD_SEEK0:
+        stepper_move(dstx, dsty);
+        break;
+
+    case CMD_PG:
+        stepper_page();
+        break;
+
+    case CMD_BD:
+        usb_set_baud(dstx);
+        break;
+
+    case CMD_BN:
+        bincmd_init();
+        Lang = BINARY;
+        break;
+
+    case CMD_AS:
+        // AS0 turns acceleration off and runs at the old fixed rates
+        planner_accel_mode(numpad[0] == 0 ? ACCEL_FIXMEDIUM : ACCEL_ACCEL);
+        break;
+
+    case CMD_VS:
+        planner_feed(planner_vs_feed(numpad[0]));
+        break;
+
+    case CMD_FC:
+        knife_set(numpad[0], numpad[1], numpad[2]);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/**
+ * Run a block of data from the host. Point lists come out of the parser a
+ * batch at a time, and go straight to the stepper queue.
+ */
+static void cli_block(const char *buf, uint8_t n) {
+    struct lang_batch b;
+    uint8_t i = 0, k;
+
+    while (i < n) {
+        switch (Lang) {
+        case HPGL:
+        case GPGL:
+            i += lang_block(buf + i, n - i, &b);
+
+            for (k = 0; k < b.points; ++k) {
+                if (b.pen == CMD_PD) {
+                    stepper_draw(b.pt[k].x, b.pt[k].y);
+                } else {
+                    stepper_move(b.pt[k].x, b.pt[k].y);
+                }
+            }
+
+            cli_cmd(b.cmd, b.x, b.y);
             break;
 
-        case CMD_SEEK0:
-            stepper_move(dstx, dsty);
+        case BINARY:
+            // BN switches in the middle of a block
+            bincmd_byte(buf[i++]);
             break;
 
         default:
-            break;
+            return; // just consume everything and do nothing
+        }
+    }
+}
+
+void cli_poll(void) {
+    uint8_t  buf[CLI_BLOCK];
+    uint16_t n, i;
+
+    if (spool_playing()) {
+        if (keypad_stop_pressed()) {
+            spool_stop();
+            return;
+        }
+
+        // the host waits until the stored job is done
+        spool_run();
+        return;
+    }
+
+    // check for data first, in binary mode SERIAL_NO_DATA is a valid byte
+    while (usb_haschar()) {
+        if (spool_storing()) {
+            n = spool_room();
+
+            if (!n) {
+                break; // leave it in the RX buffer until the flash has a buffer free
+            }
+
+            if (n > sizeof(buf)) {
+                n = sizeof(buf);
+            }
+
+            for (i = 0; i < n && usb_haschar(); ++i) {
+                buf[i] = usb_getc();
+            }
+
+            spool_write(buf, i);
+        } else {
+            for (i = 0; i < sizeof(buf) && usb_haschar(); ++i) {
+                buf[i] = usb_getc();
+            }
+
+            cli_block((const char *) buf, i);
         }
     }
 }
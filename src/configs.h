@@ -18,15 +18,38 @@
 // 
 // for prescaler / 256
 #define MOTOR_PACE_SLOW  0x60   //!< both motors start at slow pace
-#define MOTOR_PACE_FASTX 0x20   //!< X axis has smaller steps, goes faster
-#define MOTOR_PACE_FASTY 0x20   //!< Y axis has larger steps, goes slower
+#define MOTOR_PACE_FASTX 0x20   //!< not used any more, the axis speeds are MAX_RATE_X and MAX_RATE_Y
+#define MOTOR_PACE_FASTY 0x20   //!< not used any more
 
-#define ACCEL_STEPS_RAMP 3      //!< ramp up/down each this many steps 
+#define ACCEL_STEPS_RAMP 4      //!< ramp up/down each this many steps (must be power of two)
 #define ACCEL_XTHRESH1   800
 #define ACCEL_XTHRESH2   1600
 
-#define STEPSCALE_X      1.8989 //!< scale coefficient X
-#define STEPSCALE_Y      0.7588 //!< scale coefficient Y
+// Acceleration planner, see planner.c. Rates are in steps per second along the major axis.
+#define ACCEL_TICKS_PER_SEC 250000UL //!< Timer0 step clock, clk/64
+#define ACCEL_START_RATE 272    //!< rate the motors start and stop at without ramping (the old speed 1)
+#define ACCEL_RATE       16000  //!< acceleration in steps/s^2
+#define ACCEL_TABLE_SIZE 256    //!< number of speed steps in the ramp table, at most 256
+#define JUNCTION_DEVIATION 1.0  //!< how far (in steps) a corner may be cut at speed, sets the look-ahead junction speeds
+
+// Physical step size and speed limit of each axis. Both axes are 400 steps per inch
+// (MAX_X and MAX_Y in stepper.h) and run as fast, so the per axis factors in planner.c
+// make no difference on the Expression. They are kept apart so a machine with different
+// drives only needs new numbers here, at most 3 times apart.
+#define STEPS_PER_MM_X   15.748 //!< roller (X) steps per mm
+#define STEPS_PER_MM_Y   15.748 //!< carriage (Y) steps per mm
+#define MAX_RATE_X       5600   //!< fastest X step rate, in steps/s
+#define MAX_RATE_Y       5600   //!< fastest Y step rate, in steps/s
+
+// Feed rate along the path in mm/s. The speed settings 1..9 are spread evenly
+// between these, HPGL VS sets the feed directly.
+#define FEED_MIN         17     //!< feed at speed 1
+#define FEED_MAX         355    //!< feed at speed 9
+
+// Steps per HPGL plotter unit. 1.0 takes plotter units as steps, which is what
+// Inkscape sends when its HPGL resolution is set to 400 dpi.
+#define STEPSCALE_X      1.0    //!< scale coefficient X
+#define STEPSCALE_Y      1.0    //!< scale coefficient Y
 
 #define SLEEP_PERIOD     256    //!< clk/256/256
 #define SLEEP_COUNTER    5      //!< this many periods of inactivity and we really go zZz
@@ -35,6 +58,30 @@
 
 #define SIZE_WHEEL_IS_POTENTIOMETER
 
+#define SPOOL_IDLE_TICKS 50     //!< a stored job ends after this many 25Hz ticks without data (2s)
+#define COPIES_MAX       99     //!< most copies of a stored job cut in one go
+#define COPY_GAP         80     //!< space between copies, in steps (5mm)
+
+// Drag knife compensation (knife.c), the offset and overcut are set with HPGL FC
+#define KNIFE_CORNER     30     //!< bends sharper than this (degrees) get a swivel arc, unless FC says otherwise
+#define KNIFE_ARC_STEP   15     //!< degrees per chord of a swivel arc
+
+// Languages (lang.c)
+#define LANG_IDLE_TICKS  50     //!< the language of the next job is found again after this many 25Hz ticks without data (2s)
+#define GPGL_UNITS_PER_MM 20    //!< GP-GL coordinates per mm (0.05 mm, as the CraftRobo)
+
+// Arcs and circles (arc.c), HPGL AA, AR and CI
+#define ARC_TOLERANCE    0.5    //!< how far (in steps) a chord may leave the arc
+#define ARC_CHORD_MIN    0.5    //!< finest chord angle in degrees, as in HPGL
+#define ARC_CHORD_MAX    45     //!< coarsest chord angle in degrees when the host gives none
+
+// Bezier curves (bezier.c), HPGL/2 BZ and BR, GP-GL BZ. Chords stay within ARC_TOLERANCE too.
+#define BEZIER_DEPTH     10     //!< a curve is cut in at most 2^BEZIER_DEPTH chords
+
+// Text labels (label.c), HPGL LB
+#define LABEL_WIDTH      1.87   //!< character width in mm after IN, or SI without numbers
+#define LABEL_HEIGHT     2.69   //!< cap height in mm after IN
+
 // Enable or disable onboard flash chip debugging.
 // Press key F1 on the keypad to do a flash test.
 #define DEBUG_FLASH
@@ -10,7 +10,9 @@
  *  4   |  !CS  | PB4
  *  8   |  SO   | PB0
  *
- * only contains a test/dump function for now.
+ * Used to spool jobs, see spool.c. Writes go through the two SRAM buffers in
+ * turn: while one is being programmed into main memory, the next page is
+ * filled in the other one.
  *
  * The AT45DB041B is an SPI compatible serial interface Flash memory ideally suited
  * for a wide variety of digital voice-, image-, program code- and data-storage applications.
@@ -36,26 +38,28 @@
  * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
  *
  */
-#include <avr/io.h>
-#include <avr/iom1281.h>
 #include <stdio.h>
 #include <inttypes.h>
 #include <avr/pgmspace.h>
 
+#include "hal.h"
 #include "flash.h"
 #include "display.h"
 
-#define MISO        (1 << 0)
-#define SCK         (1 << 1)
-#define CS          (1 << 4)
-#define MOSI        (1 << 7)
-#define cs_low()    do { PORTB &= ~CS; }   while(0)
-#define cs_high()   do { PORTB |=  CS; }   while(0)
-#define mosi_low()  do { PORTB &= ~MOSI; } while(0)
-#define mosi_high() do { PORTB |=  MOSI; } while(0)
-#define sck_low()   do { PORTB &= ~SCK; }  while(0)
-#define sck_high()  do { PORTB |=  SCK; }  while(0)
-#define get_miso()  (PINB & 1)
+#define cs_low()      hal_flash_select()
+#define cs_high()     hal_flash_deselect()
+#define get_miso()    hal_flash_miso()
+#define get_mosi()    hal_flash_mosi()
+
+// the pins are toggled, see hal.h. SCK idles low.
+#define sck_toggle()  hal_flash_sck()
+#define mosi_toggle() hal_flash_mosi_toggle()
+
+// one bit out: 't' has a 1 where MOSI has to change from the previous bit
+#define send_bit(t, mask) do { if ((t) & (mask)) { mosi_toggle(); } sck_toggle(); sck_toggle(); } while(0)
+
+// one bit in, sampled while SCK is high. The chip changes SO after the falling edge.
+#define read_bit(data, mask) do { sck_toggle(); if (get_miso()) { (data) |= (mask); } sck_toggle(); } while(0)
 
 #define DF_READY_FLAG 0x80 // Ready/busy status is indicated using bit 7 of the status register. 0x80 = b10000000
 #define DF_STATUS     0xd7 // Status byte
@@ -73,7 +77,7 @@
 // Write operations.
 #define DF_WRITEBUF1   0x84 // Buffer 1 Write
 #define DF_WRITEPAGE1  0x88 // Buffer 1 to Main Memory Page Program without Built-in Erase
-#define DF_WRITEPAGE2E 0x86 // Buffer 1 to Main Memory Page Program with Built-in Erase
+#define DF_WRITEPAGE1E 0x83 // Buffer 1 to Main Memory Page Program with Built-in Erase
 #define DF_WRITEBUF2   0x87 // Buffer 2 Write
 #define DF_WRITEPAGE2  0x89 // Buffer 2 to Main Memory Page Program without Built-in Erase
 #define DF_WRITEPAGE2E 0x86 // Buffer 2 to Main Memory Page Program with Built-in Erase
@@ -86,7 +90,6 @@
 
 const uint8_t DF_pagebits[] PROGMEM  = {9, 9, 9, 9, 9, 10, 10, 11};
 const uint16_t DF_pagesize[] PROGMEM = {264, 264, 264, 264, 264, 528, 528, 1056};
-#define DF_RESERVED_PAGES 0 // we will reserve the first two pages for status info
 
 // Always start at first page past reserved area.
 static unsigned int  pageCounter  = DF_RESERVED_PAGES;
@@ -95,10 +98,21 @@ static unsigned char pageBits     = 0;
 static unsigned int  pageSize     = 264; // init method will figure this out for us
 static unsigned int  maxPages     = 2048; // init method will figure this out for us
 static unsigned char bufferNumber = 1;
+static unsigned int  pagesLeft    = 0; // pages the write can still fill before it runs into itself
+static unsigned char fillOpen     = 0; // buffer write command in progress, CS is low
+static unsigned char pendingBuffer = 0; // full buffer waiting for the chip, 0 for none
+static unsigned int  pendingPage  = 0; // page it goes to
+static unsigned char writing      = 0; // between flash_start_write() and flash_flush()
+static unsigned char reading      = 0; // continuous read in progress, CS is low
+static unsigned int  readPage     = 0;
+static unsigned int  readByte     = 0;
+static unsigned int  eraseStart   = DF_RESERVED_PAGES; // first page erased ahead
+static unsigned int  eraseDone    = 0; // pages erased from there
+static unsigned int  eraseTotal   = 0; // pages to erase from there
 
 /**
  * As it is now, the flash code implements methods to read and write bytes/pages/buffers
- * It is used by the serial routine to buffer in all the incoming data, so that
+ * It is used by the spooler to buffer in all the incoming data, so that
  * processing can be delayed.  Once the cutting starts, the buffer is then read back
  * by the hgpl system and parsed.
  **/
@@ -106,34 +120,37 @@ static unsigned char bufferNumber = 1;
 /**
  * write a single byte to flash chip
  * not to be confused with writing data to the buffers
+ *
+ * Unrolled, MSB first. Each bit is an optional MOSI toggle and two SCK
+ * toggles, about 4 cycles, so the bits go out at close to 4 Mbit/s.
  */
 static void flash_send_byte(uint8_t data) {
-    char i;
-
-    for (i = 0; i < 8; ++i) {
-        if (data & 0x80) {
-            mosi_high();
-        } else {
-            mosi_low();
-        }
-
-        sck_high();
-        data <<= 1;
-        sck_low();
-    }
+    uint8_t t = data ^ ((data >> 1) | get_mosi()); // bit 7 compares with the pin as it is
+
+    send_bit(t, 0x80);
+    send_bit(t, 0x40);
+    send_bit(t, 0x20);
+    send_bit(t, 0x10);
+    send_bit(t, 0x08);
+    send_bit(t, 0x04);
+    send_bit(t, 0x02);
+    send_bit(t, 0x01);
 }
 
 /*
- * read a single byte from flash chip
+ * read a single byte from flash chip, unrolled like flash_send_byte()
  */
 static uint8_t flash_read_byte(void) {
     uint8_t data = 0;
-    char i;
-    for (i = 0; i < 8; ++i) {
-        sck_high();
-        data = (data << 1) + get_miso();
-        sck_low();
-    }
+
+    read_bit(data, 0x80);
+    read_bit(data, 0x40);
+    read_bit(data, 0x20);
+    read_bit(data, 0x10);
+    read_bit(data, 0x08);
+    read_bit(data, 0x04);
+    read_bit(data, 0x02);
+    read_bit(data, 0x01);
 
     return data;
 }
@@ -162,128 +179,424 @@ static void flash_wait_ready(void) {
     cs_high();
 }
 
-static void flash_write_to_buffer(unsigned char bufferNo, unsigned int bufferAdr, uint16_t bytes, uint8_t *data) {
+/**
+ * send a page and byte address. The page number sits above the pageBits
+ * bits of the byte address, padded to 24 bits.
+ */
+static void flash_send_addr(uint16_t pageNo, uint16_t byteNo) {
+    uint32_t addr = ((uint32_t) pageNo << pageBits) | byteNo;
 
+    flash_send_byte(addr >> 16);
+    flash_send_byte(addr >> 8);
+    flash_send_byte(addr);
+}
+
+/**
+ * read the Flash status byte
+ */
+static uint8_t flash_read_status(void) {
+    uint8_t status;
     cs_low();
+    flash_send_byte(DF_STATUS);
+    status = flash_read_byte();
     cs_high();
+    return status;
+}
 
-    if (1 == bufferNo) {
-        flash_send_byte(DF_WRITEBUF1);
-        flash_send_byte((unsigned char) (bufferAdr >> (16 - pageBits)));
-        flash_send_byte((unsigned char) (bufferAdr << (pageBits - 8)));
-        flash_send_byte(0x00);
-    } else {
-        flash_send_byte(DF_WRITEBUF2);
-        flash_send_byte((unsigned char) (bufferAdr >> (16 - pageBits)));
-        flash_send_byte((unsigned char) (bufferAdr << (pageBits - 8)));
-        flash_send_byte(0x00);
+static uint8_t flash_ready(void) {
+    return flash_read_status() & DF_READY_FLAG;
+}
+
+/**
+ * next page in the ring of pages past the reserved area
+ */
+static unsigned int flash_next_page(unsigned int pageNo) {
+    return (++pageNo == maxPages) ? DF_RESERVED_PAGES : pageNo;
+}
+
+/**
+ * true when a page is in the part that has been erased ahead
+ */
+static uint8_t flash_erased(unsigned int pageNo) {
+    return flash_ring_distance(eraseStart, pageNo) < eraseDone;
+}
+
+/**
+ * program the full buffer into its page, as soon as the chip is free. Pages
+ * that have been erased ahead take 2 to 4ms, others are erased first, which
+ * takes up to 35ms. Returns 1 when nothing is left waiting.
+ */
+static uint8_t flash_program_pending(void) {
+    if (!pendingBuffer) {
+        return 1;
+    }
+
+    if (!flash_ready()) {
+        return 0;
     }
 
     cs_low();
-    cs_high();
-    flash_wait_ready();
+
+    if (flash_erased(pendingPage)) {
+        flash_send_byte((1 == pendingBuffer) ? DF_WRITEPAGE1 : DF_WRITEPAGE2);
+    } else {
+        flash_send_byte((1 == pendingBuffer) ? DF_WRITEPAGE1E : DF_WRITEPAGE2E);
+    }
+
+    flash_send_addr(pendingPage, 0);
+    cs_high(); // programming starts here
+
+    pendingBuffer = 0;
+
+    return 1;
+}
+
+/**
+ * hand the buffer that has just been filled over to be programmed, and go
+ * on with the next page in the other buffer
+ */
+static void flash_next_buffer(void) {
+    pendingBuffer = bufferNumber;
+    pendingPage = pageCounter;
+    bufferNumber = (bufferNumber == 1) ? 2 : 1;
+    pageCounter = flash_next_page(pageCounter);
+    byteCounter = 0;
+    flash_program_pending();
 }
 
-static void flash_buffer_to_page(unsigned char bufferNo, unsigned int pageNo) {
+/**
+ * number of bytes flash_write_block() takes right now without waiting: the
+ * rest of the page being filled, or 0 while both buffers are full, one being
+ * programmed and the other one waiting for that to end. When the flash is
+ * full there is room for anything, it is dropped.
+ */
+uint16_t flash_write_room(void) {
+    if (!pagesLeft) {
+        return pageSize;
+    }
 
+    return flash_program_pending() ? pageSize - byteCounter : 0;
 }
-// sequentially writes a byte to the data flash
-// always starts at byte 0, page 2
 
-uint8_t flash_write_next_byte(uint8_t data) {
+/**
+ * true when the write has run into the end of the ring, and everything
+ * after that is dropped
+ */
+uint8_t flash_write_full(void) {
+    return !pagesLeft;
+}
+
+/**
+ * sequentially writes bytes to the data flash, starting at the page given
+ * to flash_start_write(). Never waits for the chip, and returns the number
+ * of bytes taken, which is less than asked when there was no buffer free or
+ * the flash is full.
+ *
+ * The buffer write command stays open while a page is filled, so every
+ * byte after the first only costs its own 8 clocks. When the buffer is full
+ * it is handed over to be programmed, and the next page goes into the other
+ * buffer.
+ */
+uint16_t flash_write_block(const uint8_t *data, uint16_t bytes) {
+    uint16_t done = 0;
+    uint16_t n;
+
     // make sure we don't over flow page count
-    if (pageCounter >= maxPages) {
-        return 0; // no bytes written
-    }
+    while (bytes && pagesLeft && flash_program_pending()) {
+        if (!fillOpen) {
+            cs_low();
+            flash_send_byte((1 == bufferNumber) ? DF_WRITEBUF1 : DF_WRITEBUF2);
+            flash_send_addr(0, byteCounter);
+            fillOpen = 1;
+        }
 
-    // write the buffer to the flash, move to next page
-    if (byteCounter == pageSize) {
-        flash_buffer_to_page(bufferNumber, pageCounter);
-        bufferNumber = (bufferNumber == 1) ? 2 : 1;
-        ++pageCounter;
-        byteCounter = 0;
-    } else {
-        flash_write_to_buffer(bufferNumber, byteCounter, 1, &data);
+        n = pageSize - byteCounter;
+
+        if (n > bytes) {
+            n = bytes;
+        }
+
+        bytes -= n;
+        done += n;
+        byteCounter += n;
+
+        while (n--) {
+            flash_send_byte(*data++);
+        }
+
+        // write the buffer to the flash, move to next page
+        if (byteCounter == pageSize) {
+            cs_high();
+            fillOpen = 0;
+            --pagesLeft;
+            flash_next_buffer();
+        }
     }
 
-    return 1; // one byte written ok
+    return done;
 }
 
 /**
- * read the Flash status byte
+ * read bytes of the continuous read started by flash_start_read()
  */
-static uint8_t flash_read_status(void) {
-    uint8_t status;
+void flash_read_block(uint8_t *data, uint16_t bytes) {
+    uint16_t n;
+
+    while (bytes) {
+        n = pageSize - readByte;
+
+        if (n > bytes) {
+            n = bytes;
+        }
+
+        bytes -= n;
+        readByte += n;
+
+        while (n--) {
+            *data++ = flash_read_byte();
+        }
+
+        // the continuous read wraps to page 0, we want the first page past the reserved ones
+        if (readByte == pageSize) {
+            readByte = 0;
+
+            if (++readPage == maxPages) {
+                flash_start_read(DF_RESERVED_PAGES);
+            }
+        }
+    }
+}
+
+/**
+ * Initializes the continuous read operation at a byte of a page. A buffer
+ * being filled by flash_write_block() is left as it is, the write opens it
+ * again where it was.
+ */
+static void start_read(unsigned int pageNo, uint16_t byte) {
+    uint8_t i;
+
+    cs_high();
+    fillOpen = 0;
+    flash_wait_ready(); // the last page may still be programming
+
     cs_low();
-    flash_send_byte(DF_STATUS);
-    status = flash_read_byte();
+    flash_send_byte(DF_CONTREAD);
+    flash_send_addr(pageNo, byte);
+
+    for (i = 0; i < 4; ++i) {
+        flash_send_byte(0x00); // don't care bytes
+    }
+
+    readPage = pageNo;
+    readByte = byte;
+    reading = 1;
+}
+
+/**
+ * Initializes the continuous read operation at a page. Bytes can then be
+ * read with flash_read_block() until flash_end_read(). Reads go on
+ * past the last page to the first one after the reserved area.
+ */
+void flash_start_read(unsigned int pageNo) {
+    start_read(pageNo, 0);
+}
+
+/**
+ * Start a read 'offset' bytes into the data that starts at a page, going
+ * around the ring like flash_read_block().
+ */
+void flash_start_read_at(unsigned int pageNo, uint32_t offset) {
+    uint32_t page = pageNo + offset / pageSize;
+
+    while (page >= maxPages) {
+        page -= maxPages - DF_RESERVED_PAGES;
+    }
+
+    start_read(page, offset % pageSize);
+}
+
+void flash_end_read(void) {
     cs_high();
-    return status;
+    reading = 0;
 }
 
 /**
- * write a command, consisting of 8 cmd bits, and 24 address bits.
+ * Start writing at a page, which should be the first page of a block.
  */
-static void flash_write_cmd(uint8_t cmd, uint32_t addr) {
-    cs_low();
-    flash_send_byte(cmd);
-    flash_send_byte(addr >> 24);
-    flash_send_byte(addr >> 16);
-    flash_send_byte(addr >> 8);
+void flash_start_write(unsigned int pageNo) {
+    cs_high();
+    pageCounter = pageNo;
+    byteCounter = 0;
+    pagesLeft = maxPages - DF_RESERVED_PAGES;
+    writing = 1;
 }
 
-uint8_t flash_read_next_byte(void) {
-    if (byteCounter == maxPages * pageSize) {
+/**
+ * Program the last, partly filled page and wait until everything is in
+ * main memory. Returns the page the next write should start at, the first
+ * page of the next block, so erasing that block ahead leaves this data alone.
+ */
+unsigned int flash_flush(void) {
+    if (fillOpen) {
         cs_high();
-        return 0x00;
+        fillOpen = 0;
+    }
+
+    while (!flash_program_pending()) {
+        // NOOP.
     }
 
-    return flash_read_byte();
+    if (byteCounter && pagesLeft) {
+        flash_next_buffer();
+
+        while (!flash_program_pending()) {
+            // NOOP.
+        }
+    }
+
+    flash_wait_ready();
+    writing = 0;
+
+    while (pageCounter % DF_BLOCK_PAGES) {
+        pageCounter = flash_next_page(pageCounter);
+    }
+
+    return pageCounter;
 }
 
 /**
- * Initializes the continuous read operation
+ * Erase blocks from a page onwards in the background, up to the block
+ * holding page 'keep', or all the way around with FLASH_KEEP_NONE. Pages
+ * written after this go in with a plain program instead of an erase and
+ * program, which is what makes the writer keep up with the serial port.
  */
-void flash_start_read(uint32_t offset) {
-    flash_write_cmd(DF_CONTREAD, offset);
+void flash_erase_ahead(unsigned int pageNo, unsigned int keep) {
+    eraseStart = pageNo;
+    eraseDone = 0;
+    eraseTotal = maxPages - DF_RESERVED_PAGES;
+
+    if (keep != FLASH_KEEP_NONE) {
+        keep -= keep % DF_BLOCK_PAGES;
+        eraseTotal = flash_ring_distance(pageNo, keep);
+    }
 }
 
-void flash_start_write(uint32_t offset) {
+/**
+ * Called from the main loop. Starts a page program that had to wait for the
+ * chip, or erases the next block ahead when nothing is being written. Never
+ * waits for the chip.
+ */
+void flash_poll(void) {
+    unsigned int pageNo;
+
+    if (reading || fillOpen || !flash_program_pending()) {
+        return;
+    }
 
+    if (writing || eraseDone >= eraseTotal || !flash_ready()) {
+        return;
+    }
+
+    pageNo = eraseStart + eraseDone;
+
+    if (pageNo >= maxPages) {
+        pageNo -= maxPages - DF_RESERVED_PAGES;
+    }
+
+    cs_low();
+    flash_send_byte(DF_BLOCKERASE);
+    flash_send_addr(pageNo, 0);
+    cs_high(); // erasing starts here, it takes up to 75ms
+
+    eraseDone += DF_BLOCK_PAGES;
 }
 
-void flash_flush(void) {
+/**
+ * Program bytes into an erased part of a page, leaving the rest of it as it
+ * is. Buffer 1 is filled with 0xff around the data: programming without
+ * erase can only clear bits, so those bytes don't change anything. Waits
+ * for the chip, and is not to be used while spooling.
+ */
+void flash_program_bytes(unsigned int pageNo, uint16_t offset, const uint8_t *data, uint16_t bytes) {
+    uint16_t i;
+
+    flash_wait_ready();
+
+    cs_low();
+    flash_send_byte(DF_WRITEBUF1);
+    flash_send_addr(0, 0);
+
+    for (i = 0; i < pageSize; ++i) {
+        flash_send_byte((i >= offset && i < offset + bytes) ? data[i - offset] : 0xff);
+    }
+
     cs_high();
-    pageCounter = DF_RESERVED_PAGES;
-    byteCounter = 0;
+
+    cs_low();
+    flash_send_byte(DF_WRITEPAGE1);
+    flash_send_addr(pageNo, 0);
+    cs_high();
+
+    flash_wait_ready();
+}
+
+/**
+ * Erase the block holding a page, and wait for it.
+ */
+void flash_erase_block(unsigned int pageNo) {
+    flash_wait_ready();
+
+    cs_low();
+    flash_send_byte(DF_BLOCKERASE);
+    flash_send_addr(pageNo, 0);
+    cs_high();
+
+    flash_wait_ready();
+}
+
+unsigned int flash_page_size(void) {
+    return pageSize;
+}
+
+/**
+ * Number of pages from one page in the ring to another one.
+ */
+unsigned int flash_ring_distance(unsigned int from, unsigned int to) {
+    return (to >= from) ? to - from : to + maxPages - DF_RESERVED_PAGES - from;
+}
+
+unsigned int flash_ring_pages(void) {
+    return maxPages - DF_RESERVED_PAGES;
 }
 
 void flash_init(void) {
-    DDRB |= MOSI | SCK | CS;
+    hal_flash_init(); // CS high, and SCK low, the bit engine toggles it
     uint8_t status = flash_read_status();
     unsigned char index_copy;
     index_copy = ((status & 0x38) >> 3); //get the size info from status register
     pageBits = pgm_read_byte(&DF_pagebits[index_copy]); //get number of internal page address bits from look-up table
     pageSize = pgm_read_word(&DF_pagesize[index_copy]); //get the size of the page (in bytes)
+
+    if (status & 0x01) {
+        // configured for "power of 2" pages, 256 instead of 264 bytes
+        --pageBits;
+        pageSize = 1 << pageBits;
+    }
 }
 
 void flash_test(void) {
     display_puts("Flash test");
     flash_init();
-    flash_start_read(4);
+    flash_start_read(0);
     char c[20];
 
     int i = 0;
-    for (i = 0; i < 4; ++i) {
-        c[0] = flash_read_next_byte();
-    }
     for (i = 0; i < 20; ++i) {
         c[i] = 0x00;
     }
-    for (i = 0; i < 10; ++i) {
-        c[i] = flash_read_next_byte();
-    }
+    flash_read_block((uint8_t *) c, 10);
 
+    flash_end_read();
     display_puts(c);
     flash_init();
 }
@@ -30,12 +30,27 @@
 extern unsigned char PageBits;
 extern unsigned int  PageSize;
 
-uint8_t  flash_read_next_byte(void);
-void     flash_start_read(uint32_t offset);
-void     flash_start_write(uint32_t offset);
+#define DF_BLOCK_PAGES    8 // pages per erase block
+#define DF_RESERVED_PAGES 8 // one erase block for the job catalog (catalog.c), the ring of spooled data starts after it
+#define FLASH_KEEP_NONE 0xffff // flash_erase_ahead() may go all the way around
+
+void     flash_start_read(unsigned int pageNo);
+void     flash_start_read_at(unsigned int pageNo, uint32_t offset);
+void     flash_read_block(uint8_t *data, uint16_t bytes);
+void     flash_end_read(void);
+void     flash_start_write(unsigned int pageNo);
+uint16_t flash_write_room(void);
+uint8_t  flash_write_full(void);
+uint16_t flash_write_block(const uint8_t *data, uint16_t bytes);
+unsigned int flash_flush(void);
+void     flash_erase_ahead(unsigned int pageNo, unsigned int keep);
+void     flash_poll(void);
+void     flash_program_bytes(unsigned int pageNo, uint16_t offset, const uint8_t *data, uint16_t bytes);
+void     flash_erase_block(unsigned int pageNo);
+unsigned int flash_page_size(void);
+unsigned int flash_ring_distance(unsigned int from, unsigned int to);
+unsigned int flash_ring_pages(void);
 void     flash_init(void);
-uint8_t  flash_write_next_byte(uint8_t data);
 void     flash_test(void);
-void     flash_flush(void);
 
 #endif
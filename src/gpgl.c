@@ -0,0 +1,490 @@
+/**
+ * gpgl.c
+ *
+ * GP-GL, the language of Graphtec cutters and the ones built like them. The
+ * parser turns it into the same commands as hpgl_char(), so cli.c and the job
+ * store handle both languages the same way. Coordinates are in GP-GL units
+ * of 1/GPGL_UNITS_PER_MM mm, which are set up as the user units of scale.c,
+ * so arcs and everything after the parser work as they do for HPGL.
+ *
+ * A command is one or two characters, with its numbers after it separated
+ * by ','. It ends at the terminator (ETX, or CR/LF), or where the next
+ * command starts. These are done:
+ *
+ *   M, D, O, E       move, draw, relative move, relative draw (point lists)
+ *   MP, DP, OP, EP   the same in polar coordinates
+ *   Y, _             curve and relative curve, cut straight through the points
+ *   W, ], WP         arc, relative arc, circle through three points
+ *   BZ               Bezier curve, see bezier.c
+ *   H                home
+ *   ^                origin offset
+ *   !                speed, 1 to 10 of the top speed, or 100 + cm/s
+ *   FC               blade offset in 0.01 mm, see knife.c
+ *   F                chart feed, feeds out the page like HPGL PG
+ *   ESC EOT          reset
+ *
+ * Everything else is skipped. Lists put out a point as soon as it is
+ * complete, so a long D never has to fit anywhere.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <math.h>
+
+#include "configs.h"
+#include "gpgl.h"
+#include "hpgl.h"
+#include "number.h"
+#include "scale.h"
+#include "arc.h"
+#include "bezier.h"
+
+#define STEPS_PER_UNIT  ((FIXED) (STEPS_PER_MM_X / GPGL_UNITS_PER_MM * FIXED_ONE + 0.5))
+#define GPGL_PAD        10 // most numbers kept for a command
+#define ETX             003
+#define ESC             033
+#define EOT             004
+
+enum {
+    G_CMD, // expect a command
+    G_CMD2, // expect the second letter of a command, or its numbers
+    G_ARGS, // numbers of a command
+    G_SKIP, // numbers of a command that is not done
+    G_TEXT, // text, up to the terminator
+    G_ESC, // after ESC
+};
+
+static uint8_t state;
+static char op, op2; // command letters, op2 is 0 for one letter commands
+static uint8_t list; // command is a list of points
+static uint8_t curve; // Y or _, which start with open (0) or closed
+static int8_t closed; // -1 until the first number of a curve is in
+static int8_t queued; // output for the next character, when one gave two
+static STEPPER_COORD queued_x, queued_y;
+static double pad[GPGL_PAD];
+static uint8_t idx; // numbers in pad
+static uint8_t in_num; // characters of a number seen
+static double at_x, at_y; // pen position in units, with what the rounding of user_loc loses
+static double start_x, start_y; // start of a curve
+
+void gpgl_init(void) {
+    state = G_CMD;
+    queued = CMD_CONT;
+    at_x = at_y = 0;
+    user_loc.x = user_loc.y = 0;
+    translate_units(STEPS_PER_UNIT, 0, 0);
+}
+
+/**
+ * True between commands, where a new job can start.
+ */
+uint8_t gpgl_between(void) {
+    return state == G_CMD && queued == CMD_CONT;
+}
+
+static uint8_t is_terminator(char c) {
+    return c == ETX || c == '\r' || c == '\n';
+}
+
+static uint8_t is_number(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.';
+}
+
+static FIXED to_fixed(double v) {
+    return (FIXED) (v * FIXED_ONE);
+}
+
+static USER_POINT user_point(double px, double py) {
+    USER_POINT p;
+
+    p.x = lround(px);
+    p.y = lround(py);
+
+    return p;
+}
+
+/**
+ * Pen to (px, py), in units.
+ */
+static int8_t go(double px, double py, int8_t pen, STEPPER_COORD *x, STEPPER_COORD *y) {
+    at_x = px;
+    at_y = py;
+    user_loc = user_point(px, py);
+    userscale(user_loc.x, user_loc.y, x, y);
+
+    return pen;
+}
+
+/**
+ * A pair of a point list is in pad[0] and pad[1].
+ */
+static int8_t list_point(STEPPER_COORD *x, STEPPER_COORD *y) {
+    int8_t pen = (op == 'M' || op == 'O') ? CMD_PU : CMD_PD;
+    double px = pad[0], py = pad[1];
+
+    if (op2 == 'P') {
+        // r, theta
+        px = pad[0] * cos(pad[1] * (M_PI / 180));
+        py = pad[0] * sin(pad[1] * (M_PI / 180));
+    }
+
+    if (op == 'O' || op == 'E' || op == '_') {
+        px += at_x;
+        py += at_y;
+    }
+
+    return go(px, py, pen, x, y);
+}
+
+/**
+ * Arc of radius r around (cx, cy), from angle a0 to a1, with the chord angle
+ * in pad[d] when there is one.
+ */
+static int8_t arc(double cx, double cy, double r, double a0, double a1, uint8_t d) {
+    USER_POINT end = arc_circle(user_point(cx, cy), lround(r), a0, to_fixed(a1 - a0), (idx > d) ? to_fixed(pad[d]) : 0, 0);
+
+    at_x = end.x;
+    at_y = end.y;
+    user_loc = end;
+
+    return CMD_ARCABS;
+}
+
+/**
+ * Circle through three points, starting at the first: the center is where
+ * the perpendicular bisectors of two of the sides meet.
+ */
+static int8_t circle3(void) {
+    double bx = pad[2] - pad[0], by = pad[3] - pad[1];
+    double cx = pad[4] - pad[0], cy = pad[5] - pad[1];
+    double d = 2 * (bx * cy - by * cx);
+    double ux, uy, a;
+
+    if (fabs(d) < 1e-6) {
+        return CMD_ERR; // on a line
+    }
+
+    ux = (cy * (bx * bx + by * by) - by * (cx * cx + cy * cy)) / d;
+    uy = (bx * (cx * cx + cy * cy) - cx * (bx * bx + by * by)) / d;
+    a = atan2(-uy, -ux) * (180 / M_PI);
+
+    return arc(pad[0] + ux, pad[1] + uy, hypot(ux, uy), a, a + 360, 6);
+}
+
+/**
+ * Bezier curve through the control points in pad[1] to pad[8]. pad[0] and
+ * the resolution after the points are not used, the chords are worked out
+ * in bezier.c. The pen only goes up when the curve does not start where it
+ * is, so a path of curves is cut in one go.
+ */
+static int8_t bezier(void) {
+    USER_POINT p[4];
+    uint8_t i;
+
+    for (i = 0; i < 4; ++i) {
+        p[i] = user_point(pad[2 * i + 1], pad[2 * i + 2]);
+    }
+
+    bezier_start(p, 1, p[0].x != user_loc.x || p[0].y != user_loc.y);
+
+    at_x = pad[7];
+    at_y = pad[8];
+    user_loc = p[3];
+
+    return CMD_BEZIER;
+}
+
+/**
+ * The command has all its numbers. Point lists are done by then.
+ */
+static int8_t run(STEPPER_COORD *x, STEPPER_COORD *y) {
+    switch (op) {
+        case 'H':
+            return go(0, 0, CMD_PU, x, y);
+
+        case 'W':
+            if (op2 == 'P') {
+                return (idx >= 6) ? circle3() : CMD_ERR;
+            }
+
+            // x0, y0, r1, r2, theta1, theta2 [, d], a spiral (r1 != r2) is cut at r1
+            return (idx >= 6) ? arc(pad[0], pad[1], pad[2], pad[4], pad[5], 6) : CMD_ERR;
+
+        case 'B':
+            // BZ a, x1, y1, x2, y2, x3, y3, x4, y4 [, d]
+            if (op2 == 'Z') {
+                return (idx >= 9) ? bezier() : CMD_ERR;
+            }
+            break;
+
+        case ']':
+            // r1, r2, theta1, theta2 [, d] around the pen
+            return (idx >= 4) ? arc(at_x, at_y, pad[0], pad[2], pad[3], 4) : CMD_ERR;
+
+        case '^':
+            if (idx >= 2) {
+                translate_units(STEPS_PER_UNIT, lround(pad[0]), lround(pad[1]));
+            }
+            break;
+
+        case '!':
+            if (idx >= 1) {
+                // 1 to 10 is a tenth of the top speed each, above 100 it is cm/s
+                numpad[0] = to_fixed((pad[0] > 100) ? pad[0] - 100 : pad[0] * FEED_MAX / 100);
+                return CMD_VS;
+            }
+            break;
+
+        case 'F':
+            if (op2 == 'C') {
+                // offset in 0.01 mm, to plotter units of 0.025 mm
+                numpad[0] = (idx >= 1) ? to_fixed(pad[0] * 0.4) : 0;
+                numpad[1] = numpad[2] = -FIXED_ONE;
+                return CMD_FC;
+            }
+            return CMD_PG;
+    }
+
+    return CMD_CONT;
+}
+
+/**
+ * A number of the command is complete.
+ */
+static int8_t number(STEPPER_COORD *x, STEPPER_COORD *y) {
+    double v = num_double();
+
+    num_reset();
+    in_num = 0;
+
+    if (curve && closed < 0) {
+        closed = v != 0;
+        start_x = at_x;
+        start_y = at_y;
+        return CMD_CONT;
+    }
+
+    if (idx < GPGL_PAD) {
+        pad[idx++] = v;
+    }
+
+    if (!list || idx < 2) {
+        return CMD_CONT;
+    }
+
+    idx = 0;
+
+    if (op == 'Y' && curve == 1) {
+        // an absolute curve starts at its first point
+        curve = 2;
+        list_point(x, y);
+        start_x = at_x;
+        start_y = at_y;
+        return CMD_PU;
+    }
+
+    return list_point(x, y);
+}
+
+/**
+ * 'c' starts a command. One letter commands have their numbers right after
+ * the letter, two letter ones after the second.
+ */
+static void begin(char c) {
+    op = c;
+    op2 = 0;
+    idx = 0;
+    in_num = 0;
+    list = 0;
+    curve = 0;
+    num_reset();
+
+    switch (c) {
+        case ESC:
+            state = G_ESC;
+            break;
+
+        case 'M':
+        case 'D':
+        case 'O':
+        case 'E':
+            list = 1;
+            state = G_CMD2;
+            break;
+
+        case 'W':
+        case 'F':
+        case 'B':
+            state = G_CMD2;
+            break;
+
+        case 'Y':
+        case '_':
+            list = 1;
+            curve = 1;
+            closed = -1;
+            state = G_ARGS;
+            break;
+
+        case 'H':
+        case ']':
+        case '^':
+        case '!':
+            state = G_ARGS;
+            break;
+
+        case 'P':
+        case 'K':
+            state = G_TEXT; // print, the text is skipped
+            break;
+
+        default:
+            // anything else that can start a command is skipped
+            if ((c >= 'A' && c <= 'Z') || c == '*' || c == '&' || c == '%' || c == '\\' || c == '/' || c == '>' || c == '=' || c == '"' || c == '(' || c == ')') {
+                state = G_SKIP;
+            } else {
+                state = G_CMD;
+            }
+            break;
+    }
+}
+
+/**
+ * The command ends.
+ */
+static int8_t end(STEPPER_COORD *x, STEPPER_COORD *y) {
+    int8_t cmd = CMD_CONT;
+
+    if (in_num) {
+        cmd = number(x, y);
+    }
+
+    if (!list) {
+        cmd = run(x, y);
+    } else if (curve && closed > 0) {
+        // back to the start, after the last point when that is done here too
+        if (cmd == CMD_CONT) {
+            cmd = go(start_x, start_y, CMD_PD, x, y);
+        } else {
+            queued = go(start_x, start_y, CMD_PD, &queued_x, &queued_y);
+        }
+    }
+
+    state = G_CMD;
+
+    return cmd;
+}
+
+static int8_t parse(char c, STEPPER_COORD *x, STEPPER_COORD *y) {
+    int8_t cmd = CMD_CONT;
+
+    switch (state) {
+        case G_ESC:
+            if (c == EOT) {
+                gpgl_init();
+            }
+            state = G_CMD;
+            return CMD_CONT;
+
+        case G_TEXT:
+            if (is_terminator(c)) {
+                state = G_CMD;
+            }
+            return CMD_CONT;
+
+        case G_SKIP:
+            if (is_number(c) || c == ',' || c == ' ' || c == '\t') {
+                return CMD_CONT;
+            }
+            break;
+
+        case G_CMD2:
+            // the second letter of a two letter command, or the first number
+            if ((c == 'P' && op != 'F' && op != 'B') || (c == 'C' && op == 'F') || (c == 'Z' && op == 'B')) {
+                op2 = c;
+                state = G_ARGS;
+                return CMD_CONT;
+            }
+
+            if (c >= 'A' && c <= 'Z') {
+                state = G_SKIP; // a two letter command that is not done
+                return CMD_CONT;
+            }
+
+            state = G_ARGS;
+            // fall through
+
+        case G_ARGS:
+            if (is_number(c)) {
+                num_char(c);
+                in_num = 1;
+                return CMD_CONT;
+            }
+
+            if (c == ',') {
+                return in_num ? number(x, y) : CMD_CONT;
+            }
+
+            if (c == ' ' || c == '\t') {
+                return CMD_CONT;
+            }
+
+            cmd = end(x, y);
+            break;
+
+        case G_CMD:
+            break;
+    }
+
+    // c is the terminator, or the start of the next command, which never gives anything yet
+    if (!is_terminator(c)) {
+        begin(c);
+    } else {
+        state = G_CMD;
+    }
+
+    return cmd;
+}
+
+int8_t gpgl_char(char c, STEPPER_COORD *x, STEPPER_COORD *y, uint8_t *lb) {
+    STEPPER_COORD nx, ny;
+    int8_t cmd, next;
+
+    *x = *y = -1;
+    *lb = 0;
+
+    if (queued == CMD_CONT) {
+        return parse(c, x, y);
+    }
+
+    // what is left from the last character goes first. An output takes at
+    // least two characters, so there is never more than one waiting.
+    cmd = queued;
+    *x = queued_x;
+    *y = queued_y;
+    queued = CMD_CONT;
+
+    next = parse(c, &nx, &ny);
+
+    if (next != CMD_CONT) {
+        queued = next;
+        queued_x = nx;
+        queued_y = ny;
+    }
+
+    return cmd;
+}
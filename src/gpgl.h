@@ -0,0 +1,33 @@
+/**
+ * gpgl.h
+ *
+ * GP-GL (Graphtec) parser, see gpgl.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef GPGL_H
+#define GPGL_H
+
+#include <inttypes.h>
+
+#include "shvars.h"
+
+void gpgl_init(void);
+uint8_t gpgl_between(void);
+int8_t gpgl_char(char c, STEPPER_COORD *x, STEPPER_COORD *y, uint8_t *lb);
+
+#endif
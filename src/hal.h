@@ -0,0 +1,186 @@
+/**
+ * hal.h
+ *
+ * The places where stepper.c, timer.c, serial.c and flash.c touch the chip:
+ * the motor and pen ports, the timers, UART1 and the pins of the DataFlash.
+ *
+ * For the AVR these are the register accesses themselves, as macros, so the
+ * firmware comes out the same as when the registers were written in place.
+ * Built for anything else, they are functions of a simulated plotter, see
+ * host/hal_host.c. That is what lets the parsers and the motion code run on
+ * a PC, in the simulator and benchmarks of the host build.
+ *
+ * Interrupt handlers are written as HAL_ISR(HAL_..._VECT). On the host they
+ * are plain functions, which the simulator calls when they are due.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef HAL_H
+#define HAL_H
+
+#include <inttypes.h>
+
+#ifdef __AVR__
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+
+#define HAL_ISR(vect)           ISR(vect)
+#define HAL_STEP_VECT           TIMER0_COMPA_vect
+#define HAL_TICK_VECT           TIMER2_COMPA_vect
+#define HAL_UART_RX_VECT        USART1_RX_vect
+#define HAL_UART_TX_VECT        USART1_UDRE_vect
+
+#define hal_wdt_reset()         wdt_reset()
+#define hal_idle()              do { } while(0) // body of a busy wait
+
+/*
+ * Stepper motors: X on PORTA, Y on PORTC, a pin for each coil current. The
+ * pen solenoid is on PE2, and the home switch on PD1, active low.
+ */
+#define HAL_PEN                 (1 << 2)
+#define HAL_HOME                (1 << 1)
+
+#define hal_stepper_init()      do { DDRA = 0xff; DDRC = 0xff; DDRE |= HAL_PEN; PORTD |= HAL_HOME; } while(0)
+#define hal_motors(x, y)        do { PORTA = (x); PORTC = (y); } while(0)
+#define hal_pen_up()            do { PORTE &= ~HAL_PEN; } while(0)
+#define hal_pen_down()          do { PORTE |= HAL_PEN; } while(0)
+#define hal_pen_is_down()       (PORTE & HAL_PEN)
+#define hal_at_home()           (!(PIND & HAL_HOME))
+
+/*
+ * Timers. 0 sets the step rate, 1 the pen pressure (PWM on OC1B), 2 gives
+ * the 250 Hz tick and counts at 62.5 kHz for usleep(), 3 drives the beeper
+ * through OC3A.
+ */
+static inline void hal_timer_init(void) {
+    // set timer 0, variable period for stepper
+    TCCR0A = (1 << WGM01); // CTC
+    TCCR0B = (1 << CS00) | (1 << CS01); // prescaler 1/256 -> 250 kHz << this doesnt compute @16mhz/256=62500
+    OCR0A = 99; // value to count to, CTC interrupts when this value is met
+    TIMSK0 = (1 << OCIE0A); // enable interrupt
+
+    // set timer 2 for 250 Hz period
+    TCCR2A = (1 << WGM21); // CTC
+    TCCR2B = (1 << CS21) | (1 << CS20); //timer2's prescaler is different than the rest... set two bits instead of one
+    OCR2A = 249; // value to count to, CTC interrupts when this value is met
+    TIMSK2 = (1 << OCIE2A); // enable interrupt
+
+    DDRB |= (1 << PB6); // PB6 is PWM output, oc1b
+    // set timer 1, WGM mode 7, fast PWM 10 bit
+    // PWM, Phase Correct, 10-bit
+    //Clear OCnA/OCnB/OCnC on compare match, set OCnA/OCnB/OCnC at BOTTOM (non-inverting mode)
+    TCCR1A = (1 << WGM11) | (1 << WGM10) | (1 << COM1B1);
+    OCR1B = 1023;
+    TCCR1B = (1 << WGM12) | (1 << CS10); // 00001001 wave form generation mode,CLKio no prescaling
+
+    // Timer 3, WGM mode 15 (1111), Fast PWM using OCR3A
+    // this is used by the beeper, OCR3A is set in beeper_on(hz)
+    TCCR3A = (1 << COM3A0) | (1 << WGM31) | (1 << WGM30);
+    TCCR3B = (1 << WGM33) | (1 << WGM32) | 1;
+}
+
+// next step after top + 1 counts of clk/64, or of clk/256 when slow
+#define hal_step_timer(slow, top) do { TCCR0B = (slow) ? (1 << CS02) : (1 << CS01) | (1 << CS00); OCR0A = (top); } while(0)
+#define hal_tick_count()        TCNT2
+#define hal_pen_pwm(duty)       do { OCR1B = (duty); } while(0)
+#define hal_beeper_on(top)      do { DDRE |= (1 << DDE3); OCR3A = (top); } while(0)
+#define hal_beeper_off()        do { DDRE &= ~(1 << DDE3); } while(0)
+
+/*
+ * UART1, 8N1. The data register empty interrupt (UDRIE) runs the
+ * transmitter, TXC tells when the last byte has left.
+ */
+#define hal_uart_init()         do { UCSR1B |= (1 << RXEN1) | (1 << TXEN1) | (1 << RXCIE1); } while(0)
+#define hal_uart_baud(ubrr, x2) do { if (x2) { UCSR1A |= (1 << U2X1); } else { UCSR1A &= ~(1 << U2X1); } UBRR1H = (ubrr) >> 8; UBRR1L = (ubrr); } while(0)
+#define hal_uart_tx_on()        (UCSR1B & (1 << TXEN1))
+#define hal_uart_tx_done()      (UCSR1A & (1 << TXC1))
+#define hal_uart_tx_start()     do { UCSR1B |= (1 << UDRIE1); } while(0)
+#define hal_uart_tx_stop()      do { UCSR1B &= ~(1 << UDRIE1); } while(0)
+#define hal_uart_tx_clear()     do { UCSR1A = (UCSR1A & (1 << U2X1)) | (1 << TXC1); } while(0) // writing 1 clears TXC
+#define hal_uart_put(c)         do { UDR1 = (c); } while(0)
+#define hal_uart_get()          UDR1
+
+/*
+ * DataFlash, bit banged on PORTB. Writing a 1 to a PINB bit toggles the pin,
+ * a single 'out', and nothing else on the port is touched. SCK idles low.
+ */
+#define HAL_MISO                (1 << 0)
+#define HAL_SCK                 (1 << 1)
+#define HAL_CS                  (1 << 4)
+#define HAL_MOSI                (1 << 7)
+
+#define hal_flash_init()        do { PORTB |= HAL_CS; PORTB &= ~(HAL_SCK | HAL_MOSI); DDRB |= HAL_MOSI | HAL_SCK | HAL_CS; } while(0)
+#define hal_flash_select()      do { PORTB &= ~HAL_CS; } while(0)
+#define hal_flash_deselect()    do { PORTB |= HAL_CS; } while(0)
+#define hal_flash_sck()         do { PINB = HAL_SCK; } while(0)
+#define hal_flash_mosi_toggle() do { PINB = HAL_MOSI; } while(0)
+#define hal_flash_mosi()        (PORTB & HAL_MOSI)
+#define hal_flash_miso()        (PINB & HAL_MISO)
+
+#else
+
+#define HAL_ISR(vect)           void vect(void)
+#define HAL_STEP_VECT           hal_step_isr
+#define HAL_TICK_VECT           hal_tick_isr
+#define HAL_UART_RX_VECT        hal_uart_rx_isr
+#define HAL_UART_TX_VECT        hal_uart_tx_isr
+
+void    hal_step_isr(void);
+void    hal_tick_isr(void);
+void    hal_uart_rx_isr(void);
+void    hal_uart_tx_isr(void);
+
+void    hal_wdt_reset(void);
+void    hal_idle(void);
+
+void    hal_stepper_init(void);
+void    hal_motors(uint8_t x, uint8_t y);
+void    hal_pen_up(void);
+void    hal_pen_down(void);
+uint8_t hal_pen_is_down(void);
+uint8_t hal_at_home(void);
+
+void    hal_timer_init(void);
+void    hal_step_timer(uint8_t slow, uint8_t top);
+uint8_t hal_tick_count(void);
+void    hal_pen_pwm(uint16_t duty);
+void    hal_beeper_on(uint16_t top);
+void    hal_beeper_off(void);
+
+void    hal_uart_init(void);
+void    hal_uart_baud(uint16_t ubrr, uint8_t x2);
+uint8_t hal_uart_tx_on(void);
+uint8_t hal_uart_tx_done(void);
+void    hal_uart_tx_start(void);
+void    hal_uart_tx_stop(void);
+void    hal_uart_tx_clear(void);
+void    hal_uart_put(uint8_t c);
+uint8_t hal_uart_get(void);
+
+void    hal_flash_init(void);
+void    hal_flash_select(void);
+void    hal_flash_deselect(void);
+void    hal_flash_sck(void);
+void    hal_flash_mosi_toggle(void);
+uint8_t hal_flash_mosi(void); // 0x80 when high, as PORTB & HAL_MOSI
+uint8_t hal_flash_miso(void);
+
+#endif
+
+#endif
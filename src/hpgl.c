@@ -7,6 +7,8 @@
  * buffer and cause the state machine to go awol.
  *
  * Currently implemented is XON/XOFF but it is known that this is not fool proof.
+ * Hosts that can, should use the credit flow control in serial.h instead
+ * (see tools/hpgl_send.py).
  * 
  * This file is part of FreeExpression.
  *
@@ -26,27 +28,188 @@
  */
 #include <stdio.h>
 #include <inttypes.h>
-#include <math.h>
 #include <avr/pgmspace.h>
 
 #include "shvars.h"
 #include "hpgl.h"
 #include "scale.h"
+#include "arc.h"
+#include "bezier.h"
+#include "label.h"
+#include "number.h"
 
 int8_t pstate, nstate;
 uint8_t etxchar; ///< End of text, default ^C
+static uint8_t pen_down; ///< last PU/PD, arcs are cut with the pen down
+static uint8_t arc_rel; ///< AR: the arc center is relative to the pen
+static uint8_t relative; ///< PR: points are relative to the pen, until PA
+static uint8_t bz_rel; ///< BR: the control points are relative to the start of each curve
+static USER_POINT bz[4]; ///< control points of a BZ/BR curve, bz[0] is the pen
+static uint8_t bz_idx; ///< numbers of the curve so far
+
+/**
+ * Polyline Encoded (HPGL/2 PE). Every number is sent as base 64 digits (base
+ * 32 after the '7' flag), lowest first, with the sign in the lowest bit.
+ * Digits that are not the last one are in 63..126, the last one in 191..254,
+ * or in 95..126 in base 32. Points are relative to the last one, unless the
+ * '=' flag comes first, and cut unless the '<' flag comes first. The '>' flag
+ * sets a number of fraction bits for the points that follow.
+ *
+ * A point comes out as soon as its last digit is in, so a short line takes
+ * 2 to 4 bytes instead of 10 or more in PD.
+ */
+#define PE_FRAC 8 // fraction bits of the position, in user units
+
+enum {
+    PE_X, // next number is the x of a point
+    PE_Y,
+    PE_PEN, // pen number after ':', not used
+    PE_FBITS, // fraction bits after '>'
+};
+
+static struct pe_decoder {
+    uint32_t val; // digits of the number so far
+    uint8_t shift; // bit position of the next digit
+    uint8_t next; // what the number is
+    uint8_t base32; // '7' flag
+    uint8_t up; // '<' flag, the next point is a move
+    uint8_t abs; // '=' flag, the next point is absolute
+    int8_t fbits; // fraction bits of the points
+    int32_t dx; // x of the point being decoded
+    int32_t x, y; // position, with PE_FRAC fraction bits
+} pe;
+
+static void pe_start(void) {
+    pe.val = 0;
+    pe.shift = 0;
+    pe.next = PE_X;
+    pe.base32 = 0;
+    pe.up = 0;
+    pe.abs = 0;
+    pe.fbits = 0;
+    pe.x = user_loc.x * (1L << PE_FRAC);
+    pe.y = user_loc.y * (1L << PE_FRAC);
+}
+
+/**
+ * A number of a point, in PE_FRAC fraction bits.
+ */
+static int32_t pe_coord(int32_t v) {
+    return (pe.fbits <= PE_FRAC) ? v * (1L << (PE_FRAC - pe.fbits)) : v >> (pe.fbits - PE_FRAC);
+}
+
+static USER_COORD pe_round(int32_t v) {
+    return (v + (1 << (PE_FRAC - 1))) >> PE_FRAC;
+}
+
+/**
+ * Add a character of PE. Returns 1 when a point is done, which is then in
+ * user_loc.
+ */
+static uint8_t pe_char(uint8_t c) {
+    uint8_t digit, last;
+    int32_t v;
+
+    switch (c) {
+        case ':': // select pen
+            pe.next = PE_PEN;
+            return 0;
+
+        case '<': // pen up
+            pe.up = 1;
+            return 0;
+
+        case '>': // fraction bits
+            pe.next = PE_FBITS;
+            return 0;
+
+        case '=': // absolute
+            pe.abs = 1;
+            return 0;
+
+        case '7': // base 32
+            pe.base32 = 1;
+            return 0;
+    }
+
+    if (pe.base32) {
+        if (c < 63 || c > 126) {
+            return 0;
+        }
+
+        last = c >= 95;
+        digit = c - (last ? 95 : 63);
+    } else {
+        if (c >= 63 && c <= 126) {
+            last = 0;
+            digit = c - 63;
+        } else if (c >= 191 && c <= 254) {
+            last = 1;
+            digit = c - 191;
+        } else {
+            return 0; // anything else is ignored
+        }
+    }
+
+    if (pe.shift < 32) {
+        pe.val |= (uint32_t) digit << pe.shift;
+    }
+
+    pe.shift += pe.base32 ? 5 : 6;
+
+    if (!last) {
+        return 0;
+    }
+
+    v = (pe.val & 1) ? -(int32_t) (pe.val >> 1) : (int32_t) (pe.val >> 1);
+    pe.val = 0;
+    pe.shift = 0;
+
+    switch (pe.next) {
+        case PE_X:
+            pe.dx = pe_coord(v);
+            pe.next = PE_Y;
+            return 0;
+
+        case PE_Y:
+            if (pe.abs) {
+                pe.x = pe.dx;
+                pe.y = pe_coord(v);
+            } else {
+                pe.x += pe.dx;
+                pe.y += pe_coord(v);
+            }
+
+            user_loc.x = pe_round(pe.x);
+            user_loc.y = pe_round(pe.y);
+            pe.next = PE_X;
+            return 1;
+
+        case PE_FBITS:
+            pe.fbits = (v < 0) ? 0 : (v > 26) ? 26 : v;
+            break;
+    }
+
+    pe.next = PE_X;
+    return 0;
+}
 
 void hpgl_init() {
     pstate = STATE_EXP1;
     etxchar = 003; // ^C
+    pen_down = 0;
+    relative = 0;
     translate_init();
+    label_init();
 }
 
 int8_t hpgl_char(char c, STEPPER_COORD* x, STEPPER_COORD* y, uint8_t* lb) {
-    static uint8_t i, si;
+    static uint8_t i;
     static uint8_t numpad_idx;
     static int8_t cmd = CMD_ERR;
     static STEPPER_COORD fx, fy;
+    static int32_t coord[2]; // AA/AR center, CI radius, in user units that may not fit numpad
+    USER_POINT center;
 
     *x = *y = -1;
     *lb = 0;
@@ -55,13 +218,14 @@ lolbel:
     switch (pstate) {
         case STATE_EXP1: // expect first letter 
             cmd = CMD_CONT;
-            si = 0;
+            num_reset();
 
             switch (c) {
                 case ' ':
                 case '\n':
                 case '\r':
                 case '\t':
+                case ';': // after IN and IH, which are done at their second letter
                     break;
 
                 case 'P':
@@ -91,6 +255,18 @@ lolbel:
                     pstate = STATE_EXP_V;
                     break;
 
+                case 'B':
+                    pstate = STATE_EXP_B;
+                    break;
+
+                case 'F':
+                    pstate = STATE_EXP_F;
+                    break;
+
+                case 'C':
+                    pstate = STATE_EXP_C;
+                    break;
+
                 default:
                     pstate = STATE_SKIP_END;
                     break;
@@ -109,6 +285,8 @@ lolbel:
                 case ' ': case '\n': case '\r': case '\t':
                     break;
                 case 'A': // Arc Absolute
+                case 'R': // Arc Relative
+                    arc_rel = c == 'R';
                     numpad_idx = 0;
                     pstate = STATE_EXP4;
                     nstate = STATE_ARC;
@@ -122,31 +300,40 @@ lolbel:
             break;
 
         case STATE_EXP_P:
-            si = 0;
+            num_reset();
 
             switch (c) {
                 case 'U':
                     cmd = CMD_PU;
+                    pen_down = 0;
                     pstate = STATE_X;
                     break;
                 case 'D':
                     cmd = CMD_PD;
+                    pen_down = 1;
                     pstate = STATE_X;
                     break;
 
-                case 'A':
-                    cmd = CMD_PA;
+                case 'A': // PA and PR go on with the pen as it is
+                case 'R':
+                    relative = c == 'R';
+                    cmd = pen_down ? CMD_PD : CMD_PU;
                     pstate = STATE_X;
                     break;
 
+                case 'E': // PE: polyline encoded
+                    cmd = CMD_CONT;
+                    pe_start();
+                    pstate = STATE_PE;
+                    break;
+
                 case 'G': // PG: feed page/home
                     *x = *y = 0;
                     user_loc.x = user_loc.y = 0;
-                    cmd = CMD_PU;
+                    cmd = CMD_PG;
                     pstate = STATE_SKIP_END;
                     break;
 
-                case 'R':
                 case 'W':
                 default:
                     cmd = CMD_ERR;
@@ -194,6 +381,9 @@ lolbel:
                     break;
 
                 case 'N': // IN: init plotter
+                    pen_down = 0;
+                    relative = 0;
+                    label_init();
                     pstate = STATE_EXP1;
                     cmd = CMD_INIT;
                     break;
@@ -213,6 +403,7 @@ lolbel:
             switch (c) {
                 case 'B': // LB: text label
                     pstate = STATE_LB;
+                    label_start(user_loc);
                     cmd = CMD_LB0;
                     break;
 
@@ -254,6 +445,100 @@ lolbel:
             }
             break;
 
+        case STATE_EXP_F:
+            switch (c) {
+                case 'C': // FC: blade offset (not HPGL)
+                    pstate = STATE_EXP4;
+                    nstate = STATE_FC;
+                    numpad_idx = 0;
+                    break;
+
+                default:
+                    pstate = STATE_SKIP_END;
+                    break;
+            }
+            break;
+
+        case STATE_EXP_C:
+            switch (c) {
+                case 'I': // CI: circle around the pen
+                    pstate = STATE_EXP4;
+                    nstate = STATE_CI;
+                    numpad_idx = 0;
+                    break;
+
+                default:
+                    pstate = STATE_SKIP_END;
+                    break;
+            }
+            break;
+
+        case STATE_EXP_B:
+            switch (c) {
+                case 'D': // BD: baud rate (not HPGL)
+                    pstate = STATE_BD;
+                    break;
+
+                case 'N': // BN: binary stream (not HPGL)
+                    pstate = STATE_BN;
+                    break;
+
+                case 'P': // BP: begin plot, only the quoted picture name is used
+                    pstate = STATE_BP;
+                    break;
+
+                case 'Z': // BZ: Bezier curves (HPGL/2)
+                case 'R': // BR: relative Bezier curves
+                    bz_rel = c == 'R';
+                    bz_idx = 0;
+                    num_reset();
+                    pstate = STATE_BZ;
+                    break;
+
+                default:
+                    pstate = STATE_SKIP_END;
+                    break;
+            }
+            break;
+
+        case STATE_BD:
+            // one number, too big for numpad
+            if (c == ';') {
+                *x = num_int();
+                cmd = CMD_BD;
+                pstate = STATE_EXP1;
+            } else {
+                num_char(c);
+            }
+            break;
+
+        case STATE_BN:
+            // switch after the ';', so it doesn't end up in the first frame
+            if (c == ';') {
+                cmd = CMD_BN;
+                pstate = STATE_EXP1;
+            }
+            break;
+
+        case STATE_BP:
+            if (c == ';') {
+                pstate = STATE_EXP1;
+            } else if (c == '"') {
+                pstate = STATE_BP_NAME;
+            }
+            break;
+
+        case STATE_BP_NAME:
+            // name characters come out like label text, a 0 ends the name
+            cmd = CMD_BP;
+            if (c == '"') {
+                pstate = STATE_BP;
+                *lb = 000;
+            } else {
+                *lb = c;
+            }
+            break;
+
         case STATE_SP:
             switch (c) {
                 case ';':
@@ -263,6 +548,7 @@ lolbel:
                 case '0':
                     *x = *y = 0;
                     user_loc.x = user_loc.y = 0;
+                    pen_down = 0;
                     cmd = CMD_PU;
                     pstate = STATE_SKIP_END;
                     break;
@@ -270,28 +556,26 @@ lolbel:
             break;
 
         case STATE_IP:
-            for (i = 0; i < 4; ++i) {
-                ip_pad[i] = (int32_t) round(numpad[i]);
-            }
-
+            // the points went straight into ip_pad
             pstate = STATE_EXP1;
             break;
 
         case STATE_SC:
-            for (i = 0; i < 4; ++i) {
-                sc_pad[i] = (int32_t) round(numpad[i]);
-            }
-
+            // the limits went straight into sc_pad
             translate_scale();
             pstate = STATE_EXP1;
             break;
 
         case STATE_SI:
+            // SI width, height in cm, SI; for the default
+            label_size((numpad_idx > 1) ? numpad[0] : 0, (numpad_idx > 1) ? numpad[1] : 0, 0);
             cmd = CMD_SI;
             pstate = STATE_EXP1;
             break;
 
         case STATE_SR:
+            // SR width, height in percent of P2 - P1, 0.75 and 1.5 when not given
+            label_size((numpad_idx > 1) ? numpad[0] : FIXED_ONE * 3 / 4, (numpad_idx > 1) ? numpad[1] : FIXED_ONE * 3 / 2, 1);
             cmd = CMD_SR;
             pstate = STATE_EXP1;
             break;
@@ -304,11 +588,8 @@ lolbel:
                 case '\t':
                     break;
                 case ',':
-                    scratchpad[si++] = 0;
-                    fx = 0;
-                    sscanf_P(scratchpad, PSTR("%d"), &fx);
-
-                    si = 0;
+                    fx = num_int();
+                    num_reset();
                     pstate = STATE_Y;
                     break;
 
@@ -318,7 +599,7 @@ lolbel:
                     break;
 
                 default:
-                    scratchpad[si++] = c;
+                    num_char(c);
                     break;
             }
             break;
@@ -330,16 +611,20 @@ lolbel:
 
                 case ',':
                 case ';':
-                    scratchpad[si++] = 0;
-                    fy = 0;
-                    sscanf_P(scratchpad, PSTR("%d"), &fy);
-                    si = 0;
-                    *y = fy;
-                    *x = fx;
-                    //userscale(fx, fy, x, y, &user_loc.x, &user_loc.y);
+                    fy = num_int();
+                    num_reset();
+
+                    if (relative) {
+                        fx += user_loc.x;
+                        fy += user_loc.y;
+                    }
+
+                    userscale(fx, fy, x, y);
+                    user_loc.x = fx;
+                    user_loc.y = fy;
                     break;
                 default:
-                    scratchpad[si++] = c;
+                    num_char(c);
                     break;
             }
 
@@ -354,6 +639,19 @@ lolbel:
             }
             break;
 
+        case STATE_PE:
+            cmd = CMD_CONT;
+
+            if (c == ';') {
+                pstate = STATE_EXP1;
+            } else if (pe_char(c)) {
+                userscale(user_loc.x, user_loc.y, x, y);
+                pen_down = !pe.up;
+                pe.up = pe.abs = 0;
+                cmd = pen_down ? CMD_PD : CMD_PU;
+            }
+            break;
+
         case STATE_EXP4:
             switch (c) {
                 case ' ':
@@ -364,10 +662,17 @@ lolbel:
 
                 case ';':
                 case ',':
-                    scratchpad[si++] = 0;
-                    sscanf_P(scratchpad, PSTR("%d"), &fx);
-                    si = 0;
-                    numpad[numpad_idx] = fx;
+                    // coordinates are whole user units, and can be bigger than Q16.16 holds
+                    if (nstate == STATE_IP) {
+                        ip_pad[numpad_idx] = num_int();
+                    } else if (nstate == STATE_SC) {
+                        sc_pad[numpad_idx] = num_int();
+                    } else if ((nstate == STATE_ARC && numpad_idx < 2) || (nstate == STATE_CI && numpad_idx == 0)) {
+                        coord[numpad_idx] = num_int();
+                    } else {
+                        numpad[numpad_idx] = num_fixed();
+                    }
+                    num_reset();
                     ++numpad_idx;
                     if (numpad_idx == 4 || c == ';') {
                         pstate = nstate;
@@ -376,31 +681,93 @@ lolbel:
                     break;
 
                 default:
-                    scratchpad[si++] = c;
+                    num_char(c);
                     break;
             }
             break;
 
         case STATE_ARC:
-            // AA xc, yc, CentralAngle [,Degrees per step]
-            cmd = CMD_ARCABS;
+            // AA xc, yc, CentralAngle [,Degrees per chord], AR with the center relative to the pen
+            pstate = STATE_EXP1;
 
-            if (numpad_idx == 3) {
-                numpad[3] = 5.0;
+            if (numpad_idx < 3) {
+                cmd = CMD_ERR;
+                break;
             }
 
-            *x = *y = -1;
+            center.x = coord[0];
+            center.y = coord[1];
+
+            if (arc_rel) {
+                center.x += user_loc.x;
+                center.y += user_loc.y;
+            }
+
+            user_loc = arc_start(center, user_loc, numpad[2], (numpad_idx > 3) ? numpad[3] : 0, pen_down);
+            cmd = CMD_ARCABS;
+            break;
+
+        case STATE_CI:
+            // CI radius [,Degrees per chord], the pen ends up where it was
+            arc_circle(user_loc, coord[0], 0, FIXED_FROM_INT(360), (numpad_idx > 1) ? numpad[1] : 0, 1);
+            cmd = CMD_ARCABS;
             pstate = STATE_EXP1;
             break;
 
+        case STATE_BZ:
+            // BZ x1,y1,x2,y2,x3,y3 [,...], a curve from the pen for every three points
+            cmd = CMD_CONT;
+
+            switch (c) {
+                case ' ': case '\n': case '\r': case '\t':
+                    break;
+
+                case ',':
+                case ';':
+                    if (bz_idx & 1) {
+                        bz[bz_idx / 2 + 1].y = num_int();
+                    } else {
+                        bz[bz_idx / 2 + 1].x = num_int();
+                    }
+                    num_reset();
+
+                    if (++bz_idx == 6) {
+                        bz_idx = 0;
+                        bz[0] = user_loc;
+
+                        if (bz_rel) {
+                            for (i = 1; i < 4; ++i) {
+                                bz[i].x += user_loc.x;
+                                bz[i].y += user_loc.y;
+                            }
+                        }
+
+                        bezier_start(bz, pen_down, 0);
+                        user_loc = bz[3];
+                        cmd = CMD_BEZIER;
+                    }
+
+                    if (c == ';') {
+                        pstate = STATE_EXP1;
+                    }
+                    break;
+
+                default:
+                    num_char(c);
+                    break;
+            }
+            break;
+
         case STATE_LB:
             // scanning text
             cmd = CMD_LB;
             if (c == etxchar) {
                 pstate = STATE_EXP1;
+                label_end();
                 *lb = 000;
             } else {
                 *x = *y = -1;
+                user_loc = label_char(c);
                 *lb = c;
             }
             break;
@@ -411,7 +778,8 @@ lolbel:
             break;
 
         case STATE_DI:
-            // numpad contains sin(theta), cos(theta)
+            // DI run, rise, DI; for along X
+            label_dir((numpad_idx > 1) ? numpad[0] : 0, (numpad_idx > 1) ? numpad[1] : 0);
             cmd = CMD_DI;
             pstate = STATE_EXP1;
             break;
@@ -425,7 +793,20 @@ lolbel:
             cmd = CMD_AS;
             pstate = STATE_EXP1;
             break;
+
+        case STATE_FC:
+            for (i = numpad_idx; i < 3; ++i) {
+                numpad[i] = -FIXED_ONE;
+            }
+
+            cmd = CMD_FC;
+            pstate = STATE_EXP1;
+            break;
     }
 
     return cmd;
 }
+
+uint8_t hpgl_between(void) {
+    return pstate == STATE_EXP1;
+}
@@ -9,20 +9,25 @@
 enum _hpgl_command {
     CMD_ERR = -1, ///< Error
     CMD_CONT = 0, ///< Continue, do nothing (data coming)
-    CMD_PA = 1, ///< Move to returned coordinates
-    CMD_FS, ///< Pen pressure (nonstandard??)
-    CMD_PD, ///< Pen down
-    CMD_PU, ///< Pen up
-    CMD_ARCABS, ///< Start arc absolute
+    CMD_FS = 1, ///< Pen pressure (nonstandard??)
+    CMD_PD, ///< Cut to returned coordinates (PD, or PA/PR/PE with the pen down)
+    CMD_PU, ///< Move to returned coordinates (PU, or PA/PR/PE with the pen up)
+    CMD_ARCABS, ///< Arc or circle (AA, AR, CI): the points come from arc_next()
+    CMD_BEZIER, ///< Cubic Bezier curve (BZ, BR): the points come from bezier_next()
     CMD_INIT, ///< Initialize
     CMD_SEEK0, ///< Locate home position
     CMD_LB0, ///< Mark label start
-    CMD_LB, ///< Label text
+    CMD_LB, ///< Label character in lb, its strokes come from label_next(). lb is 0 at the end of the label
     CMD_SI, ///< Absolute character size
     CMD_SR, ///< Relative character size
-    CMD_DI, ///< Label direction: numpad[0]=sin(theta), numpad[1]=cos(theta)
+    CMD_DI, ///< Label direction: numpad[0]=run, numpad[1]=rise
     CMD_AS, ///< Acceleration Select: 0 = no acceleration (nonstandard)
-    CMD_VS, ///< Velocity Select: 0 = fastest (nonstandard)
+    CMD_VS, ///< Velocity Select: cm/s, 0 = fastest (nonstandard)
+    CMD_PG, ///< Page feed
+    CMD_BD, ///< Baud rate (nonstandard): x = new rate in baud
+    CMD_BN, ///< Switch to the binary stream (nonstandard)
+    CMD_BP, ///< Begin plot: lb = next character of the picture name, 0 at the end
+    CMD_FC, ///< Blade offset (nonstandard): numpad[0]=offset, numpad[1]=overcut, numpad[2]=corner angle, -1 when not given
 };
 
 /// Internal scanner state. 
@@ -37,6 +42,8 @@ enum _scanner_state {
     STATE_EXP_L,
     STATE_EXP_D,
     STATE_EXP_V,
+    STATE_EXP_B,
+    STATE_EXP_C,
 
     STATE_X,
     STATE_Y,
@@ -51,10 +58,18 @@ enum _scanner_state {
     STATE_DI, ///< label direction
 
     STATE_AS, ///< Acceleration Select (nonstandard: 0/1)
-    STATE_VS, ///< Velocity Select (nonstandard: value = skip steps, the more the slower)
+    STATE_VS, ///< Velocity Select (cm/s, 0 = fastest)
+    STATE_BD, ///< Baud rate (nonstandard)
+    STATE_BN, ///< Binary stream (nonstandard)
+    STATE_BP, ///< Begin plot
+    STATE_BP_NAME, ///< Begin plot, quoted picture name
+    STATE_FC, ///< Blade offset (nonstandard)
+    STATE_PE, ///< Polyline encoded
 
     STATE_EXP4, ///< Expect 4 numbers (like for AA, IP, SC)
-    STATE_ARC, ///< Arc
+    STATE_ARC, ///< Arc (AA, AR)
+    STATE_CI, ///< Circle
+    STATE_BZ, ///< Bezier curves (HPGL/2 BZ, BR)
     STATE_SKIP_END, ///< Skip all until semicolon
 };
 
@@ -70,4 +85,7 @@ void hpgl_init(void);
 /// @returns	_hpgl_command
 int8_t hpgl_char(char c, STEPPER_COORD* x, STEPPER_COORD* y, uint8_t* lb);
 
+/// True between commands, where a new job can start.
+uint8_t hpgl_between(void);
+
 #endif
@@ -88,6 +88,9 @@
 #include "display.h"
 #include "flash.h"
 #include "usb.h"
+#include "spool.h"
+#include "catalog.h"
+#include "order.h"
 
 // pin assignment
 // These appear to be the same on both the Cake and Expression machines
@@ -238,6 +241,11 @@ int keypad_poll(void) {
             display_puts("Location 0,0 set");
             break;
 
+        case KEYPAD_FITLENGTH:
+            stepper_roll_mode(!stepper_get_roll_mode());
+            display_puts(stepper_get_roll_mode() ? "Roll feed on" : "Roll feed off");
+            break;
+
             // this jogs X and Y freely -- use to load, unload or set position for  0,0 origin
         case KEYPAD_MOVEUP:
         case KEYPAD_MOVEUPLEFT:
@@ -255,6 +263,46 @@ int keypad_poll(void) {
             }
             break;
 
+        case KEYPAD_F2:
+            spool_store_mode(!spool_get_store_mode());
+            display_puts(spool_get_store_mode() ? "Store mode on" : "Store mode off");
+            break;
+
+        case KEYPAD_F3:
+            order_mode(!order_get_mode());
+            display_puts(order_get_mode() ? "Path order on" : "Path order off");
+            break;
+
+        case KEYPAD_QUANTITY: // + and - set the number of copies
+            k_state = key;
+            spool_copies(spool_get_copies());
+            break;
+
+        case KEYPAD_FITPAGE:
+            k_state = KEYPAD_QUANTITY;
+            spool_fit_copies();
+            break;
+
+        case KEYPAD_REPEATLAST:
+            if (!spool_play(catalog_last())) {
+                display_puts("No stored job");
+            }
+            break;
+
+            // the digit keys select a slot for stored jobs
+        case KEYPAD_1:
+        case KEYPAD_2:
+        case KEYPAD_3:
+        case KEYPAD_4:
+        case KEYPAD_5:
+        case KEYPAD_6:
+        case KEYPAD_7:
+        case KEYPAD_8:
+        case KEYPAD_9:
+        case KEYPAD_0:
+            spool_select((key == KEYPAD_0) ? 0 : key - KEYPAD_1 + 1);
+            break;
+
 #ifdef DEBUG_FLASH
         case KEYPAD_F1:
             flash_test();
@@ -280,6 +328,10 @@ int keypad_poll(void) {
 
         case KEYPAD_CUT:
             k_state = key;
+
+            if (!spool_play(spool_get_slot())) {
+                display_puts("Slot is empty");
+            }
             break;
 
         case KEYPAD_MINUS: // decrements either pressure or speed depending on what was last pressed
@@ -295,6 +347,10 @@ int keypad_poll(void) {
                 int p = timer_get_stepper_speed() - 1;
                 timer_set_stepper_speed(p);
             }
+
+            if (k_state == KEYPAD_QUANTITY) {
+                spool_copies(spool_get_copies() - 1);
+            }
             break;
 
         case KEYPAD_PLUS:
@@ -311,6 +367,10 @@ int keypad_poll(void) {
                 int p = timer_get_stepper_speed() + 1;
                 timer_set_stepper_speed(p);
             }
+
+            if (k_state == KEYPAD_QUANTITY) {
+                spool_copies(spool_get_copies() + 1);
+            }
             break;
     }
 
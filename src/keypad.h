@@ -22,7 +22,9 @@ int keypad_scan(void);
 #define leds_off() do { PORTD |=  (1 << 5); } while(0) // PD5
 
 typedef enum _languge {
-    HPGL = 1
+    HPGL = 1,
+    BINARY, // framed binary stream, see bincmd.c
+    GPGL, // Graphtec, see gpgl.c
 } en_language;
 
 extern en_language Lang;
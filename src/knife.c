@@ -0,0 +1,238 @@
+/**
+ * knife.c
+ *
+ * Drag knife blade offset compensation. The tip of a swivel blade trails
+ * the axis of the holder by the blade offset, so it follows the direction
+ * the holder moves in. Cutting with the holder right on the path rounds off
+ * every corner. This stage sits between stepper_draw()/stepper_move() and the
+ * command queue, and moves the holder so the tip is on the path:
+ *
+ * - along a line, the holder runs one offset ahead of the tip.
+ * - at a corner sharper than the corner angle, the holder stops with the tip
+ *   in the corner, and goes around it on an arc of the offset, which swivels
+ *   the blade into the new direction. Gentler bends are left to the blade.
+ * - a move keeps the offset in the direction the blade was left in, as the
+ *   blade does not turn while it is up. The first cut then swivels it.
+ * - when a closed path is done, the cut goes on over its first line by the
+ *   overcut, so the shape comes loose even where the blade went down.
+ *
+ * The stage only works out points. stepper.c puts them in the queue with
+ * knife_next(), so the planner sees a normal path and joins it up at speed.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <math.h>
+
+#include "configs.h"
+#include "knife.h"
+#include "planner.h"
+
+#define Q14     16384 // 1.0 for directions, from planner_unit()
+#define UNIT_STEPS_Q16 ((int32_t) (STEPS_PER_MM_X / 40 * 65536 + 0.5)) // steps per plotter unit
+
+/**
+ * A line the holder goes along, after an arc around the point the tip is
+ * in, when arc is set.
+ */
+struct leg {
+    STEPPER_COORD cx, cy; // center of the arc
+    int16_t rx, ry; // direction from the center of the last arc point, Q14
+    int16_t ux, uy; // direction at the end of the arc, Q14
+    int8_t turn; // 1 counterclockwise, -1 clockwise
+    uint8_t arc;
+    uint8_t draw;
+    STEPPER_COORD x, y; // end of the line
+};
+
+static uint16_t offset; // blade offset in steps, 0 is off
+static uint16_t overcut; // in steps
+static int16_t corner_cos = Q14; // corners with a smaller cosine get an arc
+static int16_t chord_cos, chord_sin; // rotation per chord of an arc
+static struct leg legs[2]; // overcut and move, or a single cut
+static uint8_t leg_count, leg_next;
+static STEPPER_COORD tip_x, tip_y;
+static int16_t dir_x = Q14, dir_y; // direction of the blade
+static STEPPER_COORD start_x, start_y; // start of the path being cut
+static int16_t first_x, first_y; // direction of its first line
+static int32_t first_len; // and its length
+static uint8_t lines; // number of lines cut since the last move
+static uint8_t closed; // the last line ended at the start of the path
+
+/**
+ * len along the Q14 direction u, rounded to a step.
+ */
+static STEPPER_COORD along(int32_t len, int16_t u) {
+    return (len * u + Q14 / 2) >> 14;
+}
+
+/**
+ * Set up the blade from HPGL FC: the offset and the overcut in plotter
+ * units (0.025mm), and the sharpest bend in degrees the blade is left to
+ * follow by itself. Negative values were not given, and get the default.
+ * An offset of 0 turns the compensation off. The cosines are worked out
+ * here, so cutting takes no floating point.
+ */
+void knife_set(FIXED off, FIXED over, FIXED corner) {
+    double a = ((corner >= 0) ? corner / (double) FIXED_ONE : KNIFE_CORNER) * M_PI / 180;
+
+    offset = (off > 0) ? ((int64_t) off * UNIT_STEPS_Q16 + (1LL << 31)) >> 32 : 0;
+    overcut = (over > 0) ? ((int64_t) over * UNIT_STEPS_Q16 + (1LL << 31)) >> 32 : 0;
+    corner_cos = lround(cos(a) * Q14);
+    chord_cos = lround(cos(KNIFE_ARC_STEP * M_PI / 180) * Q14);
+    chord_sin = lround(sin(KNIFE_ARC_STEP * M_PI / 180) * Q14);
+}
+
+/**
+ * Forget the path being cut, and take the tip to be at (x, y), pointing
+ * along X as at power up. For when the cutter went somewhere without this
+ * stage, or the queue was thrown away, so there is no overcut to finish.
+ */
+void knife_reset(STEPPER_COORD x, STEPPER_COORD y) {
+    tip_x = x;
+    tip_y = y;
+    dir_x = Q14;
+    dir_y = 0;
+    lines = 0;
+    closed = 0;
+    leg_count = leg_next = 0;
+}
+
+/**
+ * Plan the holder going with the tip from where it is to (x, y). Without
+ * an offset the holder is where the tip is.
+ */
+static void plan_line(STEPPER_COORD x, STEPPER_COORD y, uint8_t draw) {
+    struct leg *l = &legs[leg_count++];
+    int16_t ux, uy;
+
+    l->arc = 0;
+    l->draw = draw;
+    l->x = x;
+    l->y = y;
+
+    if (offset > 0 && draw && (x != tip_x || y != tip_y)) {
+        planner_unit(x - tip_x, y - tip_y, &ux, &uy);
+
+        if ((((int32_t) dir_x * ux + (int32_t) dir_y * uy) >> 14) < corner_cos) {
+            // swivel around the corner, the short way
+            l->cx = tip_x;
+            l->cy = tip_y;
+            l->rx = dir_x;
+            l->ry = dir_y;
+            l->ux = ux;
+            l->uy = uy;
+            l->turn = ((int32_t) dir_x * uy < (int32_t) dir_y * ux) ? -1 : 1;
+            l->arc = 1;
+        }
+
+        dir_x = ux;
+        dir_y = uy;
+    }
+
+    if (offset > 0) {
+        l->x += along(offset, dir_x);
+        l->y += along(offset, dir_y);
+    }
+
+    tip_x = x;
+    tip_y = y;
+}
+
+/**
+ * Cut with the tip to (x, y).
+ */
+void knife_draw(STEPPER_COORD x, STEPPER_COORD y) {
+    leg_count = leg_next = 0;
+
+    if (!lines) {
+        start_x = tip_x;
+        start_y = tip_y;
+
+        if (x == tip_x && y == tip_y) {
+            return; // not a line yet
+        }
+
+        if (overcut > 0) {
+            planner_unit(x - tip_x, y - tip_y, &first_x, &first_y);
+            first_len = ((int64_t) (x - tip_x) * first_x + (int64_t) (y - tip_y) * first_y) >> 14;
+        }
+    }
+
+    if (lines < 255) {
+        ++lines;
+    }
+
+    closed = lines > 1 && x == start_x && y == start_y;
+    plan_line(x, y, 1);
+}
+
+/**
+ * Move the tip to (x, y) with the pen up, after the overcut when that ends
+ * a closed path.
+ */
+void knife_move(STEPPER_COORD x, STEPPER_COORD y) {
+    int32_t over = (overcut < first_len) ? overcut : first_len;
+
+    leg_count = leg_next = 0;
+
+    if (closed && over > 0) {
+        plan_line(start_x + along(over, first_x), start_y + along(over, first_y), 1);
+    }
+
+    plan_line(x, y, 0);
+    lines = 0;
+    closed = 0;
+}
+
+/**
+ * Next point for the holder, of the cut or move planned last. Returns 0
+ * when there are no more. An arc goes around in chords of KNIFE_ARC_STEP,
+ * the last one shorter, up to the direction of the line.
+ */
+uint8_t knife_next(uint8_t *draw, STEPPER_COORD *x, STEPPER_COORD *y) {
+    struct leg *l = &legs[leg_next];
+    int16_t rx;
+
+    if (leg_next == leg_count) {
+        return 0;
+    }
+
+    *draw = l->draw;
+
+    if (l->arc) {
+        if ((((int32_t) l->rx * l->ux + (int32_t) l->ry * l->uy) >> 14) >= chord_cos) {
+            // one chord or less to go
+            l->rx = l->ux;
+            l->ry = l->uy;
+            l->arc = 0;
+        } else {
+            rx = ((int32_t) l->rx * chord_cos - (int32_t) l->turn * l->ry * chord_sin + Q14 / 2) >> 14;
+            l->ry = ((int32_t) l->ry * chord_cos + (int32_t) l->turn * l->rx * chord_sin + Q14 / 2) >> 14;
+            l->rx = rx;
+        }
+
+        *x = l->cx + along(offset, l->rx);
+        *y = l->cy + along(offset, l->ry);
+    } else {
+        *x = l->x;
+        *y = l->y;
+        ++leg_next;
+    }
+
+    return 1;
+}
@@ -0,0 +1,35 @@
+/**
+ * knife.h
+ *
+ * Drag knife blade offset compensation, see knife.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef KNIFE_H
+#define KNIFE_H
+
+#include <inttypes.h>
+
+#include "shvars.h"
+
+void knife_set(FIXED offset, FIXED overcut, FIXED corner);
+void knife_reset(STEPPER_COORD x, STEPPER_COORD y);
+void knife_draw(STEPPER_COORD x, STEPPER_COORD y);
+void knife_move(STEPPER_COORD x, STEPPER_COORD y);
+uint8_t knife_next(uint8_t *draw, STEPPER_COORD *x, STEPPER_COORD *y);
+
+#endif
@@ -0,0 +1,347 @@
+/**
+ * label.c
+ *
+ * Text labels (HPGL LB), cut in a single stroke font, so a job ID or a part
+ * number is a few bytes from the host instead of the outlines of a font.
+ *
+ * A glyph is drawn on a grid 4 wide, with the baseline at 2, capitals and
+ * digits up to 8, lower case up to 6 and descenders down to 0. The font is
+ * one string in flash, a glyph per printable ASCII character in order, each
+ * ended by '|'. A glyph is its points as pairs of digits, x then y, drawn
+ * one after the other, with a space where the pen lifts.
+ *
+ * The grid is scaled to the size from SI or SR (4 wide is the character
+ * width, 6 high the cap height) and turned to the direction from DI, in
+ * steps. The next character starts 1.5 widths further along, and a line
+ * feed goes 2 heights down, as on HP plotters. The pen ends up where the
+ * next character would start.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <math.h>
+#include <avr/pgmspace.h>
+
+#include "configs.h"
+#include "label.h"
+#include "hpgl.h"
+#include "scale.h"
+
+#define GRID_Q  8 // fraction bits of the grid vectors
+#define BASE    2 // grid y of the baseline
+#define CAP     6 // cap height, in grid units above the baseline
+#define WIDTH   4 // character width, in grid units
+#define GLYPH_END '|'
+#define GLYPH_UP ' '
+
+static const char font[] PROGMEM =
+    /*   */ "|"
+    /* ! */ "2824 2322|"
+    /* " */ "1816 3836|"
+    /* # */ "1713 3733 0646 0444|"
+    /* $ */ "4717061535443303 2822|"
+    /* % */ "0248 0818170708 3343423233|"
+    /* & */ "4216172837360403122244|"
+    /* ' */ "2826|"
+    /* ( */ "38161432|"
+    /* ) */ "18363412|"
+    /* * */ "2723 0644 0446|"
+    /* + */ "2723 0545|"
+    /* , */ "232211|"
+    /* - */ "0545|"
+    /* . */ "2322|"
+    /* / */ "0248|"
+    /* 0 */ "183847433212030718 0347|"
+    /* 1 */ "172822 1232|"
+    /* 2 */ "07183847460242|"
+    /* 3 */ "07183847463515 354443321203|"
+    /* 4 */ "32380444|"
+    /* 5 */ "4808053544433202|"
+    /* 6 */ "38180703123243443505|"
+    /* 7 */ "084812|"
+    /* 8 */ "15060718384746351504031232434435|"
+    /* 9 */ "45150607183847433212|"
+    /* : */ "2625 2322|"
+    /* ; */ "2625 232211|"
+    /* < */ "470543|"
+    /* = */ "0646 0444|"
+    /* > */ "074503|"
+    /* ? */ "07183847462524 2322|"
+    /* @ */ "342314152635334347381807031232|"
+    /* A */ "0206284642 0545|"
+    /* B */ "02083847463505 3544433202|"
+    /* C */ "4738180703123243|"
+    /* D */ "02082846442202|"
+    /* E */ "48080242 0535|"
+    /* F */ "480802 0535|"
+    /* G */ "47381807031232434525|"
+    /* H */ "0802 4842 0545|"
+    /* I */ "1838 2822 1232|"
+    /* J */ "4843321203|"
+    /* K */ "0802 4804 1542|"
+    /* L */ "080242|"
+    /* M */ "0208254842|"
+    /* N */ "02084248|"
+    /* O */ "183847433212030718|"
+    /* P */ "02083847463505|"
+    /* Q */ "183847433212030718 2442|"
+    /* R */ "02083847463505 2542|"
+    /* S */ "473818070615354443321203|"
+    /* T */ "0848 2822|"
+    /* U */ "080312324348|"
+    /* V */ "082248|"
+    /* W */ "0812253248|"
+    /* X */ "0842 4802|"
+    /* Y */ "082548 2522|"
+    /* Z */ "08480242|"
+    /* [ */ "38181232|"
+    /* \ */ "0842|"
+    /* ] */ "18383212|"
+    /* ^ */ "062846|"
+    /* _ */ "0141|"
+    /* ` */ "1836|"
+    /* a */ "16364542 441403123243|"
+    /* b */ "08023243453606|"
+    /* c */ "461605031242|"
+    /* d */ "48421203051646|"
+    /* e */ "044445361605031242|"
+    /* f */ "48382722 1636|"
+    /* g */ "4536160503123243 46413010|"
+    /* h */ "0802 0516364542|"
+    /* i */ "2622 2827|"
+    /* j */ "36312010 3837|"
+    /* k */ "0802 4603 1442|"
+    /* l */ "282332|"
+    /* m */ "0206 05162522 25364542|"
+    /* n */ "0206 0516364542|"
+    /* o */ "163645433212030516|"
+    /* p */ "00063645433202|"
+    /* q */ "40461605031242|"
+    /* r */ "0206 042646|"
+    /* s */ "4616051434433202|"
+    /* t */ "28233242 1636|"
+    /* u */ "0603123243 4642|"
+    /* v */ "062246|"
+    /* w */ "0612243246|"
+    /* x */ "0642 4602|"
+    /* y */ "0622 4610|"
+    /* z */ "06460242|"
+    /* { */ "38272615242332|"
+    /* | */ "2822|"
+    /* } */ "18272635242312|"
+    /* ~ */ "05163445|"
+    ;
+
+static STEPPER_COORD size_w, size_h; // character size, in steps
+static double dir_x, dir_y; // direction of the text
+static int32_t gx_x, gx_y, gy_x, gy_y; // a grid unit along x and y of the glyph, in steps with GRID_Q fraction bits
+static double line_x, line_y; // start of the line, in user units
+static double at_x, at_y; // start of the next character
+static double adv_x, adv_y; // from one character to the next, in user units
+static double feed_x, feed_y; // from one line to the next
+static STEPPER_COORD ox, oy; // start of the character being drawn, in steps
+static uint16_t pos; // next point of the glyph in font
+static uint8_t lift; // the pen goes up before the next point
+static uint8_t done; // nothing left to draw
+static uint8_t park; // move to the start of the next character, at the end
+
+/**
+ * Size and direction as after IN.
+ */
+void label_init(void) {
+    label_size(0, 0, 0);
+    label_dir(0, 0);
+    done = 1;
+    park = 0;
+}
+
+/**
+ * Character width and cap height in cm (SI), or in percent of P2 - P1 (SR).
+ * Without them (w and h 0 or less) the size is back to what it is after IN.
+ */
+void label_size(FIXED w, FIXED h, uint8_t relative) {
+    USER_POINT p;
+
+    if (w <= 0 || h <= 0) {
+        size_w = LABEL_WIDTH * STEPS_PER_MM_X;
+        size_h = LABEL_HEIGHT * STEPS_PER_MM_Y;
+    } else if (relative) {
+        p = scale_P1P2();
+        size_w = lround(w / (double) FIXED_ONE / 100 * fabs(p.x) * STEPSCALE_X);
+        size_h = lround(h / (double) FIXED_ONE / 100 * fabs(p.y) * STEPSCALE_Y);
+    } else {
+        size_w = lround(w / (double) FIXED_ONE * 10 * STEPS_PER_MM_X);
+        size_h = lround(h / (double) FIXED_ONE * 10 * STEPS_PER_MM_Y);
+    }
+}
+
+/**
+ * Direction of the text as run and rise (DI). Both 0 is along X.
+ */
+void label_dir(FIXED run, FIXED rise) {
+    double len = hypot(run, rise);
+
+    if (len > 0) {
+        dir_x = run / len;
+        dir_y = rise / len;
+    } else {
+        dir_x = 1;
+        dir_y = 0;
+    }
+}
+
+/**
+ * A label starts at 'at', in user units. The size and direction are taken
+ * as they are now, with the scale of the user units as it is now.
+ */
+void label_start(USER_POINT at) {
+    FIXED xscale, yscale;
+    double sx, sy;
+    double up_x = -dir_y, up_y = dir_x;
+
+    userscale_factors(&xscale, &yscale);
+    sx = xscale / (double) FIXED_ONE;
+    sy = yscale / (double) FIXED_ONE;
+
+    gx_x = lround(size_w * dir_x / WIDTH * (1 << GRID_Q));
+    gx_y = lround(size_w * dir_y / WIDTH * (1 << GRID_Q));
+    gy_x = lround(size_h * up_x / CAP * (1 << GRID_Q));
+    gy_y = lround(size_h * up_y / CAP * (1 << GRID_Q));
+
+    adv_x = 1.5 * size_w * dir_x / sx;
+    adv_y = 1.5 * size_w * dir_y / sy;
+    feed_x = -2.0 * size_h * up_x / sx;
+    feed_y = -2.0 * size_h * up_y / sy;
+
+    line_x = at_x = at.x;
+    line_y = at_y = at.y;
+    done = 1;
+    park = 0;
+}
+
+static USER_POINT user_point(double px, double py) {
+    USER_POINT p;
+
+    p.x = lround(px);
+    p.y = lround(py);
+
+    return p;
+}
+
+/**
+ * Draw the character c of the label, or handle CR, LF and BS. Returns where
+ * the pen is after it, in user units.
+ */
+USER_POINT label_char(char c) {
+    uint8_t n;
+
+    done = 1;
+
+    switch (c) {
+        case '\r':
+            at_x = line_x;
+            at_y = line_y;
+            break;
+
+        case '\n':
+            line_x += feed_x;
+            line_y += feed_y;
+            at_x += feed_x;
+            at_y += feed_y;
+            break;
+
+        case '\b':
+            at_x -= adv_x;
+            at_y -= adv_y;
+            break;
+
+        default:
+            if (c < ' ' || c > '~') {
+                break; // not in the font
+            }
+
+            // glyphs are in order, find the one of c
+            for (pos = 0, n = c - ' '; n; ++pos) {
+                if (pgm_read_byte(&font[pos]) == GLYPH_END) {
+                    --n;
+                }
+            }
+
+            userscale(lround(at_x), lround(at_y), &ox, &oy);
+            lift = 1;
+            done = 0;
+
+            at_x += adv_x;
+            at_y += adv_y;
+            break;
+    }
+
+    return user_point(at_x, at_y);
+}
+
+/**
+ * The label ends: the pen goes to the start of the next character, so what
+ * comes after starts where the parser thinks the pen is.
+ */
+void label_end(void) {
+    done = 1;
+    park = 1;
+}
+
+/**
+ * Next point of the character, and CMD_PD or CMD_PU for how to get there.
+ * CMD_CONT when the character is done.
+ */
+int8_t label_next(STEPPER_COORD *x, STEPPER_COORD *y) {
+    uint8_t c;
+    int8_t gx, gy, pen;
+
+    while (!done) {
+        c = pgm_read_byte(&font[pos]);
+
+        if (c == GLYPH_END) {
+            done = 1;
+            break;
+        }
+
+        ++pos;
+
+        if (c == GLYPH_UP) {
+            lift = 1;
+            continue;
+        }
+
+        gx = c - '0';
+        gy = pgm_read_byte(&font[pos++]) - '0' - BASE;
+
+        *x = ox + ((gx * gx_x + gy * gy_x + (1L << (GRID_Q - 1))) >> GRID_Q);
+        *y = oy + ((gx * gx_y + gy * gy_y + (1L << (GRID_Q - 1))) >> GRID_Q);
+
+        pen = lift ? CMD_PU : CMD_PD;
+        lift = 0;
+
+        return pen;
+    }
+
+    if (park) {
+        park = 0;
+        userscale(lround(at_x), lround(at_y), x, y);
+        return CMD_PU;
+    }
+
+    return CMD_CONT;
+}
@@ -0,0 +1,37 @@
+/**
+ * label.h
+ *
+ * Stroke font text labels for HPGL LB, see label.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef LABEL_H
+#define LABEL_H
+
+#include <inttypes.h>
+
+#include "shvars.h"
+
+void label_init(void);
+void label_size(FIXED w, FIXED h, uint8_t relative);
+void label_dir(FIXED run, FIXED rise);
+void label_start(USER_POINT at);
+USER_POINT label_char(char c);
+void label_end(void);
+int8_t label_next(STEPPER_COORD *x, STEPPER_COORD *y);
+
+#endif
@@ -0,0 +1,212 @@
+/**
+ * lang.c
+ *
+ * Picks the parser for the language the host speaks, HPGL or GP-GL, from
+ * the first two bytes of every job. A job starts after power up, when a job
+ * starts to be stored, and when the host has been quiet for LANG_IDLE_TICKS
+ * between two commands.
+ *
+ * HPGL jobs start with a two letter command, nearly always IN, and the
+ * common ones are in a table. Anything else is taken to be GP-GL, where
+ * commands are mostly one letter followed by a number, or ESC EOT. HPGL
+ * device control (ESC .) is told apart from that by the '.'. The first byte
+ * of a command never gives any output, so it can simply be run through the
+ * parser once the second one has decided which.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+
+#include "configs.h"
+#include "lang.h"
+#include "hpgl.h"
+#include "gpgl.h"
+#include "arc.h"
+#include "bezier.h"
+#include "label.h"
+#include "keypad.h"
+
+// two letter commands an HPGL job can start with
+static const char hpgl_start[] PROGMEM = "INDFPUPDPAPRPEPGSPSCIPIHBPBNBDVSASLBDTDISISRAAARCI";
+
+static uint8_t detect = 1; // the next bytes start a job
+static uint8_t fresh = 1; // and the parser starts over for it
+static char first; // first byte of the job, 0 before it
+static uint8_t idle; // 25Hz ticks since the last byte
+
+/**
+ * The next bytes start a new job, which may be in the other language.
+ */
+void lang_job(void) {
+    detect = 1;
+    fresh = 1;
+    first = 0;
+}
+
+/**
+ * Called at 25Hz. Once the host has gone quiet, the next bytes can be a job
+ * in the other language. The parser only starts over when it is.
+ */
+void lang_tick(void) {
+    uint8_t between;
+
+    if (idle < LANG_IDLE_TICKS) {
+        ++idle;
+        return;
+    }
+
+    between = (Lang == GPGL) ? gpgl_between() : (Lang == HPGL) && hpgl_between();
+
+    if (!detect && between) {
+        detect = 1;
+        first = 0;
+    }
+}
+
+static uint8_t is_hpgl(char c1, char c2) {
+    uint8_t i;
+
+    if (c1 == 033) {
+        return c2 == '.';
+    }
+
+    for (i = 0; i < sizeof(hpgl_start) - 1; i += 2) {
+        if (pgm_read_byte(&hpgl_start[i]) == c1 && pgm_read_byte(&hpgl_start[i + 1]) == c2) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int8_t parse(char c, STEPPER_COORD *x, STEPPER_COORD *y, uint8_t *lb) {
+    return (Lang == GPGL) ? gpgl_char(c, x, y, lb) : hpgl_char(c, x, y, lb);
+}
+
+/**
+ * Handle the next byte from the host, with the parser of the language of
+ * the job. Returns what the parser returns.
+ */
+int8_t lang_char(char c, STEPPER_COORD *x, STEPPER_COORD *y, uint8_t *lb) {
+    en_language found;
+
+    idle = 0;
+
+    if (detect) {
+        *x = *y = -1;
+        *lb = 0;
+
+        // separators and terminators before the first command
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ';' || c == ',' || c == 003) {
+            return CMD_CONT;
+        }
+
+        if (!first) {
+            first = c;
+            return CMD_CONT;
+        }
+
+        detect = 0;
+        found = is_hpgl(first, c) ? HPGL : GPGL;
+
+        if (fresh || found != Lang) {
+            if (found == HPGL) {
+                hpgl_init();
+            } else {
+                gpgl_init();
+            }
+        }
+
+        fresh = 0;
+        Lang = found;
+        parse(first, x, y, lb);
+    }
+
+    return parse(c, x, y, lb);
+}
+
+/**
+ * Next point of a command that gives more than one (CMD_ARCABS, CMD_BEZIER
+ * and CMD_LB), and CMD_PD or CMD_PU for how to get there. CMD_CONT when it
+ * is done.
+ */
+int8_t lang_next(int8_t cmd, STEPPER_COORD *x, STEPPER_COORD *y) {
+    switch (cmd) {
+        case CMD_ARCABS:
+            return arc_next(x, y);
+
+        case CMD_BEZIER:
+            return bezier_next(x, y);
+
+        case CMD_LB:
+            return label_next(x, y);
+    }
+
+    return CMD_CONT;
+}
+
+/**
+ * Run a block of input through the parser, and gather the points of point
+ * lists (HPGL PU/PD/PA/PR/PE, GP-GL M/D/O/E), so a long list is queued without
+ * handling every pair on its own. Stops after LANG_BATCH points, or at any
+ * other command. Points that can not be on the media are left out, as cli.c
+ * did. Returns the number of bytes used.
+ */
+uint8_t lang_block(const char *buf, uint8_t len, struct lang_batch *b) {
+    STEPPER_COORD x, y;
+    uint8_t lb;
+    uint8_t i = 0;
+    int8_t cmd;
+
+    b->points = 0;
+    b->cmd = CMD_CONT;
+
+    while (i < len) {
+        cmd = lang_char(buf[i++], &x, &y, &lb);
+
+        if (cmd == CMD_CONT || cmd == CMD_ERR) {
+            continue;
+        }
+
+        if (cmd == CMD_PU || cmd == CMD_PD) {
+            if (x < 0 || y < 0) {
+                continue; // no point yet, or off the media
+            }
+
+            if (!b->points || cmd == b->pen) {
+                b->pen = cmd;
+                b->pt[b->points].x = x;
+                b->pt[b->points].y = y;
+
+                if (++b->points == LANG_BATCH) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        // anything else ends the batch, and is handled on its own
+        b->cmd = cmd;
+        b->x = x;
+        b->y = y;
+        b->lb = lb;
+        break;
+    }
+
+    return i;
+}
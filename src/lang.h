@@ -0,0 +1,50 @@
+/**
+ * lang.h
+ *
+ * Command language of the host, see lang.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef LANG_H
+#define LANG_H
+
+#include <inttypes.h>
+
+#include "shvars.h"
+
+#define LANG_BATCH 8 // most points lang_block() gathers
+
+/**
+ * Points that came out of lang_block() one after the other, with the same
+ * pen, and the command that ended them.
+ */
+struct lang_batch {
+    uint8_t points; // number of points in pt
+    int8_t pen; // CMD_PU or CMD_PD for all of them
+    STEPPER_POINT pt[LANG_BATCH];
+    int8_t cmd; // other command, or a point with the other pen, CMD_CONT when none
+    STEPPER_COORD x, y; // its coordinates, like hpgl_char()
+    uint8_t lb; // its label character, like hpgl_char()
+};
+
+void lang_job(void);
+void lang_tick(void);
+int8_t lang_char(char c, STEPPER_COORD *x, STEPPER_COORD *y, uint8_t *lb);
+int8_t lang_next(int8_t cmd, STEPPER_COORD *x, STEPPER_COORD *y);
+uint8_t lang_block(const char *buf, uint8_t len, struct lang_batch *b);
+
+#endif
@@ -36,6 +36,10 @@
 #include "dial.h"
 #include "hpgl.h"
 #include "display.h"
+#include "planner.h"
+#include "spool.h"
+#include "catalog.h"
+#include "lang.h"
 
 void setup(void);
 
@@ -47,8 +51,10 @@ void setup(void) {
     display_init();
     usb_init();
     timer_init();
+    planner_init();
     stepper_init();
     flash_init();
+    catalog_init();
     hpgl_init();
     dial_init();
 
@@ -67,11 +73,15 @@ int main(void) {
 
     while (1) {
         cli_poll(); // polls ready bytes from USB  and processes them
+        stepper_prep(); // keeps the ISR supplied with step segments
+        flash_poll(); // programs spooled pages and erases ahead, without waiting
         wdt_reset();
 
         if (flag_25Hz) {
             flag_25Hz = 0;
 
+            spool_tick(); // ends a stored job when the host goes quiet
+            lang_tick(); // the next job may be in another language
             dial_poll(); // polls the dials and processes their state
             keypad_poll(); // polls the keypad and executes functions
             //display_update();
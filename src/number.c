@@ -0,0 +1,115 @@
+/**
+ * number.c
+ *
+ * Number scanner, shared by the HPGL and GP-GL parsers. Digits are added up
+ * as they come in, so there is no buffer to overrun and no sscanf to run at
+ * the end. Up to 4 decimals are kept, the rest are ignored. Values that don't
+ * fit saturate at NUM_MAX. Only one parser runs at a time, so there is one
+ * number being scanned.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+
+#include "number.h"
+
+#define NUM_DIV_MAX     10000       // 10^decimals kept
+#define NUM_MAX         99999999L
+
+static struct number {
+    uint32_t ip; // integer part
+    uint16_t frac; // decimals so far
+    uint16_t div; // 10^number of decimals, 0 before the '.'
+    uint8_t neg; // '-' seen
+} num;
+
+void num_reset(void) {
+    num.ip = 0;
+    num.frac = 0;
+    num.div = 0;
+    num.neg = 0;
+}
+
+/**
+ * Add a character to the number. Anything that is not part of a number is
+ * ignored, like sscanf did with separators.
+ */
+void num_char(char c) {
+    if (c >= '0' && c <= '9') {
+        c -= '0';
+        if (num.div) {
+            if (num.div < NUM_DIV_MAX) {
+                num.frac = num.frac * 10 + c;
+                num.div *= 10;
+            }
+        } else if (num.ip < NUM_MAX / 10) {
+            num.ip = num.ip * 10 + c;
+        } else {
+            num.ip = NUM_MAX;
+        }
+    } else if (c == '.') {
+        if (!num.div) {
+            num.div = 1;
+        }
+    } else if (c == '-') {
+        num.neg = 1;
+    }
+}
+
+/**
+ * The number, rounded to a whole unit.
+ */
+int32_t num_int(void) {
+    int32_t v = num.ip;
+
+    if (num.div > 1 && num.frac * 2 >= num.div) {
+        ++v;
+    }
+
+    return num.neg ? -v : v;
+}
+
+/**
+ * The number in Q16.16, saturated to what fits.
+ */
+FIXED num_fixed(void) {
+    FIXED v;
+
+    if (num.ip >= 0x7fff) {
+        v = 0x7fffffffL;
+    } else {
+        v = FIXED_FROM_INT(num.ip);
+        if (num.div > 1) {
+            v += ((uint32_t) num.frac * FIXED_ONE + num.div / 2) / num.div;
+        }
+    }
+
+    return num.neg ? -v : v;
+}
+
+/**
+ * The number as a double, for what goes into trigonometry anyway.
+ */
+double num_double(void) {
+    double v = num.ip;
+
+    if (num.div > 1) {
+        v += (double) num.frac / num.div;
+    }
+
+    return num.neg ? -v : v;
+}
@@ -0,0 +1,35 @@
+/**
+ * number.h
+ *
+ * Number scanner for the command parsers, see number.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include <inttypes.h>
+
+#include "shvars.h"
+
+void num_reset(void);
+void num_char(char c);
+int32_t num_int(void);
+FIXED num_fixed(void);
+double num_double(void);
+
+#endif
@@ -0,0 +1,456 @@
+/**
+ * order.c
+ *
+ * Path ordering for stored jobs. Drawing programs often send the paths of a
+ * design in an order that has the cutter go back and forth over the media
+ * with the pen up. With ordering on, every stored job is written again right
+ * after it came in, with its paths in a better order:
+ *
+ * - each path starts where the cutter is closest to, measured along the
+ *   slowest axis, as that is how long the move takes.
+ * - a closed path is only cut after every path that fits inside it, so the
+ *   inside of a letter is cut before the letter itself comes loose.
+ * - paths that join up are cut without lifting the pen in between.
+ *
+ * A path is a DRAW record and the ones following it. The DRAW records are
+ * relative, so a path is copied over byte for byte, only the MOVE to its
+ * start is new. Any other record (a feed, a page feed) stays where it is, and
+ * only the paths in between are reordered. The table holds ORDER_PATHS paths,
+ * to keep it in RAM. When it fills up, the paths that can go are written
+ * out, but the closed ones stay for the paths still to come inside them.
+ * Only with the table full of closed paths does the smallest one go early,
+ * and the report says how often that happened.
+ *
+ * The new job goes in the flash after the old one, and takes its place in
+ * the catalog. How far the cutter moves with the pen up, and how often the
+ * pen goes down, before and after, is sent to the host.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <util/crc16.h>
+
+#include "configs.h"
+#include "hal.h"
+#include "order.h"
+#include "flash.h"
+#include "catalog.h"
+#include "bincmd.h"
+#include "display.h"
+#include "usb.h"
+
+#define ORDER_PATHS     32      // paths ordered at a time
+#define PATH_MAX_BYTES  0xff00  // longer paths are split
+
+struct path {
+    uint32_t at; // offset of its first DRAW in the job
+    uint16_t bytes; // length of its DRAW records
+    STEPPER_COORD x0, y0, x1, y1; // start and end
+    STEPPER_COORD min_x, min_y, max_x, max_y;
+    uint8_t inner; // paths inside this one that are still to be cut
+    uint8_t done;
+};
+
+static uint8_t mode;
+static struct path paths[ORDER_PATHS];
+static uint8_t npaths;
+static uint16_t src_page; // the job being ordered
+static uint32_t src_length;
+static uint8_t in_buf[32]; // records read from it
+static uint8_t in_len, in_pos;
+static uint32_t in_at; // offset of in_buf[in_pos] in the job
+static STEPPER_COORD in_x, in_y; // where the records read so far leave the cutter
+static struct cat_entry job; // the job being written
+static uint32_t room; // bytes it can take without running into the old one
+static uint8_t failed;
+static STEPPER_COORD out_x, out_y; // where the records written so far leave the cutter
+static uint32_t up_before, up_after; // pen up travel, in steps along the slowest axis
+static uint16_t lifts_before, lifts_after;
+static uint16_t early; // closed paths written before the end of their group
+static uint8_t moved; // the old job went somewhere else with the pen up since its last DRAW
+
+void order_mode(uint8_t on) {
+    mode = on;
+}
+
+uint8_t order_get_mode(void) {
+    return mode;
+}
+
+static STEPPER_COORD distance(STEPPER_COORD dx, STEPPER_COORD dy) {
+    if (dx < 0) {
+        dx = -dx;
+    }
+
+    if (dy < 0) {
+        dy = -dy;
+    }
+
+    return (dx > dy) ? dx : dy;
+}
+
+/**
+ * Decode the next record of the old job. Returns its length, 0 at the end.
+ */
+static uint8_t next_record(uint8_t *type, int32_t *a, int32_t *b) {
+    uint32_t left = src_length - (in_at + in_len - in_pos); // bytes not in in_buf yet
+    uint8_t n;
+
+    if (in_len - in_pos < BIN_RECORD_MAX && left) {
+        in_len -= in_pos;
+        memmove(in_buf, in_buf + in_pos, in_len);
+        in_pos = 0;
+
+        n = sizeof(in_buf) - in_len;
+
+        if (n > left) {
+            n = left;
+        }
+
+        flash_start_read_at(src_page, in_at + in_len);
+        flash_read_block(in_buf + in_len, n);
+        flash_end_read();
+        in_len += n;
+    }
+
+    n = bincmd_decode(in_buf + in_pos, in_len - in_pos, type, a, b);
+    in_pos += n;
+    in_at += n;
+
+    return n;
+}
+
+/**
+ * Append bytes to the new job.
+ */
+static void put(const uint8_t *data, uint16_t bytes) {
+    uint16_t i, n;
+
+    if (failed || job.length + bytes > room) {
+        failed = 1;
+        return;
+    }
+
+    for (i = 0; i < bytes; ++i) {
+        job.crc = _crc_ccitt_update(job.crc, data[i]);
+    }
+
+    job.length += bytes;
+
+    while (bytes) {
+        hal_wdt_reset();
+        n = flash_write_block(data, bytes);
+        data += n;
+        bytes -= n;
+    }
+}
+
+static void put_record(uint8_t type, int32_t a, int32_t b) {
+    uint8_t rec[BIN_RECORD_MAX];
+
+    put(rec, bincmd_encode(rec, type, a, b));
+}
+
+/**
+ * Move to (x, y) with the pen up, if the cutter is not there already.
+ */
+static void move_to(STEPPER_COORD x, STEPPER_COORD y) {
+    if (x != out_x || y != out_y) {
+        put_record(BIN_MOVE, x - out_x, y - out_y);
+        up_after += distance(x - out_x, y - out_y);
+        out_x = x;
+        out_y = y;
+    }
+}
+
+/**
+ * Copy a path from the old job to the new one.
+ */
+static void copy_path(const struct path *p) {
+    uint8_t buf[32];
+    uint32_t at = p->at;
+    uint16_t left = p->bytes;
+    uint16_t n;
+
+    if (p->x0 != out_x || p->y0 != out_y) {
+        ++lifts_after;
+    }
+
+    move_to(p->x0, p->y0);
+
+    for (; left; left -= n, at += n) {
+        n = (left > sizeof(buf)) ? sizeof(buf) : left;
+        flash_start_read_at(src_page, at);
+        flash_read_block(buf, n);
+        flash_end_read();
+        put(buf, n);
+    }
+
+    out_x = p->x1;
+    out_y = p->y1;
+}
+
+static uint8_t closed(const struct path *p) {
+    return p->x0 == p->x1 && p->y0 == p->y1;
+}
+
+/**
+ * Longest side of the bounding box.
+ */
+static STEPPER_COORD size(const struct path *p) {
+    return distance(p->max_x - p->min_x, p->max_y - p->min_y);
+}
+
+/**
+ * True when the bounding box of 'a' is inside that of 'b', and not the same.
+ */
+static uint8_t inside(const struct path *a, const struct path *b) {
+    return a->min_x >= b->min_x && a->max_x <= b->max_x && a->min_y >= b->min_y && a->max_y <= b->max_y &&
+            (a->min_x != b->min_x || a->max_x != b->max_x || a->min_y != b->min_y || a->max_y != b->max_y);
+}
+
+/**
+ * Write a path from the table, and let the closed paths around it know.
+ */
+static void take(uint8_t i) {
+    uint8_t j;
+
+    copy_path(&paths[i]);
+    paths[i].done = 1;
+
+    for (j = 0; j < npaths; ++j) {
+        if (!paths[j].done && closed(&paths[j]) && inside(&paths[i], &paths[j])) {
+            --paths[j].inner;
+        }
+    }
+}
+
+/**
+ * Write the paths in the table to the new job, nearest first, and the inner
+ * ones before the closed paths around them. Unless 'all' is set the closed
+ * paths stay in the table, as there may be more paths inside them in the
+ * rest of the group. If that leaves the table full, the smallest one goes.
+ */
+static void put_paths(uint8_t all) {
+    uint8_t i, j, best;
+    STEPPER_COORD d, best_d;
+
+    for (j = 0; j < npaths; ++j) {
+        paths[j].inner = 0;
+        paths[j].done = 0;
+
+        if (closed(&paths[j])) {
+            for (i = 0; i < npaths; ++i) {
+                if (inside(&paths[i], &paths[j])) {
+                    ++paths[j].inner;
+                }
+            }
+        }
+    }
+
+    for (;;) {
+        best = 0xff;
+        best_d = 0;
+
+        for (i = 0; i < npaths; ++i) {
+            if (paths[i].done || paths[i].inner || (!all && closed(&paths[i]))) {
+                continue;
+            }
+
+            d = distance(paths[i].x0 - out_x, paths[i].y0 - out_y);
+
+            if (best == 0xff || d < best_d) {
+                best = i;
+                best_d = d;
+            }
+        }
+
+        if (best == 0xff) {
+            break;
+        }
+
+        take(best);
+    }
+
+    // keep what is left for the next round
+    for (i = j = 0; i < npaths; ++i) {
+        if (!paths[i].done) {
+            paths[j++] = paths[i];
+        }
+    }
+
+    npaths = j;
+
+    if (npaths == ORDER_PATHS) {
+        for (i = 0; i < npaths; ++i) {
+            if (!paths[i].inner && (best == 0xff || size(&paths[i]) < size(&paths[best]))) {
+                best = i;
+            }
+        }
+
+        take(best);
+        ++early;
+        memmove(&paths[best], &paths[best + 1], (--npaths - best) * sizeof(struct path));
+    }
+}
+
+/**
+ * Read the old job up to the next record that is not a MOVE or DRAW, and
+ * write it out in order.
+ */
+static uint8_t order_group(void) {
+    struct path *p = 0;
+    uint8_t park = 0; // the group ends with a MOVE
+    uint8_t type, n;
+    int32_t a, b;
+
+    for (;;) {
+        n = next_record(&type, &a, &b);
+
+        if (!n) {
+            break;
+        }
+
+        if (type == BIN_MOVE) {
+            if (a || b) {
+                up_before += distance(a, b);
+                moved = 1;
+                park = 1;
+            }
+
+            in_x += a;
+            in_y += b;
+            p = 0;
+            continue;
+        }
+
+        if (type != BIN_DRAW) {
+            break;
+        }
+
+        if (!p || p->bytes + n > PATH_MAX_BYTES) {
+            if (npaths == ORDER_PATHS) {
+                put_paths(0);
+            }
+
+            p = &paths[npaths++];
+            p->at = in_at - n;
+            p->bytes = 0;
+            p->x0 = p->min_x = p->max_x = in_x;
+            p->y0 = p->min_y = p->max_y = in_y;
+
+            if (moved) {
+                ++lifts_before;
+                moved = 0;
+            }
+        }
+
+        in_x += a;
+        in_y += b;
+        p->bytes += n;
+        p->x1 = in_x;
+        p->y1 = in_y;
+
+        if (in_x < p->min_x) {
+            p->min_x = in_x;
+        }
+
+        if (in_x > p->max_x) {
+            p->max_x = in_x;
+        }
+
+        if (in_y < p->min_y) {
+            p->min_y = in_y;
+        }
+
+        if (in_y > p->max_y) {
+            p->max_y = in_y;
+        }
+
+        park = 0;
+    }
+
+    put_paths(1);
+
+    if (park) {
+        move_to(in_x, in_y);
+    }
+
+    if (n && type != BIN_DRAW) {
+        put_record(type, a, b);
+    }
+
+    return n;
+}
+
+/**
+ * Write the job in a slot again with its paths ordered, and report what it
+ * saved. Keeps the old job if the new one does not fit in the flash.
+ */
+void order_job(uint8_t slot) {
+    const struct cat_entry *e = catalog_get(slot);
+    char string[100]; // the longest report, with every number at its widest
+    uint16_t next;
+
+    if (!e) {
+        return;
+    }
+
+    src_page = e->page;
+    src_length = e->length;
+    in_len = in_pos = 0;
+    in_at = 0;
+    in_x = in_y = 0;
+    out_x = out_y = 0;
+    npaths = 0;
+    up_before = up_after = 0;
+    lifts_before = lifts_after = 0;
+    early = 0;
+    moved = 0;
+    failed = 0;
+
+    job = *e;
+    job.page = catalog_next_page();
+    job.length = 0;
+    job.crc = 0xffff;
+    room = (uint32_t) flash_ring_distance(job.page, src_page) * flash_page_size();
+
+    display_puts("Ordering paths");
+    flash_start_write(job.page);
+
+    while (order_group() && !failed) {
+    }
+
+    next = flash_flush();
+    catalog_clobber(job.page, flash_ring_distance(job.page, next));
+
+    if (failed) {
+        display_puts("No room to order");
+        return;
+    }
+
+    catalog_put(slot, &job);
+
+    sprintf(string, "Order: pen up %ld -> %ldmm, lifts %u -> %u, %u cut early\r\n",
+            (long) (up_before / STEPS_PER_MM_X), (long) (up_after / STEPS_PER_MM_X), lifts_before, lifts_after, early);
+    usb_puts(string);
+
+    sprintf(string, "Lifts %u -> %u", lifts_before, lifts_after);
+    display_puts(string);
+}
@@ -0,0 +1,31 @@
+/**
+ * order.h
+ *
+ * Path ordering for stored jobs, see order.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef ORDER_H
+#define ORDER_H
+
+#include <inttypes.h>
+
+void order_mode(uint8_t on);
+uint8_t order_get_mode(void);
+void order_job(uint8_t slot);
+
+#endif
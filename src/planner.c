@@ -0,0 +1,353 @@
+/**
+ * planner.c
+ *
+ * Trapezoidal speed profiles for the stepper command queue.
+ *
+ * Every line in the queue gets an accelerate/cruise/decelerate profile when
+ * it is put in the queue. The cruise speed comes from the feed rate in mm/s,
+ * converted to steps along the major axis with the step size of each axis,
+ * so a line runs at the same speed over the media whatever its direction.
+ * The stepper ISR then only has to follow the profile, and rewrite the
+ * Timer0 compare value when the speed changes.
+ *
+ * Speeds are kept as an index into a table of step periods. The table is
+ * built for constant acceleration, so v^2 grows linearly with the index:
+ *
+ *     v(n)^2 = ACCEL_START_RATE^2 + 2 * ACCEL_RATE * ACCEL_STEPS_RAMP * n
+ *
+ * Ramping up or down by one index takes exactly ACCEL_STEPS_RAMP steps,
+ * which means the profile can be worked out with a few additions, and the
+ * ISR only needs a table lookup instead of a division.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <math.h>
+
+#include "configs.h"
+#include "shvars.h"
+#include "planner.h"
+#include "stepper.h"
+
+#define RAMP_V2 (2UL * ACCEL_RATE * ACCEL_STEPS_RAMP) // v^2 gained per table index
+#define Q14     16384 // 1.0 for unit vectors
+#define STEPS_X_Q8 ((uint32_t) (STEPS_PER_MM_X * 256 + 0.5)) // steps per mm, Q8
+#define STEPS_Y_Q8 ((uint32_t) (STEPS_PER_MM_Y * 256 + 0.5))
+#define X_PER_Y_Q14 ((uint32_t) (STEPS_PER_MM_X / STEPS_PER_MM_Y * Q14 + 0.5)) // X steps in the length of a Y step
+#define Y_PER_X_Q14 ((uint32_t) (STEPS_PER_MM_Y / STEPS_PER_MM_X * Q14 + 0.5))
+#define JUNCTION_K ((uint16_t) (ACCEL_RATE * JUNCTION_DEVIATION / 16)) // 4 * ACCEL_RATE * JUNCTION_DEVIATION / 64, at most 2047
+
+static uint16_t accel_period[ACCEL_TABLE_SIZE]; // step period per speed index, in Timer0 ticks
+static uint8_t fixed_index[MAX_STEPPER_SPEED_RANGES]; // cruise speed index per speed setting, for the old fixed rates
+static uint16_t feed; // feed in mm/s set by HPGL VS, 0 when the speed setting is used
+static ACCEL_MODE accel_mode = ACCEL_ACCEL;
+
+/**
+ * Find the speed index closest to, but not above, a speed given as v^2.
+ */
+static uint8_t v2_to_index(uint32_t v2) {
+    if (v2 <= (uint32_t) ACCEL_START_RATE * ACCEL_START_RATE) {
+        return 0;
+    }
+
+    v2 = (v2 - (uint32_t) ACCEL_START_RATE * ACCEL_START_RATE) / RAMP_V2;
+
+    return (v2 >= ACCEL_TABLE_SIZE) ? ACCEL_TABLE_SIZE - 1 : v2;
+}
+
+/**
+ * Find the speed index closest to, but not above, a rate in steps/s.
+ */
+static uint8_t rate_to_index(uint32_t rate) {
+    return v2_to_index(rate * rate);
+}
+
+/**
+ * Square root, rounded down. Bit by bit, so it takes only shifts and adds.
+ */
+static uint16_t isqrt(uint32_t v) {
+    uint32_t root = 0;
+    uint32_t bit = 1UL << 30;
+
+    while (bit > v) {
+        bit >>= 2;
+    }
+
+    while (bit) {
+        if (v >= root + bit) {
+            v -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+
+        bit >>= 2;
+    }
+
+    return root;
+}
+
+/**
+ * Direction of (dx, dy), not both 0, as a vector of length Q14 (16384).
+ * knife.c uses it too.
+ */
+void planner_unit(int32_t dx, int32_t dy, int16_t *ux, int16_t *uy) {
+    int32_t m = (dx < 0) ? -dx : dx;
+    uint16_t len;
+
+    if (m < ((dy < 0) ? -dy : dy)) {
+        m = (dy < 0) ? -dy : dy;
+    }
+
+    // scale to 12 or 13 bits, so the squares add up in 32 bits
+    for (; m < 4096; m *= 2) {
+        dx *= 2;
+        dy *= 2;
+    }
+
+    for (; m >= 8192; m /= 2) {
+        dx /= 2;
+        dy /= 2;
+    }
+
+    len = isqrt(dx * dx + dy * dy);
+    *ux = dx * Q14 / len;
+    *uy = dy * Q14 / len;
+}
+
+/**
+ * Build the ramp table and the fixed rate lookup. This uses floating
+ * point, but only once at start up.
+ */
+void planner_init(void) {
+    uint16_t i;
+
+    for (i = 0; i < ACCEL_TABLE_SIZE; ++i) {
+        double v = sqrt((double) ACCEL_START_RATE * ACCEL_START_RATE + (double) RAMP_V2 * i);
+        accel_period[i] = (uint16_t) (ACCEL_TICKS_PER_SEC / v + 0.5);
+    }
+
+    for (i = 0; i < MAX_STEPPER_SPEED_RANGES; ++i) {
+        // what timer_set_stepper_speed() used to program: (255 - 25 * speed) ticks at clk/256
+        fixed_index[i] = rate_to_index(ACCEL_TICKS_PER_SEC / (4 * (255 - 25 * (i + 1))));
+    }
+}
+
+/**
+ * Select the acceleration mode (HPGL AS). ACCEL_FIXMEDIUM runs every line
+ * at the old fixed rate for the current speed, without any ramping.
+ * Everything else uses the trapezoidal profiles.
+ */
+void planner_accel_mode(ACCEL_MODE mode) {
+    accel_mode = mode;
+}
+
+/**
+ * Set the feed rate in mm/s (HPGL VS). 0 goes back to the speed setting
+ * from the keypad.
+ */
+void planner_feed(uint16_t mm_s) {
+    feed = mm_s;
+}
+
+/**
+ * Feed in mm/s for HPGL VS, which is in cm/s. VS0, or anything faster than
+ * FEED_MAX, runs at FEED_MAX.
+ */
+uint16_t planner_vs_feed(FIXED cm_s) {
+    return (cm_s > 0 && cm_s < FIXED_FROM_INT(FEED_MAX) / 10) ? (uint16_t) FIXED_ROUND(cm_s * 10) : FEED_MAX;
+}
+
+/**
+ * Cruise speed index for a line of dx by dy steps, at the VS feed or at the
+ * speed setting from 1 to MAX_STEPPER_SPEED_RANGES. The feed is along the path,
+ * so it is turned into a major axis step rate using the length of the line in
+ * mm, and then limited so neither axis goes faster than it is allowed to.
+ *
+ * With the minor axis at b times the major one, both in the step length of
+ * the major axis, that rate is feed * steps per mm / sqrt(1 + b^2). It is
+ * worked out in fixed point, with the axis factors from configs.h, which may
+ * be at most 3 times apart. On the Expression they are the same.
+ */
+uint8_t planner_nominal(int speed, uint16_t dx, uint16_t dy) {
+    uint32_t feed16, steps, cross, b, rate, limit;
+    uint16_t major, minor;
+
+    if (speed > MAX_STEPPER_SPEED_RANGES) {
+        speed = MAX_STEPPER_SPEED_RANGES;
+    } else if (speed < 1) {
+        speed = 1;
+    }
+
+    if (accel_mode == ACCEL_FIXMEDIUM) {
+        return fixed_index[speed - 1];
+    }
+
+    // feed in mm/s, Q4
+    if (feed) {
+        feed16 = (uint32_t) feed * 16;
+    } else {
+        feed16 = FEED_MIN * 16 + (uint32_t) (FEED_MAX - FEED_MIN) * 16 * (speed - 1) / (MAX_STEPPER_SPEED_RANGES - 1);
+    }
+
+    if (dx >= dy) {
+        major = dx;
+        minor = dy;
+        steps = STEPS_X_Q8;
+        cross = X_PER_Y_Q14;
+    } else {
+        major = dy;
+        minor = dx;
+        steps = STEPS_Y_Q8;
+        cross = Y_PER_X_Q14;
+    }
+
+    if (major == 0) {
+        return 0;
+    }
+
+    b = (((uint32_t) minor << 14) / major * cross) >> 14; // Q14
+    rate = ((feed16 * steps) << 2) / isqrt((1UL << 28) + b * b);
+
+    if (dx) {
+        limit = (uint32_t) MAX_RATE_X * major / dx;
+        if (rate > limit) {
+            rate = limit;
+        }
+    }
+
+    if (dy) {
+        limit = (uint32_t) MAX_RATE_Y * major / dy;
+        if (rate > limit) {
+            rate = limit;
+        }
+    }
+
+    return rate_to_index(rate);
+}
+
+/**
+ * Speed index a line can start or stop at when the motors are at rest.
+ */
+uint8_t planner_entry(uint8_t nominal) {
+    return (accel_mode == ACCEL_FIXMEDIUM) ? nominal : 0;
+}
+
+/**
+ * Fastest speed index to go from a line along (dx0, dy0) into one along
+ * (dx1, dy1) without stopping. This is the junction deviation model from grbl:
+ * take the largest circle that fits in the corner while staying within
+ * JUNCTION_DEVIATION of it, and go around it at ACCEL_RATE centripetal
+ * acceleration:
+ *
+ *     v^2 = ACCEL_RATE * JUNCTION_DEVIATION * sin(t/2) / (1 - sin(t/2))
+ *
+ * where t is the inside angle of the corner. Nearly collinear lines get the
+ * top of the table, at 90 degrees or sharper it comes out below the start rate.
+ *
+ * This runs for every line, so it is all integer. With w the distance
+ * between the two unit directions, sin(t/2) = sqrt(1 - w^2/4) and
+ * 1 - sin(t/2) = (w^2/4) / (1 + sin(t/2)), which stays exact for the small
+ * bends that matter most, so:
+ *
+ *     v^2 = 4 * ACCEL_RATE * JUNCTION_DEVIATION * sin(t/2) * (1 + sin(t/2)) / w^2
+ */
+uint8_t planner_junction(int dx0, int dy0, int dx1, int dy1) {
+    int16_t ux0, uy0, ux1, uy1;
+    uint32_t w2, n, q;
+    uint16_t s;
+
+    if ((!dx0 && !dy0) || (!dx1 && !dy1)) {
+        return 0;
+    }
+
+    planner_unit(dx0, dy0, &ux0, &uy0);
+    planner_unit(dx1, dy1, &ux1, &uy1);
+
+    w2 = (int32_t) (ux0 - ux1) * (ux0 - ux1) + (int32_t) (uy0 - uy1) * (uy0 - uy1); // Q28
+
+    // 90 degrees or sharper
+    if (w2 >= 2UL << 28) {
+        return 0;
+    }
+
+    s = isqrt((1UL << 28) - w2 / 4); // sin(t/2), Q14
+    n = ((uint32_t) s * (Q14 + s)) >> 8; // Q20
+    w2 >>= 8;
+
+    if (!w2) {
+        return ACCEL_TABLE_SIZE - 1;
+    }
+
+    q = n * JUNCTION_K / w2; // v^2 / 64
+
+    return (q >= 1UL << 26) ? ACCEL_TABLE_SIZE - 1 : v2_to_index(q << 6);
+}
+
+/**
+ * Work out the trapezoid for a line of 'steps' steps that starts at speed
+ * index 'entry', has to end at 'exit', and cruises at 'nominal'. When the line
+ * is too short to reach the cruise speed, it becomes a triangle.
+ */
+void planner_profile(struct profile *p, uint16_t steps, uint8_t entry, uint8_t exit, uint8_t nominal) {
+    int16_t span = steps / ACCEL_STEPS_RAMP; // speed index change available over the whole line
+    int16_t up, down;
+
+    if (nominal < entry) {
+        nominal = entry;
+    }
+
+    if (nominal < exit) {
+        nominal = exit;
+    }
+
+    up = nominal - entry;
+    down = nominal - exit;
+
+    if (up + down > span) {
+        up = (span + exit - entry) / 2;
+
+        if (up < 0) {
+            up = 0;
+        } else if (up > span) {
+            up = span;
+        }
+
+        down = entry + up - exit;
+
+        if (down < 0) {
+            down = 0;
+        } else if (up + down > span) {
+            down = span - up;
+        }
+
+        nominal = entry + up;
+    }
+
+    p->entry = entry;
+    p->exit = nominal - down;
+    p->nominal = nominal;
+    p->accel_until = up * ACCEL_STEPS_RAMP;
+    p->decel_after = steps - down * ACCEL_STEPS_RAMP;
+}
+
+/**
+ * Step period for a speed index, in Timer0 ticks (see timer_set_step_period()).
+ */
+uint16_t planner_period(uint8_t index) {
+    return accel_period[index];
+}
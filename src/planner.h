@@ -0,0 +1,52 @@
+/**
+ * planner.h
+ *
+ * Acceleration planner for the stepper command queue
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ */
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <inttypes.h>
+
+#include "shvars.h"
+
+/**
+ * Speed profile of a single line. Speeds are indices into the ramp table,
+ * which is linear in v^2, so the index changes by exactly one every
+ * ACCEL_STEPS_RAMP steps while ramping.
+ */
+struct profile {
+    uint16_t accel_until; // accelerate up to and including this step
+    uint16_t decel_after; // decelerate after this step
+    uint8_t  entry;       // speed index at the first step
+    uint8_t  nominal;     // cruise speed index
+    uint8_t  exit;        // speed index at the last step
+};
+
+void     planner_init(void);
+void     planner_accel_mode(ACCEL_MODE mode);
+void     planner_feed(uint16_t feed);
+uint16_t planner_vs_feed(FIXED cm_s);
+uint8_t  planner_nominal(int speed, uint16_t dx, uint16_t dy);
+uint8_t  planner_entry(uint8_t nominal);
+uint8_t  planner_junction(int dx0, int dy0, int dx1, int dy1);
+void     planner_unit(int32_t dx, int32_t dy, int16_t *ux, int16_t *uy);
+void     planner_profile(struct profile *p, uint16_t steps, uint8_t entry, uint8_t exit, uint8_t nominal);
+uint16_t planner_period(uint8_t index);
+
+#endif
@@ -18,7 +18,6 @@
  *
  */
 #include <inttypes.h>
-#include <math.h>
 #include <avr/pgmspace.h>
 #include <stdio.h>
 
@@ -26,11 +25,38 @@
 #include "shvars.h"
 #include "scale.h"
 
-static double user_xscale, user_yscale, user_translate_x, user_translate_y;
+#define STEPSCALE_X_FIXED ((FIXED) (STEPSCALE_X * FIXED_ONE + 0.5))
+#define STEPSCALE_Y_FIXED ((FIXED) (STEPSCALE_Y * FIXED_ONE + 0.5))
+
+static FIXED user_xscale, user_yscale; // steps per user unit
+static STEPPER_COORD user_translate_x, user_translate_y; // steps at user (0, 0)
+static uint8_t user_identity; // user units are steps, nothing to do
+
+static void scale_set(FIXED xscale, FIXED yscale, STEPPER_COORD tx, STEPPER_COORD ty) {
+    user_xscale = xscale;
+    user_yscale = yscale;
+    user_translate_x = tx;
+    user_translate_y = ty;
+    user_identity = xscale == FIXED_ONE && yscale == FIXED_ONE && tx == 0 && ty == 0;
+}
+
+/**
+ * a * s rounded, where s is Q16.16. The product is split in 16 bit halves,
+ * so it never needs more than a 32 bit multiply.
+ */
+static int32_t fixed_mul(int32_t a, FIXED s) {
+    uint32_t ua = (a < 0) ? -a : a;
+    uint32_t us = (s < 0) ? -s : s;
+    uint16_t al = ua, sl = us;
+    uint32_t r;
+
+    r = (ua >> 16) * us + (uint32_t) al * (uint16_t) (us >> 16) + (((uint32_t) al * sl + 0x8000) >> 16);
+
+    return ((a < 0) != (s < 0)) ? -(int32_t) r : (int32_t) r;
+}
 
 void translate_init() {
-    user_xscale = user_yscale = 1;
-    user_translate_x = user_translate_y = 0;
+    scale_set(STEPSCALE_X_FIXED, STEPSCALE_Y_FIXED, 0, 0);
     ip_pad[0] = 0;
     ip_pad[1] = 0;
     ip_pad[2] = 9500;
@@ -41,32 +67,51 @@ void translate_init() {
     sc_pad[3] = 7000;
 }
 
-// use IP and SC data to calculate the scale
+// use IP and SC data to calculate the scale. This runs once per SC, so it can
+// afford 64 bit math to get the factors exact.
 void translate_scale() {
     int32_t ipxrange = ip_pad[2] - ip_pad[0];
     int32_t ipyrange = ip_pad[3] - ip_pad[1];
     int32_t scxrange = sc_pad[1] - sc_pad[0]; // xmax - xmin
     int32_t scyrange = sc_pad[3] - sc_pad[2]; // ymax - ymin
+    FIXED xscale, yscale;
+
+    if (scxrange == 0 || scyrange == 0) {
+        return; // no range to scale to, keep what we have
+    }
 
-    user_xscale = ((double) ipxrange) / ((double) scxrange);
-    user_yscale = ((double) ipyrange) / ((double) scyrange);
-    user_translate_x = -sc_pad[0] * user_xscale;
-    user_translate_y = -sc_pad[2] * user_yscale;
+    xscale = (int64_t) ipxrange * STEPSCALE_X_FIXED / scxrange;
+    yscale = (int64_t) ipyrange * STEPSCALE_Y_FIXED / scyrange;
 
-    printf_P(PSTR("Scale set to: (%f,%f) translate (%f,%f)"), user_xscale, user_yscale, user_translate_x, user_translate_y);
+    // user (xmin, ymin) lands on P1
+    scale_set(xscale, yscale,
+              FIXED_ROUND((int64_t) ip_pad[0] * STEPSCALE_X_FIXED - (int64_t) sc_pad[0] * xscale),
+              FIXED_ROUND((int64_t) ip_pad[1] * STEPSCALE_Y_FIXED - (int64_t) sc_pad[2] * yscale));
+
+    printf_P(PSTR("Scale set to: (%ld,%ld)/65536 translate (%ld,%ld)"), (long) xscale, (long) yscale, (long) user_translate_x, (long) user_translate_y);
 }
 
-void userprescale(double absx, double absy, double *ox, double *oy) {
-    *ox = absx / user_xscale;
-    *oy = absy / user_yscale;
+// user units of a language with a fixed unit (GP-GL), with the origin at
+// (ox, oy) of them
+void translate_units(FIXED steps_per_unit, USER_COORD ox, USER_COORD oy) {
+    scale_set(steps_per_unit, steps_per_unit, fixed_mul(ox, steps_per_unit), fixed_mul(oy, steps_per_unit));
 }
 
-void userscale(double fx, double fy, int16_t* x, int16_t* y, double* ox, double* oy) {
-    *x = (int) round(fx * STEPSCALE_X * user_xscale);
-    *y = (int) round(fy * STEPSCALE_Y * user_yscale);
+void userscale(USER_COORD fx, USER_COORD fy, STEPPER_COORD* x, STEPPER_COORD* y) {
+    if (user_identity) {
+        *x = fx;
+        *y = fy;
+        return;
+    }
+
+    *x = fixed_mul(fx, user_xscale) + user_translate_x;
+    *y = fixed_mul(fy, user_yscale) + user_translate_y;
+}
 
-    *ox = (*x) / (user_xscale * STEPSCALE_X);
-    *oy = (*y) / (user_yscale * STEPSCALE_Y);
+/// Steps per user unit of each axis, in Q16.16.
+void userscale_factors(FIXED* xscale, FIXED* yscale) {
+    *xscale = user_xscale;
+    *yscale = user_yscale;
 }
 
 USER_POINT scale_P1P2() {
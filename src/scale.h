@@ -4,32 +4,33 @@
 #include "shvars.h"
 
 /// Initialize translation and scale.
-///
-/// Translation is not implemented.
 void translate_init(void);
 
 /// Use IP and SC data to calculate the scale and translation.
-///
-/// Translation is not implemented. 
 void translate_scale(void);
 
-/// Transform user coordinates (fx,fy) into plotter coordinates (x,y) according to 
-/// the transform defined by IP/SC. Then do reverse transform, round and assign
-/// resulting values to (ox,oy).
+/// Use a fixed unit for the user coordinates, instead of IP and SC.
+/// @param	steps_per_unit	steps per user unit on both axes, in Q16.16
+/// @param	ox	user x of the origin
+/// @param	oy	user y of the origin
+void translate_units(FIXED steps_per_unit, USER_COORD ox, USER_COORD oy);
+
+/// Transform user coordinates (fx,fy) into absolute stepper coordinates (x,y)
+/// according to the transform defined by IP/SC, in Q16.16 fixed point.
 /// @param	fx 	user coordinates x
 /// @param	fy	user coordinates y
 /// @param  *x 	(output) absolute stepper x
 /// @param  *y 	(output) absolute stepper y
-/// @param	*ox (output) corrected fx
-/// @param	*oy (output) corrected fy
 ///
 /// @see STEPSCALE_X
 /// @see STEPSCALE_Y
-void userscale(double fx, double fy, int16_t* x, int16_t* y, double* ox, double* oy);
-
+void userscale(USER_COORD fx, USER_COORD fy, STEPPER_COORD* x, STEPPER_COORD* y);
 
-/// Something that shouldn't be used 
-void userprescale(double absx, double absy, double *ox, double *oy);
+/// Steps per user unit, without the translation. For arcs, which are scaled
+/// as a vector from their center.
+/// @param  *xscale	(output) steps per user unit along x, in Q16.16
+/// @param  *yscale	(output) steps per user unit along y, in Q16.16
+void userscale_factors(FIXED* xscale, FIXED* yscale);
 
 /// Something else that should not be used
 USER_POINT scale_P1P2(void);
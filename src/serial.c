@@ -24,9 +24,7 @@
  *   Copyright (c) 2011-2012 Sungeun K. Jeon
  */
 #include "avrlib.h"
-#include <avr/interrupt.h>
-#include <avr/io.h>
-#include <avr/iom1281.h>
+#include "hal.h"
 #include "serial.h"
 
 uint8_t serial_rx_buffer[RX_BUFFER_SIZE];
@@ -39,6 +37,17 @@ volatile uint8_t serial_tx_buffer_tail = 0;
 
 #ifdef ENABLE_XONXOFF
 volatile uint8_t flow_ctrl = XON_SENT; // Flow control state variable
+static uint8_t rx_buffer_full = RX_BUFFER_SIZE - 1 - RX_HEADROOM_MIN; // XOFF high watermark
+static uint8_t rx_buffer_low = (RX_BUFFER_SIZE - 1 - RX_HEADROOM_MIN) / 2; // XON low watermark
+#endif
+
+#ifdef ENABLE_CREDIT
+static volatile uint8_t credit_reset; // ENQ received, send ACK with the free space
+static volatile uint8_t credit_send; // the count byte of ACK <n> or DC2 <n> still has to go out
+static volatile uint8_t credit_count; // credits in that count byte
+static volatile uint8_t credit_tail; // RX tail when credits were last given out
+static uint8_t tx_pair[TX_BUFFER_SIZE / 8]; // bit set: this byte and the next go out back to back
+static volatile uint8_t tx_joined; // first byte of such a pair sent, hold the credits
 #endif
 
 // Returns the number of bytes used in the RX serial buffer.
@@ -66,33 +75,76 @@ uint8_t serial_get_tx_buffer_count() {
     return (TX_BUFFER_SIZE - (ttail - serial_tx_buffer_head));
 }
 
-void serial_init() {
-    // Set baud rate
-#if BAUD_RATE < 57600
-    uint16_t UBRR0_value = ((F_CPU / (8L * BAUD_RATE)) - 1) / 2;
-    UART1_STATUS &= ~(1 << U2X1); // baud doubler off  - Only needed on Uno XXX
-#else
-    uint16_t UBRR0_value = ((F_CPU / (4L * BAUD_RATE)) - 1) / 2;
-    UART1_STATUS |= (1 << U2X1); // baud doubler on for high baud rates, i.e. 115200
+// UBRR value for a baud rate, with the baud doubler on from 57600 up.
+
+static uint16_t baud_ubrr(uint32_t baud) {
+    return ((F_CPU / ((baud >= 57600 ? 4L : 8L) * baud)) - 1) / 2;
+}
+
+uint8_t serial_baud_valid(uint32_t baud) {
+    uint32_t actual;
+
+    if (baud < 2400 || baud > BAUD_RATE_MAX) {
+        return 0;
+    }
+
+    actual = F_CPU / ((baud >= 57600 ? 8L : 16L) * (baud_ubrr(baud) + 1));
+
+    // 250000, 500000 and 1000000 are exact at 16 MHz, 115200 is 2.1% off
+    return (actual > baud ? actual - baud : baud - actual) <= baud / 40;
+}
+
+uint8_t serial_set_baud(uint32_t baud) {
+    uint16_t UBRR0_value = baud_ubrr(baud);
+
+    if (!serial_baud_valid(baud)) {
+        return 0;
+    }
+
+    // let the last bytes at the old rate go out, the host may be waiting for them.
+    // TXC is cleared for every byte sent, so it is set once the last one has left.
+    if (hal_uart_tx_on()) {
+        while (serial_tx_buffer_tail != serial_tx_buffer_head) {
+            hal_idle();
+        }
+        while (!hal_uart_tx_done()) {
+            hal_idle();
+        }
+    }
+
+    hal_uart_baud(UBRR0_value, baud >= 57600); // baud doubler on for high baud rates, i.e. 115200
+
+#ifdef ENABLE_XONXOFF
+    {
+        // bytes the host can still send after XOFF, 10 bits per byte
+        uint16_t headroom = baud / 10 * XOFF_LATENCY_US / 1000000UL;
+
+        if (headroom < RX_HEADROOM_MIN) {
+            headroom = RX_HEADROOM_MIN;
+        }
+
+        rx_buffer_full = RX_BUFFER_SIZE - 1 - headroom;
+        rx_buffer_low = rx_buffer_full / 2;
+    }
 #endif
-    UBRR1H = UBRR0_value >> 8;
-    UBRR1L = UBRR0_value;
 
-    // enable rx and tx
-    UART1_CONTROL |= 1 << RXEN1;
-    UART1_CONTROL |= 1 << TXEN1;
+    return 1;
+}
+
+void serial_init() {
+    serial_set_baud(BAUD_RATE);
 
-    // enable interrupt on complete reception of a byte
-    UART1_CONTROL |= 1 << RXCIE1;
+    // enable rx and tx, and the interrupt on complete reception of a byte
+    hal_uart_init();
 
     // defaults to 8-bit, no parity, 1 stop bit
 }
 
 
-// Writes one byte to the TX serial buffer. Called by main program.
-// TODO: Check if we can speed this up for writing strings, rather than single bytes.
+// Stores one byte in the TX serial buffer. 'pair' keeps the next byte
+// right behind it, with no credit reply in between.
 
-void serial_write(uint8_t data) {
+static void tx_put(uint8_t data, uint8_t pair) {
     // Calculate next head
     uint8_t next_head = serial_tx_buffer_head + 1;
 
@@ -102,34 +154,93 @@ void serial_write(uint8_t data) {
 
     // Wait until there is space in the buffer
     while (next_head == serial_tx_buffer_tail) {
-        // NOOP
+        hal_idle();
     }
 
     // Store data and advance head
     serial_tx_buffer[serial_tx_buffer_head] = data;
+#ifdef ENABLE_CREDIT
+    // only the main program writes tx_pair, and the ISR doesn't read this slot yet
+    if (pair) {
+        tx_pair[serial_tx_buffer_head / 8] |= 1 << (serial_tx_buffer_head & 7);
+    } else {
+        tx_pair[serial_tx_buffer_head / 8] &= ~(1 << (serial_tx_buffer_head & 7));
+    }
+#else
+    (void) pair;
+#endif
     serial_tx_buffer_head = next_head;
 
     // Enable Data Register Empty Interrupt to make sure tx-streaming is running
-    UART1_CONTROL |= (1 << UART1_UDRIE);
+    hal_uart_tx_start();
+}
+
+// Writes one byte to the TX serial buffer. Called by main program.
+// TODO: Check if we can speed this up for writing strings, rather than single bytes.
+
+void serial_write(uint8_t data) {
+    tx_put(data, 0);
+}
+
+// Writes a two byte reply, like the ACK <seq> of the binary stream. The
+// host reads ACK <n> and DC2 <n> credits out of the same stream, so these
+// must not be split up by one.
+
+void serial_write_pair(uint8_t code, uint8_t data) {
+    tx_put(code, 1);
+    tx_put(data, 0);
+}
+
+#ifdef ENABLE_CREDIT
+// The host has read enough to hand out another chunk of credits.
+
+static inline uint8_t credit_due(void) {
+    return flow_ctrl == FLOW_CREDIT && (uint8_t) (serial_rx_buffer_tail - credit_tail) >= CREDIT_CHUNK;
 }
+#endif
 
 // Data Register Empty Interrupt handler
 
-ISR(UART1_TRANSMIT_INTERRUPT) {
+HAL_ISR(HAL_UART_TX_VECT) {
     uint8_t tail = serial_tx_buffer_tail; // Temporary serial_tx_buffer_tail (to optimize for volatile)
 
+    hal_uart_tx_clear(); // clear transmit complete, serial_set_baud() waits for it
+
+#ifdef ENABLE_CREDIT
+    // ISRs don't nest, so nothing else touches the credit state while we're here
+    if (credit_send) {
+        // second byte of ACK <n> or DC2 <n>
+        hal_uart_put(credit_count);
+        credit_send = 0;
+    } else if (!tx_joined && credit_reset) {
+        // (with tx_joined set the second byte of a pair has to go first)
+        credit_reset = 0;
+        credit_tail = serial_rx_buffer_tail;
+        credit_count = RX_BUFFER_SIZE - 1 - serial_get_rx_buffer_count();
+        credit_send = 1;
+        hal_uart_put(ACK_CHAR);
+    } else if (!tx_joined && credit_due()) {
+        credit_count = serial_rx_buffer_tail - credit_tail;
+        credit_tail += credit_count;
+        credit_send = 1;
+        hal_uart_put(DC2_CHAR);
+    } else
+#endif
 #ifdef ENABLE_XONXOFF
     if (flow_ctrl == SEND_XOFF) {
-        UART1_DATA = XOFF_CHAR;
+        hal_uart_put(XOFF_CHAR);
         flow_ctrl = XOFF_SENT;
     } else if (flow_ctrl == SEND_XON) {
-        UART1_DATA = XON_CHAR;
+        hal_uart_put(XON_CHAR);
         flow_ctrl = XON_SENT;
     } else
 #endif
-    {
+    if (tail != serial_tx_buffer_head) {
         // Send a byte from the buffer
-        UART1_DATA = serial_tx_buffer[tail];
+        hal_uart_put(serial_tx_buffer[tail]);
+#ifdef ENABLE_CREDIT
+        tx_joined = tx_pair[tail / 8] & (1 << (tail & 7));
+#endif
 
         // Update tail position
         ++tail;
@@ -141,8 +252,13 @@ ISR(UART1_TRANSMIT_INTERRUPT) {
     }
 
     // Turn off Data Register Empty Interrupt to stop tx-streaming if this concludes the transfer
+#ifdef ENABLE_CREDIT
+    // Between the two bytes of a pair it stops too, tx_put() starts it again.
+    if (tail == serial_tx_buffer_head && (tx_joined || (!credit_send && !credit_reset && !credit_due()))) {
+#else
     if (tail == serial_tx_buffer_head) {
-        UART1_CONTROL &= ~(1 << UART1_UDRIE);
+#endif
+        hal_uart_tx_stop();
     }
 }
 
@@ -164,9 +280,15 @@ uint8_t serial_read() {
         serial_rx_buffer_tail = tail;
 
 #ifdef ENABLE_XONXOFF
-        if ((serial_get_rx_buffer_count() < RX_BUFFER_LOW) && flow_ctrl == XOFF_SENT) {
+        if ((serial_get_rx_buffer_count() < rx_buffer_low) && flow_ctrl == XOFF_SENT) {
             flow_ctrl = SEND_XON;
-            UART1_CONTROL |= (1 << UART1_UDRIE); // Force TX
+            hal_uart_tx_start(); // Force TX
+        }
+#endif
+
+#ifdef ENABLE_CREDIT
+        if (flow_ctrl == FLOW_CREDIT && (uint8_t) (tail - credit_tail) >= CREDIT_CHUNK) {
+            hal_uart_tx_start(); // hand the credits back
         }
 #endif
 
@@ -174,12 +296,21 @@ uint8_t serial_read() {
     }
 }
 
-ISR(UART1_RECEIVE_INTERRUPT) {
-    uint8_t data = UART1_DATA;
+HAL_ISR(HAL_UART_RX_VECT) {
+    uint8_t data = hal_uart_get();
     uint8_t next_head;
 
     // Pick off runtime command characters directly from the serial stream. These characters are
     // not passed into the buffer, but these set system state flag bits for runtime execution.
+#ifdef ENABLE_CREDIT
+    if (data == ENQ_CHAR) {
+        flow_ctrl = FLOW_CREDIT;
+        credit_reset = 1;
+        hal_uart_tx_start(); // Force TX
+        return;
+    }
+#endif
+
     next_head = serial_rx_buffer_head + 1;
     if (next_head == RX_BUFFER_SIZE) {
         next_head = 0;
@@ -191,9 +322,9 @@ ISR(UART1_RECEIVE_INTERRUPT) {
         serial_rx_buffer_head = next_head;
 
 #ifdef ENABLE_XONXOFF
-        if ((serial_get_rx_buffer_count() >= RX_BUFFER_FULL) && flow_ctrl == XON_SENT) {
+        if ((serial_get_rx_buffer_count() >= rx_buffer_full) && flow_ctrl == XON_SENT) {
             flow_ctrl = SEND_XOFF;
-            UART1_CONTROL |= (1 << UART1_UDRIE); // Force TX
+            hal_uart_tx_start(); // Force TX
         }
 #endif
         //TODO: else alarm on overflow?
@@ -204,6 +335,8 @@ void serial_reset_read_buffer() {
     serial_rx_buffer_tail = serial_rx_buffer_head;
 
 #ifdef ENABLE_XONXOFF
-    flow_ctrl = XON_SENT;
+    if (flow_ctrl != FLOW_CREDIT) {
+        flow_ctrl = XON_SENT;
+    }
 #endif
 }
@@ -26,19 +26,14 @@
 #ifndef serial_h
 #define serial_h
 
-#define BAUD_RATE                   9600
+#define BAUD_RATE                   9600    // at power up, the host can change it with BD
+#define BAUD_RATE_MAX               1000000
 
 #define ENABLE_XONXOFF
-
-#define UART1_RECEIVE_INTERRUPT     USART1_RX_vect
-#define UART1_TRANSMIT_INTERRUPT    USART1_UDRE_vect
-#define UART1_STATUS                UCSR1A
-#define UART1_CONTROL               UCSR1B
-#define UART1_DATA                  UDR1
-#define UART1_UDRIE                 UDRIE1
+#define ENABLE_CREDIT
 
 #ifndef RX_BUFFER_SIZE
-#define RX_BUFFER_SIZE              128
+#define RX_BUFFER_SIZE              256     // at most 256, the indices are 8 bit
 #endif
 #ifndef TX_BUFFER_SIZE
 #define TX_BUFFER_SIZE              64
@@ -47,21 +42,51 @@
 #define SERIAL_NO_DATA              0xFF
 
 #ifdef ENABLE_XONXOFF
-#define RX_BUFFER_FULL              96 // XOFF high watermark
-#define RX_BUFFER_LOW               32 // XON low watermark
+// The XOFF watermark leaves room for what the host sends before it reacts
+// to XOFF, so it depends on the baud rate. See serial_set_baud().
+#define XOFF_LATENCY_US             1000    // time for the host to stop sending after XOFF
+#define RX_HEADROOM_MIN             32      // room left after XOFF at low rates
 #define SEND_XOFF                   1
 #define SEND_XON                    2
 #define XOFF_SENT                   3
 #define XON_SENT                    4
+#define FLOW_CREDIT                 5 // credit mode, no XON/XOFF
 #define XOFF_CHAR                   0x13
 #define XON_CHAR                    0x11
 #endif
 
+// Credit flow control. The host sends ENQ, waits for ACK <n>, and then never
+// has more than n bytes in flight. Every CREDIT_CHUNK bytes the firmware reads,
+// it hands them back with DC2 <n>. ENQ and the replies stay out of the data
+// stream, and the host drops any DC2 <n> that comes before the ACK.
+#ifdef ENABLE_CREDIT
+#ifndef ENABLE_XONXOFF
+#error "ENABLE_CREDIT needs ENABLE_XONXOFF"
+#endif
+#if RX_BUFFER_SIZE != 256
+#error "ENABLE_CREDIT counts credits with 8 bit buffer indices"
+#endif
+#define CREDIT_CHUNK                32
+#define ENQ_CHAR                    0x05
+#define ACK_CHAR                    0x06
+#define DC2_CHAR                    0x12
+#endif
+
 void serial_init(void);
 
+// Returns 0 when a baud rate can't be made within 2.5% from F_CPU.
+uint8_t serial_baud_valid(uint32_t baud);
+
+// Change the baud rate, after everything in the TX buffer has been sent.
+// Returns 0 when the rate is not valid.
+uint8_t serial_set_baud(uint32_t baud);
+
 // Writes one byte to the TX serial buffer. Called by main program.
 void serial_write(uint8_t data);
 
+// Writes a two byte reply, with no credit reply slipping in between.
+void serial_write_pair(uint8_t code, uint8_t data);
+
 // Fetches the first byte in the serial read buffer. Called by main program.
 uint8_t serial_read(void);
 
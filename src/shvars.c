@@ -2,8 +2,7 @@
 
 #include "shvars.h"
 
-char scratchpad[SCRATCHPAD_SIZE];
-double numpad[4];
+FIXED numpad[4];
 int32_t ip_pad[4];
 int32_t sc_pad[4];
 
@@ -1,14 +1,20 @@
 #ifndef _SHVARS_H
 #define _SHVARS_H
 
-#define SCRATCHPAD_SIZE 64
-
 ///< Absolute coordinates used for stepper motion.
 ///< Negative means invalid.
-typedef int16_t STEPPER_COORD;
+typedef int32_t STEPPER_COORD;
 
 ///< User coordinates used in input, arc calculation etc.
-typedef double USER_COORD;
+///< Whole plotter units, as they come from the HPGL scanner.
+typedef int32_t USER_COORD;
+
+///< Q16.16 fixed point, used for HPGL parameters and scale factors.
+typedef int32_t FIXED;
+
+#define FIXED_ONE           0x10000L
+#define FIXED_FROM_INT(i)   ((FIXED) (i) * FIXED_ONE)
+#define FIXED_ROUND(f)      ((int32_t) (((f) + FIXED_ONE / 2) >> 16))
 
 typedef struct _stepper_xy {
     STEPPER_COORD x;
@@ -31,8 +37,7 @@ typedef enum _acceleration_modes {
     ACCEL_DECEL, ///< Ramp speed down
 } ACCEL_MODE;
 
-extern char scratchpad[]; ///< character scratchpad used by scanner
-extern double numpad[]; ///< stored parameters of AA and similar commands
+extern FIXED numpad[]; ///< stored parameters of AA and similar commands
 extern int32_t ip_pad[]; ///< stored parameters of IP command (4)
 extern int32_t sc_pad[]; ///< stored parameters of SC command (4)
 
@@ -0,0 +1,619 @@
+/**
+ * spool.c
+ *
+ * Store-then-cut. With store mode on, a job coming in from the host is not
+ * cut right away, but written to the dataflash as it arrives. Nothing has to
+ * wait for the motors, so the host can send at full line rate, and is free
+ * to go once the job is in. The job ends when no data has come in for
+ * SPOOL_IDLE_TICKS, and is then cut.
+ *
+ * The HPGL (or GP-GL) is parsed, scaled and clipped while it comes in, and
+ * stored as the step records of the binary stream (bincmd.c). A stored job
+ * goes straight from the flash into the stepper queue, without being parsed
+ * again, and is usually a third of the size of the HPGL.
+ *
+ * Every job goes in the slot picked with the digit keys, and is kept in the
+ * catalog (catalog.c) with its length, CRC, bounding box and the picture
+ * name from HPGL BP. CUT cuts the job in the selected slot, REPEATLAST the
+ * newest one. The CRC is checked before a job is cut. With path ordering
+ * on, a job is reordered (order.c) before it is cut.
+ *
+ * A stored job can be cut a number of times in one go. The copies are laid
+ * out over the media by moving the origin (see stepper_set_offset()): down
+ * the carriage first, then along X, each one the size of the bounding box
+ * plus COPY_GAP from the last. The next copy is read from the flash as soon
+ * as the records of the last one are in the queue, so the motors never wait.
+ *
+ * Jobs go in one after the other, the flash is used as a ring, and the
+ * oldest jobs are written over first. While store mode waits for a job, the
+ * free part of the ring is erased ahead, so the writer can keep up with the
+ * serial port.
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <util/crc16.h>
+
+#include "configs.h"
+#include "spool.h"
+#include "flash.h"
+#include "catalog.h"
+#include "order.h"
+#include "bincmd.h"
+#include "hpgl.h"
+#include "planner.h"
+#include "stepper.h"
+#include "knife.h"
+#include "lang.h"
+#include "display.h"
+
+#define CONVERT_MAX (1 + BIN_RECORD_MAX) // most record bytes one byte of HPGL gives (IN gives a FEED and a MOVE)
+
+typedef enum {
+    SPOOL_IDLE, // data goes straight to the parser
+    SPOOL_ARMED, // store mode, waiting for a job
+    SPOOL_STORING, // receiving a job into the flash
+    SPOOL_PLAYING, // cutting a job from the flash
+} SPOOL_STATE;
+
+static SPOOL_STATE state = SPOOL_IDLE;
+static uint8_t store_mode;
+static uint8_t slot; // selected slot, new jobs go here
+static uint8_t idle; // 25Hz ticks since the last byte came in
+static uint8_t full; // the job did not fit
+static uint32_t length; // bytes in the job being played
+static uint32_t played; // bytes read from the flash so far
+static uint8_t play_buf[32]; // records read, but not run yet
+static uint8_t play_len, play_pos;
+static uint16_t play_page; // first page of the job being played
+static uint8_t copies = 1; // copies to cut of the next job
+static uint8_t copy, copies_now; // copy being cut, and how many of the job being played
+static uint8_t rows; // copies down the carriage
+static STEPPER_COORD base_x, base_y; // origin of the first copy
+static STEPPER_COORD pitch_x, pitch_y; // distance between copies
+static struct cat_entry job; // the job being stored
+static uint32_t written; // record bytes of it so far
+static uint8_t rec[64]; // records not in the flash yet
+static uint8_t rec_len;
+static uint8_t name_len;
+static uint8_t box_set; // the bounding box has a point
+static uint8_t pen_set; // pen position known
+static STEPPER_COORD pen_x, pen_y; // end of the last stored MOVE or DRAW, starts at (0, 0) like bincmd_record()
+
+static SPOOL_STATE rest_state(void) {
+    return store_mode ? SPOOL_ARMED : SPOOL_IDLE;
+}
+
+/**
+ * Get the flash ready for the next job, without touching the stored ones
+ * ahead of it.
+ */
+static void erase_ahead(void) {
+    flash_erase_ahead(catalog_next_page(), catalog_keep_page());
+}
+
+/**
+ * Add a point of a cut to the bounding box.
+ */
+static void extend_box(STEPPER_COORD x, STEPPER_COORD y) {
+    if (!box_set || x < job.min_x) {
+        job.min_x = x;
+    }
+
+    if (!box_set || x > job.max_x) {
+        job.max_x = x;
+    }
+
+    if (!box_set || y < job.min_y) {
+        job.min_y = y;
+    }
+
+    if (!box_set || y > job.max_y) {
+        job.max_y = y;
+    }
+
+    box_set = 1;
+}
+
+/**
+ * True for a point that can be on the media, in either feed mode.
+ */
+static uint8_t on_media(STEPPER_COORD x, STEPPER_COORD y) {
+    return x >= 0 && x <= MAX_X_ROLL && y >= 0 && y <= MAX_Y;
+}
+
+/**
+ * Add a record to the job.
+ */
+static void put(uint8_t type, int32_t a, int32_t b) {
+    uint8_t n = bincmd_encode(rec + rec_len, type, a, b);
+
+    written += n;
+
+    while (n--) {
+        job.crc = _crc_ccitt_update(job.crc, rec[rec_len++]);
+    }
+}
+
+/**
+ * Add a MOVE or DRAW to (x, y).
+ */
+static void put_point(uint8_t type, STEPPER_COORD x, STEPPER_COORD y) {
+    put(type, x - pen_x, y - pen_y);
+    pen_x = x;
+    pen_y = y;
+    pen_set = 1;
+}
+
+/**
+ * Add a DRAW to (x, y), and put the cut in the bounding box.
+ */
+static void put_draw(STEPPER_COORD x, STEPPER_COORD y) {
+    if (pen_set) {
+        extend_box(pen_x, pen_y);
+    }
+
+    extend_box(x, y);
+    put_point(BIN_DRAW, x, y);
+}
+
+/**
+ * Hand the records to the flash, as far as it takes them without waiting.
+ * When the flash is full, they are dropped.
+ */
+static void drain(void) {
+    uint8_t n = flash_write_block(rec, rec_len);
+
+    if (n < rec_len && flash_write_full()) {
+        full = 1;
+        n = rec_len;
+    }
+
+    rec_len -= n;
+    memmove(rec, rec + n, rec_len);
+}
+
+/**
+ * Run a byte of the job being stored through the parser, and turn what comes
+ * out into records, as cli.c would have run them. Also finds the bounding box
+ * of the cuts and the picture name. Nothing moves.
+ */
+static void convert(uint8_t c) {
+    STEPPER_COORD x, y;
+    uint8_t lb;
+    int8_t cmd = lang_char(c, &x, &y, &lb);
+    int8_t pen;
+
+    switch (cmd) {
+        case CMD_PU:
+        case CMD_SEEK0:
+            if (on_media(x, y)) {
+                put_point(BIN_MOVE, x, y);
+            }
+            break;
+
+        case CMD_PD:
+            if (on_media(x, y)) {
+                put_draw(x, y);
+            }
+            break;
+
+        case CMD_ARCABS:
+        case CMD_BEZIER:
+        case CMD_LB:
+            // the only commands that can give more than CONVERT_MAX, so this waits for the flash
+            while ((pen = lang_next(cmd, &x, &y)) != CMD_CONT) {
+                while (rec_len > sizeof(rec) - BIN_RECORD_MAX) {
+                    drain();
+                }
+
+                if (!on_media(x, y)) {
+                    continue;
+                }
+
+                if (pen == CMD_PD) {
+                    put_draw(x, y);
+                } else {
+                    put_point(BIN_MOVE, x, y);
+                }
+            }
+            break;
+
+        case CMD_INIT:
+            put(BIN_FEED, 0, 0);
+            put_point(BIN_MOVE, 0, 0);
+            break;
+
+        case CMD_PG:
+            put(BIN_PAGE, 0, 0);
+            break;
+
+        case CMD_AS:
+            put(BIN_ACCEL, numpad[0] != 0, 0);
+            break;
+
+        case CMD_VS:
+            put(BIN_FEED, planner_vs_feed(numpad[0]), 0);
+            break;
+
+        case CMD_FC:
+            // a machine setting, like BD, so it is not stored with the job
+            knife_set(numpad[0], numpad[1], numpad[2]);
+            break;
+
+        case CMD_BP:
+            if (lb && name_len < CAT_NAME_LEN) {
+                job.name[name_len++] = lb;
+            }
+            break;
+
+        default:
+            // BD and BN are about the link to the host, not the job
+            break;
+    }
+}
+
+/**
+ * Write out the last page of the job being stored, and put it in the
+ * catalog.
+ */
+static void end_job(void) {
+    uint16_t next;
+
+    while (rec_len) {
+        drain();
+    }
+
+    next = flash_flush();
+
+    state = rest_state();
+    catalog_clobber(job.page, full ? flash_ring_pages() : flash_ring_distance(job.page, next));
+
+    if (full) {
+        display_puts("Job too large");
+    } else {
+        job.length = written;
+        catalog_put(slot, &job);
+        display_puts("Job stored");
+
+        if (order_get_mode()) {
+            order_job(slot);
+        }
+    }
+
+    if (store_mode) {
+        erase_ahead();
+    }
+}
+
+/**
+ * Turn store mode on or off. Turning it off while a job is coming in ends
+ * that job, without cutting it.
+ */
+void spool_store_mode(uint8_t on) {
+    store_mode = on;
+
+    if (state == SPOOL_STORING) {
+        end_job();
+    } else if (state != SPOOL_PLAYING) {
+        state = rest_state();
+    }
+
+    if (on && state == SPOOL_ARMED) {
+        erase_ahead();
+    }
+}
+
+uint8_t spool_get_store_mode(void) {
+    return store_mode;
+}
+
+/**
+ * Select the slot new jobs go in, and CUT cuts. Shows what is in it: the
+ * name and the size of the cut area in mm.
+ */
+void spool_select(uint8_t s) {
+    const struct cat_entry *e = catalog_get(s);
+    char string[40];
+
+    slot = s;
+
+    if (e) {
+        sprintf(string, "%u: %.*s %ldx%ldmm", s, CAT_NAME_LEN, e->name,
+                (long) ((e->max_x - e->min_x) / STEPS_PER_MM_X), (long) ((e->max_y - e->min_y) / STEPS_PER_MM_Y));
+    } else {
+        sprintf(string, "%u: empty", s);
+    }
+
+    display_puts(string);
+}
+
+uint8_t spool_get_slot(void) {
+    return slot;
+}
+
+/**
+ * True when data from the host has to go to spool_write().
+ */
+uint8_t spool_storing(void) {
+    return state == SPOOL_ARMED || state == SPOOL_STORING;
+}
+
+/**
+ * Number of bytes spool_write() can take without waiting for the flash.
+ * Whatever they turn into has to fit in the flash buffer and in rec[].
+ */
+uint16_t spool_room(void) {
+    if (rec_len) {
+        drain();
+    }
+
+    return (flash_write_room() + sizeof(rec) - rec_len) / CONVERT_MAX;
+}
+
+void spool_write(const uint8_t *data, uint16_t bytes) {
+    uint16_t i;
+
+    if (state == SPOOL_ARMED) {
+        memset(&job, 0, sizeof(job));
+        job.page = catalog_next_page();
+        job.crc = 0xffff;
+        written = 0;
+        rec_len = 0;
+        name_len = 0;
+        box_set = 0;
+        pen_set = 0;
+        pen_x = pen_y = 0;
+        full = 0;
+        lang_job();
+        flash_start_write(job.page);
+        state = SPOOL_STORING;
+        display_puts("Receiving job");
+    }
+
+    idle = 0;
+
+    for (i = 0; i < bytes; ++i) {
+        convert(data[i]);
+    }
+
+    drain();
+}
+
+/**
+ * Called at 25Hz. Ends a job once the host has gone quiet, and starts
+ * cutting it.
+ */
+void spool_tick(void) {
+    if (state != SPOOL_STORING || ++idle < SPOOL_IDLE_TICKS) {
+        return;
+    }
+
+    end_job();
+
+    if (!full) {
+        spool_play(slot);
+    }
+}
+
+/**
+ * Set the number of copies CUT and REPEATLAST cut, and show it.
+ */
+void spool_copies(uint8_t n) {
+    char string[40];
+
+    if (n < 1) {
+        n = 1;
+    } else if (n > COPIES_MAX) {
+        n = COPIES_MAX;
+    }
+
+    copies = n;
+    sprintf(string, "Copies: %u", n);
+    display_puts(string);
+}
+
+uint8_t spool_get_copies(void) {
+    return copies;
+}
+
+/**
+ * Work out where the copies of a job go, from the origin set now. Returns
+ * how many fit on the media, at most COPIES_MAX.
+ */
+static uint8_t layout(const struct cat_entry *e) {
+    int32_t cols, fit;
+
+    stepper_get_offset(&base_x, &base_y);
+    pitch_x = e->max_x - e->min_x + COPY_GAP;
+    pitch_y = e->max_y - e->min_y + COPY_GAP;
+
+    fit = (MAX_Y - base_y - e->max_y) / pitch_y + 1;
+    rows = (fit < 1) ? 1 : (fit > COPIES_MAX) ? COPIES_MAX : fit;
+
+    cols = (stepper_max_x() - base_x - e->max_x) / pitch_x + 1;
+    fit = (cols < 1) ? 1 : (cols > COPIES_MAX) ? COPIES_MAX * rows : cols * rows;
+
+    return (fit > COPIES_MAX) ? COPIES_MAX : fit;
+}
+
+/**
+ * Set the number of copies to as many of the job in the selected slot as
+ * fit on the media (FITPAGE). In roll feed mode that is COPIES_MAX.
+ */
+void spool_fit_copies(void) {
+    const struct cat_entry *e = catalog_get(slot);
+
+    if (!e) {
+        display_puts("Slot is empty");
+        return;
+    }
+
+    spool_copies(layout(e));
+}
+
+/**
+ * Start the next copy of the job being played: move the origin, go there
+ * with the pen up and read the job again from the start.
+ */
+static void next_copy(void) {
+    char string[40];
+
+    stepper_set_offset(base_x + (copy / rows) * pitch_x, base_y + (copy % rows) * pitch_y);
+    stepper_move(0, 0);
+    bincmd_origin();
+
+    flash_end_read();
+    flash_start_read(play_page);
+    played = 0;
+    play_len = 0;
+    play_pos = 0;
+
+    sprintf(string, "Cutting copy %u/%u", copy + 1, copies_now);
+    display_puts(string);
+}
+
+/**
+ * The job being played is done or stopped. After copies, the origin goes
+ * back to where the first one was.
+ */
+static void end_play(char *msg) {
+    flash_end_read();
+
+    if (copies_now > 1) {
+        stepper_set_offset(base_x, base_y);
+    }
+
+    state = rest_state();
+    display_puts(msg);
+}
+
+/**
+ * Start cutting the job in a slot, after checking its CRC. Returns 0 if
+ * there is no job there, or the spooler is busy.
+ */
+uint8_t spool_play(uint8_t s) {
+    const struct cat_entry *e = catalog_get(s);
+    uint8_t buf[32];
+    char string[40];
+    uint16_t crc = 0xffff;
+    uint32_t left;
+    uint16_t n, i;
+
+    if (!e || state == SPOOL_STORING || state == SPOOL_PLAYING) {
+        return 0;
+    }
+
+    flash_start_read(e->page);
+
+    for (left = e->length; left; left -= n) {
+        n = (left > sizeof(buf)) ? sizeof(buf) : left;
+        flash_read_block(buf, n);
+
+        for (i = 0; i < n; ++i) {
+            crc = _crc_ccitt_update(crc, buf[i]);
+        }
+    }
+
+    flash_end_read();
+
+    if (crc != e->crc) {
+        display_puts("Job damaged");
+        return 1;
+    }
+
+    copies_now = layout(e);
+
+    if (copies_now > copies) {
+        copies_now = copies;
+    }
+
+    bincmd_origin();
+    flash_start_read(e->page);
+    play_page = e->page;
+    length = e->length;
+    played = 0;
+    play_len = 0;
+    play_pos = 0;
+    copy = 0;
+    state = SPOOL_PLAYING;
+
+    if (copies_now < copies) {
+        sprintf(string, "Only %u copies fit", copies_now);
+        display_puts(string);
+    } else {
+        display_puts("Cutting job");
+    }
+
+    return 1;
+}
+
+uint8_t spool_playing(void) {
+    return state == SPOOL_PLAYING;
+}
+
+/**
+ * Feed the records of the job being played to the stepper queue, until it
+ * is full. The job ends after the last one.
+ */
+void spool_run(void) {
+    uint16_t n;
+
+    while (stepper_queue_room()) {
+        if (play_len - play_pos < BIN_RECORD_MAX && played < length) {
+            play_len -= play_pos;
+            memmove(play_buf, play_buf + play_pos, play_len);
+            play_pos = 0;
+
+            n = sizeof(play_buf) - play_len;
+
+            if (n > length - played) {
+                n = length - played;
+            }
+
+            flash_read_block(play_buf + play_len, n);
+            play_len += n;
+            played += n;
+        }
+
+        n = bincmd_record(play_buf + play_pos, play_len - play_pos);
+
+        if (!n) {
+            // out of records
+            if (++copy < copies_now) {
+                next_copy();
+                continue;
+            }
+
+            end_play("Job done");
+            return;
+        }
+
+        play_pos += n;
+    }
+}
+
+/**
+ * Abandon the job being played (STOP). It can still be cut again.
+ */
+void spool_stop(void) {
+    if (state == SPOOL_PLAYING) {
+        end_play("Job stopped");
+    }
+}
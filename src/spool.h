@@ -0,0 +1,43 @@
+/**
+ * spool.h
+ *
+ * Store-then-cut job spooling, see spool.c
+ *
+ * This file is part of FreeExpression.
+ *
+ * https://github.com/thetazzbot/FreeExpression
+ *
+ * FreeExpression is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ *
+ * FreeExpression is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <inttypes.h>
+
+void spool_store_mode(uint8_t on);
+uint8_t spool_get_store_mode(void);
+void spool_select(uint8_t s);
+uint8_t spool_get_slot(void);
+void spool_copies(uint8_t n);
+uint8_t spool_get_copies(void);
+void spool_fit_copies(void);
+uint8_t spool_storing(void);
+uint16_t spool_room(void);
+void spool_write(const uint8_t *data, uint16_t bytes);
+void spool_tick(void);
+uint8_t spool_play(uint8_t s);
+uint8_t spool_playing(void);
+void spool_run(void);
+void spool_stop(void);
+
+#endif
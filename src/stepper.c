@@ -21,6 +21,12 @@
  * blade starting point on the mat. A small amount of negative X is allowed
  * to roll the mat out of the machine.
  *
+ * Motion is a two stage pipeline. The main loop takes lines from the command
+ * queue in stepper_prep(), runs Bresenham and the speed profile, and chops the
+ * result into small segments of up to 8 steps at a constant period. The Timer0
+ * ISR only pops those segments and writes the phase table to PORTA/PORTC, so
+ * its cost is the same for every kind of command.
+ *
  * This source original developed by  https://github.com/Arlet/Freecut
  *
  * This file is part of FreeExpression.
@@ -39,30 +45,26 @@
  * along with FreeExpression. If not, see http://www.gnu.org/licenses/.
  *
  */
-#include "avrlib.h"
-#include <avr/wdt.h>
-#include <avr/io.h>
-#include <avr/iom1281.h>
-#include <avr/interrupt.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <util/atomic.h>
 
+#include "configs.h"
+#include "hal.h"
 #include "stepper.h"
 #include "keypad.h"
 #include "timer.h"
 #include "display.h"
+#include "planner.h"
+#include "knife.h"
 
 #define MAT_EDGE        250         // distance to roll to load mat
 #define HOME_Y_LEAD     100         // distance to move the carriage out before homing.
-#define MAX_Y           4800        // This is the width of the carriage 4800 == 12"
-#define MAX_X           32000       // That's 80 inches of vinyl cutting --
+#define ROLL_GAP        400         // space left between pages in roll feed mode, 1"
+#define LINE_MAX_STEPS  32767       // longer lines are split, so Bresenham and the planner can stay 16 bit
 #define MOTOR_OFF_DEL   30000       // number of iterations through the ISR after last motor movement before the stepper power gets turned off
-// 30000 is about 1 minute at speed 5
-
-#define HOME            (1 << 1 )   // PD1, attached to 'home' push button
-#define PEN             (1 << 2)    // PE2, attached to pen up/down output
-
-#define at_home()       (!(PIND & HOME))
+// 30000 is about 1 minute at the idle tick rate
+#define IDLE_PERIOD     520         // ISR period while not moving, in Timer0 ticks. This is the old speed 5 rate.
 
 /**
  * motor phases: There are 16 different stepper motor phases, using
@@ -111,18 +113,55 @@ static uint8_t StepperPhaseTable[] = {
 /* *
  * current location of cutter.
  *
-  The two variables loc_x and loc_y represent the current x/y location of the cutting tool and the lower 4 bits are directly
-  used to look up the stepper motor drive signals via the phase table (16 micro-steps in the stepper_tick ISR.
-  This implies that loc_xand loc_y always have to increment/decrement in steps of 1 in order to execute through all the phases.
+  The two variables loc_x and loc_y represent the x/y location of the cutting tool after the last step handed to the ISR.
+  The ISR keeps its own phase counters phase_x and phase_y, which always increment/decrement in steps of 1 and whose
+  lower 4 bits are used to look up the stepper motor drive signals via the phase table (16 micro-steps).
 
  * Initialize at left (away from home switch), and with the mat touching
  * the rollers, such that loading the mat is a simple movement to (0,0)
  */
 
-static volatile int loc_x = -MAT_EDGE;
-static volatile int loc_y = -HOME_Y_LEAD; // This is  the axis we need t home first -- negative number prohibits any movement of Y axis for cutting until homed
-static volatile int ofs_x = 0; // Stores an offset to the absolute 0 of the X axis -- As set by the offset keyboard command
-static volatile int ofs_y = 0; // ""
+static volatile STEPPER_COORD loc_x = -MAT_EDGE;
+static volatile STEPPER_COORD loc_y = -HOME_Y_LEAD; // This is  the axis we need t home first -- negative number prohibits any movement of Y axis for cutting until homed
+static volatile STEPPER_COORD ofs_x = 0; // Stores an offset to the absolute 0 of the X axis -- As set by the offset keyboard command
+static volatile STEPPER_COORD ofs_y = 0; // ""
+
+/**
+ * loc_x/loc_y are 32 bit, and the ISR moves loc_y while homing, so outside
+ * stepper_prep() they are only read and written with interrupts off, or a
+ * value could be half from before a step and half from after. stepper_prep()
+ * waits for the homing to finish, so it uses them as they are.
+ */
+static void get_loc(STEPPER_COORD *x, STEPPER_COORD *y) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        *x = loc_x;
+        *y = loc_y;
+    }
+}
+
+static void set_loc(STEPPER_COORD x, STEPPER_COORD y) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        loc_x = x;
+        loc_y = y;
+    }
+}
+
+/**
+ * roll feed mode: X is not limited to the length of the mat, and every page
+ * feed moves the X origin past what has been cut, onto fresh vinyl.
+ */
+static uint8_t roll_mode;
+static STEPPER_COORD roll_end; // furthest X cut on the current page
+
+/**
+ * location at the end of the last line put in the queue, and the direction of
+ * that line. The planner needs them to know the length of the next line and the
+ * angle at the junction before the ISR gets to it.
+ */
+static STEPPER_COORD plan_x, plan_y;
+static int plan_dx, plan_dy; // at most LINE_MAX_STEPS
+static int plan_speed; // speed of the last SPEED command queued
+static uint8_t speed_cmds; // SPEED commands queued, lines behind them are planned at plan_speed
 
 /**
  * current pressure
@@ -139,10 +178,15 @@ static struct bresenham {
     char steep; // y > x
 } b;
 
-static int step_delay; // delay between steps (if not 0)
+static struct profile prof; // speed profile of the line being chopped into segments
+static uint8_t rate; // speed index after the last step handed to the ISR
+static uint8_t line_active; // a line is being chopped into segments
+static uint8_t pen_state; // pen position after the last segment handed to the ISR
+
+static volatile uint8_t step_delay; // delay between steps (if not 0)
 static unsigned short motor_off_delay = MOTOR_OFF_DEL;
 
-static enum state {
+static volatile enum state {
     HOME0 = 0,
     HOME1, // homing until switch is pushed
     HOME2, // reversing until switch is released
@@ -150,6 +194,37 @@ static enum state {
     LINE // draw straight line
 } ActionState;
 
+/**
+ * segment queue, between stepper_prep() and the ISR. Each segment is either
+ * up to 8 steps at the same period, with a bit per step telling which axes
+ * move, or a single pen/pressure action.
+ */
+#define SEG_QUEUE_SIZE  32 // must be power of two
+#define SEG_MAX_STEPS   8
+
+enum seg_action {
+    SEG_STEP, // steps
+    SEG_PEN_UP, // lift the pen, then wait
+    SEG_PEN_DOWN, // drop the pen, then wait
+    SEG_PRESSURE, // set the pressure, value in period
+};
+
+struct segment {
+    uint16_t period; // Timer0 period after each step
+    uint8_t action; // enum seg_action
+    uint8_t count; // number of steps left
+    uint8_t xmask; // bit n set: X moves at step n
+    uint8_t ymask; // bit n set: Y moves at step n
+    int8_t dx; // X direction
+    int8_t dy; // Y direction
+};
+
+static struct segment seg_queue[SEG_QUEUE_SIZE];
+static volatile uint8_t seg_head, seg_tail;
+static volatile struct segment seg; // segment the ISR is working on
+static volatile uint8_t stopped; // STOP was pressed, the ISR waits for stepper_prep() to flush everything
+static uint8_t phase_x, phase_y; // stepper phase, only used by the ISR
+
 /**
  * command queue. The stepper controller takes commands from the queue
  * using step timer interrupt. Main program can put new commands in.
@@ -170,40 +245,81 @@ enum type {
 
 struct cmd {
     enum type action_type; // command type,
-    int x, y; // target coordinates
+    STEPPER_COORD x, y; // target coordinates
+    struct profile prof; // speed profile for MOVE/DRAW, as used by the ISR
+    uint16_t steps; // number of steps in main direction
+    uint8_t nominal; // cruise speed index
+    uint8_t max_entry; // fastest safe speed at the junction with the previous line, 0 if it has to stop
+    uint8_t entry; // planned entry speed, only used by replan()
 } cmd_queue[CMD_QUEUE_SIZE];
 
 static volatile uint8_t cmd_head, cmd_tail;
 
+/**
+ * nothing queued, and the motors are standing still
+ */
+static uint8_t stepper_idle(void) {
+    return cmd_head == cmd_tail && !line_active && seg_head == seg_tail && ActionState == READY;
+}
+
+/**
+ * number of free places in the command queue, so a stored job can be fed
+ * in without waiting for the motors
+ */
+uint8_t stepper_queue_room(void) {
+    return CMD_QUEUE_SIZE - (uint8_t) (cmd_head - cmd_tail);
+}
+
 // Store the current position of the cutter in offset x and y.
 // Later used for positioning relative to this recorded origin
 
 void stepper_set_origin00(void) {
+    STEPPER_COORD x, y;
+
     // if there is anything in the queue don't do it , we are in the middle of cutting possibly
-    if (cmd_head != cmd_tail) {
+    if (!stepper_idle()) {
         return;
     }
 
-    if (loc_x < 0 || loc_y < 0) {
+    get_loc(&x, &y);
+
+    if (x < 0 || y < 0) {
         // can't take negative offset, media is not loaded or not homed yet
         return;
     }
 
-    ofs_x = loc_x;
-    ofs_y = loc_y;
+    ofs_x = x;
+    ofs_y = y;
+    knife_reset(x, y);
+}
+
+/**
+ * Origin that the coordinates of the moves queued from now on are relative
+ * to. Moves already in the queue keep theirs.
+ */
+void stepper_set_offset(STEPPER_COORD x, STEPPER_COORD y) {
+    ofs_x = x;
+    ofs_y = y;
+}
+
+void stepper_get_offset(STEPPER_COORD *x, STEPPER_COORD *y) {
+    *x = ofs_x;
+    *y = ofs_y;
 }
 
 // Find Y home via switch and assume the unloaded media position.
 
 void stepper_home(void) {
     // if there is anything in the queue don't do it , we are in the middle of cutting
-    if (cmd_head != cmd_tail) {
+    if (!stepper_idle()) {
         return;
     }
 
     pen_up();
-    loc_y = -HOME_Y_LEAD;
-    loc_x = -MAT_EDGE;
+    set_loc(-MAT_EDGE, -HOME_Y_LEAD);
+    plan_x = -MAT_EDGE;
+    plan_y = 0; // where homing will leave the carriage
+    knife_reset(plan_x, plan_y);
 
     ActionState = HOME0; // immediately do a home sequence
 }
@@ -211,8 +327,7 @@ void stepper_home(void) {
 // Take stepper drivers off power --
 
 void stepper_off(void) {
-    PORTA = 0;
-    PORTC = 0;
+    hal_motors(0, 0);
 }
 
 /**
@@ -221,8 +336,12 @@ void stepper_off(void) {
 static struct cmd * alloc_cmd(uint8_t type) {
     struct cmd *cmd;
 
+    stepper_prep();
+
     while ((uint8_t) (cmd_head - cmd_tail) >= CMD_QUEUE_SIZE) {
-        wdt_reset();
+        hal_wdt_reset();
+        hal_idle();
+        stepper_prep();
     }
 
     cmd = &cmd_queue[cmd_head % CMD_QUEUE_SIZE];
@@ -232,7 +351,7 @@ static struct cmd * alloc_cmd(uint8_t type) {
 }
 
 /**
- * get next command from the queue (called in ISR)
+ * get next command from the queue (called from stepper_prep())
  */
 static struct cmd * get_cmd(void) {
     if (cmd_head == cmd_tail) {
@@ -243,61 +362,259 @@ static struct cmd * get_cmd(void) {
 }
 
 /**
- * Cut to coordinate (x, y).
+ * Look-ahead over the lines in the queue. Walk backwards from the newest line,
+ * which has to be able to stop, and raise the entry speed of every line joined
+ * to its predecessor as far as the junction angle and the deceleration over the
+ * line allow. Then walk forwards to limit every exit speed to what can be
+ * reached by accelerating, and work out the new profiles.
+ *
+ * The first line in the queue keeps the entry speed it already has, since
+ * that is what the line stepper_prep() is working on is going to end at.
  */
-void stepper_draw(int x, int y) {
-    struct cmd *cmd = alloc_cmd(DRAW); // This call blocks if the queue is full
+static void replan(void) {
+    struct cmd *cmd, *next;
+    uint8_t first = cmd_tail, i, n, speed = 0;
+
+    for (i = cmd_head; i != first;) {
+        cmd = &cmd_queue[--i % CMD_QUEUE_SIZE];
 
+        if (cmd->action_type != MOVE && cmd->action_type != DRAW) {
+            speed = 0;
+            continue;
+        }
+
+        n = cmd->max_entry;
+        if (speed + cmd->steps / ACCEL_STEPS_RAMP < n) {
+            n = speed + cmd->steps / ACCEL_STEPS_RAMP;
+        }
+
+        cmd->entry = n;
+        speed = n;
+    }
+
+    speed = cmd_queue[first % CMD_QUEUE_SIZE].prof.entry;
+
+    for (i = first; i != cmd_head; ++i) {
+        cmd = &cmd_queue[i % CMD_QUEUE_SIZE];
+        next = &cmd_queue[(uint8_t) (i + 1) % CMD_QUEUE_SIZE];
+
+        if (cmd->action_type != MOVE && cmd->action_type != DRAW) {
+            speed = 0;
+            continue;
+        }
+
+        // exit at the speed the next line wants to enter at, if we can get there
+        n = ((uint8_t) (i + 1) != cmd_head && next->max_entry) ? next->entry : 0;
+        if (speed + cmd->steps / ACCEL_STEPS_RAMP < n) {
+            n = speed + cmd->steps / ACCEL_STEPS_RAMP;
+        }
+
+        planner_profile(&cmd->prof, cmd->steps, speed, n, cmd->nominal);
+        speed = cmd->prof.exit;
+    }
+}
+
+/**
+ * Put a MOVE or DRAW to (x, y) in the queue. It starts out with a profile that
+ * starts and ends at rest, and when it continues the previous line with the pen
+ * in the same state, replan() speeds up the junction. (x, y) can not be more
+ * than LINE_MAX_STEPS away from the end of the previous line.
+ */
+static void queue_line(struct cmd *cmd, STEPPER_COORD x, STEPPER_COORD y) {
+    struct cmd *prev = &cmd_queue[(uint8_t) (cmd_head - 1) % CMD_QUEUE_SIZE];
+    int dx, dy;
+    unsigned steps;
+    uint8_t entry;
+
+    dx = x - plan_x;
+    dy = y - plan_y;
+    steps = (dx < 0) ? -dx : dx;
+    if (steps < (unsigned) ((dy < 0) ? -dy : dy)) {
+        steps = (dy < 0) ? -dy : dy;
+    }
+
+    cmd->max_entry = 0;
+
+    if (cmd_head != cmd_tail && prev->action_type == cmd->action_type) {
+        // repeated point in a polyline, nothing to do
+        if (steps == 0) {
+            return;
+        }
+
+        cmd->max_entry = planner_junction(plan_dx, plan_dy, dx, dy);
+    }
+
+    cmd->steps = steps;
+    cmd->nominal = planner_nominal(speed_cmds ? plan_speed : timer_get_stepper_speed(), (dx < 0) ? -dx : dx, (dy < 0) ? -dy : dy);
+    entry = planner_entry(cmd->nominal);
+    planner_profile(&cmd->prof, steps, entry, entry, cmd->nominal);
+
+    if (cmd->max_entry > cmd->nominal) {
+        cmd->max_entry = cmd->nominal;
+    }
+
+    if (cmd->max_entry > prev->nominal) {
+        cmd->max_entry = prev->nominal;
+    }
+
+    plan_dx = dx;
+    plan_dy = dy;
+    cmd->x = plan_x = x;
+    cmd->y = plan_y = y;
+    ++cmd_head; // this really allocates the entry in the queue
+
+    if (cmd->max_entry > entry) {
+        replan();
+    }
+}
+
+/**
+ * Put a MOVE or DRAW to (x, y) in the queue, split in equal pieces of at most
+ * LINE_MAX_STEPS. The pieces are in line, so they run on at full speed.
+ */
+static void queue_path(uint8_t type, STEPPER_COORD x, STEPPER_COORD y) {
+    STEPPER_COORD dx, dy;
+    uint32_t n;
+
+    // nothing queued or moving, so the planned location has to be the real one
+    if (stepper_idle()) {
+        get_loc(&plan_x, &plan_y);
+    }
+
+    dx = (x > plan_x) ? x - plan_x : plan_x - x;
+    dy = (y > plan_y) ? y - plan_y : plan_y - y;
+    n = ((dx > dy ? dx : dy) + LINE_MAX_STEPS - 1) / LINE_MAX_STEPS;
+
+    for (; n > 1; --n) {
+        struct cmd *cmd = alloc_cmd(type); // This call blocks if the queue is full
+
+        queue_line(cmd, plan_x + (x - plan_x) / (STEPPER_COORD) n, plan_y + (y - plan_y) / (STEPPER_COORD) n);
+    }
+
+    queue_line(alloc_cmd(type), x, y);
+}
+
+/**
+ * furthest X the cutter may go
+ */
+STEPPER_COORD stepper_max_x(void) {
+    return roll_mode ? MAX_X_ROLL : MAX_X;
+}
+
+/**
+ * Queue the points the blade offset stage (knife.c) made of a move or a
+ * cut. They can be up to the blade offset off the media, those are pulled
+ * back onto it.
+ */
+static void queue_knife(void) {
+    STEPPER_COORD x, y;
+    uint8_t draw;
+
+    while (knife_next(&draw, &x, &y)) {
+        if (x < (draw ? 0 : -MAT_EDGE)) {
+            x = draw ? 0 : -MAT_EDGE;
+        } else if (x > stepper_max_x()) {
+            x = stepper_max_x();
+        }
+
+        if (y < 0) {
+            y = 0;
+        } else if (y > MAX_Y) {
+            y = MAX_Y;
+        }
+
+        queue_path(draw ? DRAW : MOVE, x, y);
+    }
+}
+
+/**
+ * Cut to coordinate (x, y).
+ */
+void stepper_draw(STEPPER_COORD x, STEPPER_COORD y) {
     x += ofs_x;
     y += ofs_y;
 
-    if (x < 0 || x > MAX_X || y < 0 || y > MAX_Y) {
+    if (x < 0 || x > stepper_max_x() || y < 0 || y > MAX_Y) {
         // don't do it if it's outside the media
         return;
     }
 
-    cmd->x = x;
-    cmd->y = y;
-    ++cmd_head; // this really allocates the entry in the queue
+    if (x > roll_end) {
+        roll_end = x;
+    }
+
+    knife_draw(x, y);
+    queue_knife();
 }
 
 /**
  * move to coordinate (x, y) (with cutter up). We allow moving
  * beyond the mat so that it will roll out.
  */
-void stepper_move(int x, int y) {
-    struct cmd *cmd = alloc_cmd(MOVE); // This call blocks if the queue is full
-
+void stepper_move(STEPPER_COORD x, STEPPER_COORD y) {
     x += ofs_x;
     y += ofs_y;
 
-    if (x < -MAT_EDGE || x > MAX_X || y < 0 || y > MAX_Y) {
+    if (x < -MAT_EDGE || x > stepper_max_x() || y < 0 || y > MAX_Y) {
         // don't do it if it's outside the media
         return;
     }
 
-    cmd->x = x;
-    cmd->y = y;
-    ++cmd_head; // this really allocates the entry in the queue
+    knife_move(x, y);
+    queue_knife();
 }
 
 /**
  * This moves the cutter/ media freely within the machines range limits - can be used to set offsets and jog the carriage around
  */
 static void stepper_jogRelative(int x, int y) {
-    struct cmd *cmd = alloc_cmd(MOVE);
+    STEPPER_COORD jx, jy;
+
+    if (stepper_idle()) {
+        get_loc(&plan_x, &plan_y);
+    }
 
-    x += loc_x; // relative to the current position
-    y += loc_y;
+    jx = plan_x + x; // relative to where the last jog ends
+    jy = plan_y + y;
 
-    if (x < -MAX_X || x > MAX_X || y < 0 || y > MAX_Y) {
+    if (jx < -MAX_X || jx > stepper_max_x() || jy < 0 || jy > MAX_Y) {
         // don't do it if it's outside the range of motion
         return;
     }
 
-    cmd->x = x;
-    cmd->y = y;
-    ++cmd_head; // this really allocates the entry in the queue
+    queue_path(MOVE, jx, jy);
+    knife_reset(jx, jy);
+}
+
+/**
+ * Page feed (HPGL PG). On the mat this goes back to the origin. In roll feed
+ * mode the X origin moves to just past the furthest cut of this page, so the
+ * next page starts on fresh vinyl.
+ */
+void stepper_page(void) {
+    if (roll_mode && roll_end > ofs_x) {
+        ofs_x = roll_end + ROLL_GAP;
+        roll_end = ofs_x;
+    }
+
+    stepper_move(0, 0);
+}
+
+/**
+ * Turn roll feed mode on or off. Only while nothing is queued, since it
+ * changes the X limit.
+ */
+void stepper_roll_mode(uint8_t on) {
+    if (!stepper_idle()) {
+        return;
+    }
+
+    roll_mode = on;
+    roll_end = ofs_x;
+}
+
+uint8_t stepper_get_roll_mode(void) {
+    return roll_mode;
 }
 
 /**
@@ -350,29 +667,45 @@ void stepper_speed(int speed) {
     struct cmd *cmd = alloc_cmd(SPEED);
     cmd->x = speed;
     ++cmd_head;
+
+    // the timer only changes when the command is taken from the queue,
+    // but the lines queued after it have to be planned at the new speed
+    plan_speed = speed;
+    ++speed_cmds;
 }
 
 /**
  * Loading the media: The mat/media needs to be pulled under the rollers first.
  */
 void stepper_load_paper(void) {
-    if (loc_y < 0) {
+    STEPPER_COORD x, y;
+
+    get_loc(&x, &y);
+
+    if (y < 0) {
         // not homed yet
         return;
     }
 
-    if (loc_x < 0) {
+    if (x < 0) {
         // if media is not loaded yet
-        loc_x = -MAT_EDGE; // This is the distance we pull in the mat -- if origin offsets are in effect it will drive to the last recorded position
-        stepper_move(0, loc_y); // move media to location 0, this is the HOME point for X
+        set_loc(-MAT_EDGE, y); // This is the distance we pull in the mat -- if origin offsets are in effect it will drive to the last recorded position
+        plan_x = -MAT_EDGE;
+        stepper_move(0, y); // move media to location 0, this is the HOME point for X
         stepper_move(0, 0); // make sure Y is at zero as well -- GS: not sure why it would not be
     }
 }
 
 /**
- * Unloading the media: go to absolute 0 minus the MAT feed distance to free the mat/media
+ * Unloading the media: go to absolute 0 minus the MAT feed distance to free the mat/media.
+ * A roll is not pulled back, but fed forward past the last page so it can be cut off.
  */
 void stepper_unload_paper(void) {
+    if (roll_mode) {
+        stepper_page();
+        return;
+    }
+
     stepper_move(-(MAT_EDGE + ofs_x), -ofs_y); // move to absolute position
 }
 
@@ -390,30 +723,34 @@ void stepper_pressure(int pressure) {
  * to work OK when you leave it on.
  */
 void pen_up(void) {
-    if (PORTE & PEN) {
+    if (hal_pen_is_down()) {
         step_delay = 50;
     }
 
-    PORTE &= ~PEN;
+    hal_pen_up();
+    pen_state = 0;
 }
 
 /**
  * move pen down
  */
 void pen_down(void) {
-    int pe = PORTE;
+    STEPPER_COORD x, y;
+
+    get_loc(&x, &y);
 
-    if (loc_x < 0 || loc_y < 0) {
+    if (x < 0 || y < 0) {
         // prevent dropping the cutter when there is no media underneath
         return;
     }
 
-    if (pe & PEN) {
+    if (hal_pen_is_down()) {
         // already down, ignore
         return;
     }
 
-    PORTE |= PEN;
+    hal_pen_down();
+    pen_state = 1;
 
     step_delay = 50;
 }
@@ -422,8 +759,8 @@ void pen_down(void) {
  * initialize Bresenham line drawing algorithm. Draw from (x, y)
  * to (x1, y1).
  */
-static void bresenham_init(int x1, int y1) {
-    int dx, dy;
+static void bresenham_init(STEPPER_COORD x1, STEPPER_COORD y1) {
+    int dx, dy; // at most LINE_MAX_STEPS
 
     if (x1 > loc_x) {
         b.dx = 1;
@@ -456,65 +793,191 @@ static void bresenham_init(int x1, int y1) {
 }
 
 /**
- * perform single step in Bresenham line drawing algorithm.
+ * Speed index after step number 'step' of the current line. The index changes
+ * once every ACCEL_STEPS_RAMP steps while accelerating or decelerating.
  */
-static enum state bresenham_step(void) {
-    if (b.step >= b.steps) {
-        return READY;
+static uint8_t profile_rate(uint16_t step) {
+    if (step <= prof.accel_until) {
+        if (!(step & (ACCEL_STEPS_RAMP - 1)) && rate < prof.nominal) {
+            return rate + 1;
+        }
+    } else if (step > prof.decel_after) {
+        if (!((step - prof.decel_after) & (ACCEL_STEPS_RAMP - 1)) && rate > prof.exit) {
+            return rate - 1;
+        }
     }
 
-    ++b.step;
-    if ((b.error -= b.delta) < 0) {
-        b.error += b.steps;
-        loc_x += b.dx;
-        loc_y += b.dy;
-    } else if (b.steep) {
-        loc_y += b.dy;
-    } else {
-        loc_x += b.dx;
+    return rate;
+}
+
+/**
+ * Run Bresenham for the next few steps of the current line, and put them in
+ * one segment. A segment ends after SEG_MAX_STEPS steps, at the end of the line,
+ * or when the speed changes.
+ */
+static void bresenham_segment(struct segment *s) {
+    uint8_t n = 0, next;
+
+    s->action = SEG_STEP;
+    s->xmask = s->ymask = 0;
+    s->dx = b.dx;
+    s->dy = b.dy;
+
+    do {
+        next = profile_rate(b.step + 1);
+        if (n && next != rate) {
+            break; // this step starts the next segment
+        }
+        rate = next;
+
+        ++b.step;
+        if ((b.error -= b.delta) < 0) {
+            b.error += b.steps;
+            s->xmask |= 1 << n;
+            s->ymask |= 1 << n;
+            loc_x += b.dx;
+            loc_y += b.dy;
+        } else if (b.steep) {
+            s->ymask |= 1 << n;
+            loc_y += b.dy;
+        } else {
+            s->xmask |= 1 << n;
+            loc_x += b.dx;
+        }
+    } while (++n < SEG_MAX_STEPS && b.step < b.steps);
+
+    s->count = n;
+    s->period = planner_period(rate);
+
+    if (b.step >= b.steps) {
+        line_active = 0;
     }
+}
 
-    return LINE;
+/**
+ * Put a pen or pressure action in the segment queue.
+ */
+static void queue_action(struct segment *s, uint8_t action, uint16_t value) {
+    s->action = action;
+    s->period = value;
+    s->count = 0;
+    ++seg_head;
 }
 
 /**
- * get next command from command queue. Called from the ISR at the READY state
+ * get next command from command queue, and set up the segments for it.
  */
-enum state do_next_command(void) {
+static void next_command(struct segment *s) {
     struct cmd *cmd = get_cmd();
 
     if (cmd == NULL) {
-        return READY; // Stay at the ready
+        return;
     }
 
     switch (cmd->action_type) {
         case MOVE:
         case DRAW:
             if (cmd->action_type == MOVE) {
-                pen_up();
-            } else {
-                pen_down();
+                if (pen_state) {
+                    pen_state = 0;
+                    queue_action(s, SEG_PEN_UP, IDLE_PERIOD);
+                }
+            } else if (!pen_state && loc_x >= 0 && loc_y >= 0) {
+                // only drop the cutter when there is media underneath
+                pen_state = 1;
+                queue_action(s, SEG_PEN_DOWN, IDLE_PERIOD);
             }
 
             // No motion required -- already where we want to go on both axes
             if (loc_x == cmd->x && loc_y == cmd->y) {
-                return READY;
+                return;
             }
 
             bresenham_init(cmd->x, cmd->y);
-            return LINE;
+            prof = cmd->prof;
+            rate = prof.entry;
+            line_active = 1;
+            break;
 
         case PRESSURE:
             pressure = cmd->x;
-            timer_set_pen_pressure(pressure);
+            queue_action(s, SEG_PRESSURE, pressure);
             break;
 
         case SPEED:
             timer_set_stepper_speed(cmd->x);
+            --speed_cmds;
             break;
     }
+}
 
-    return READY;
+/**
+ * Count the bits in a step mask.
+ */
+static uint8_t mask_steps(uint8_t mask) {
+    uint8_t n = 0;
+
+    for (; mask; mask >>= 1) {
+        n += mask & 1;
+    }
+
+    return n;
+}
+
+/**
+ * STOP was pressed. Throw away everything that is queued, and take back
+ * the steps the ISR never made, so loc_x/loc_y match the motors again.
+ */
+static void stepper_flush(void) {
+    uint8_t i;
+
+    seg.count = 0;
+    loc_x -= seg.dx * mask_steps(seg.xmask);
+    loc_y -= seg.dy * mask_steps(seg.ymask);
+
+    for (i = seg_tail; i != seg_head; ++i) {
+        struct segment *s = &seg_queue[i % SEG_QUEUE_SIZE];
+
+        if (s->action == SEG_STEP) {
+            loc_x -= s->dx * mask_steps(s->xmask);
+            loc_y -= s->dy * mask_steps(s->ymask);
+        }
+    }
+
+    seg_head = seg_tail;
+    cmd_tail = cmd_head;
+    speed_cmds = 0;
+    knife_reset(loc_x, loc_y);
+    line_active = 0;
+    pen_state = 0;
+    stopped = 0;
+}
+
+/**
+ * Keep the segment queue filled from the command queue. Called from the main
+ * loop, and while waiting for room in the command queue.
+ */
+void stepper_prep(void) {
+    if (stopped) {
+        stepper_flush();
+    }
+
+    if (ActionState < READY) {
+        return; // homing
+    }
+
+    while ((uint8_t) (seg_head - seg_tail) < SEG_QUEUE_SIZE) {
+        struct segment *s = &seg_queue[seg_head % SEG_QUEUE_SIZE];
+
+        if (line_active) {
+            bresenham_segment(s);
+            ++seg_head;
+        } else if (cmd_head != cmd_tail) {
+            next_command(s);
+        } else {
+            break;
+        }
+    }
 }
 
 /**
@@ -527,14 +990,15 @@ void stepper_tick(void) {
         return;
     }
 
-    // abort cutting if 'STOP' is pressed.
+    // abort cutting if 'STOP' is pressed. stepper_prep() empties the queues.
     // TODO: This is not sufficient -- also need to stop the flow of new commands from the UART and signal to the PC
     // that we want to abort the job, otherwise we only stop what is currently in the queue
     if (keypad_stop_pressed()) {
+        stopped = 1;
         ActionState = READY;
-        cmd_tail = cmd_head;
-        pen_up();
+        hal_pen_up();
         stepper_off();
+        timer_set_step_period(IDLE_PERIOD);
     }
 
     switch (ActionState) {
@@ -542,6 +1006,7 @@ void stepper_tick(void) {
             if (loc_y < 0) {
                 // first move out by the offset given in the home init
                 ++loc_y; // so that the initial power on jolt doesn't trigger switch
+                ++phase_y;
             } else {
                 ActionState = HOME1;
             }
@@ -551,8 +1016,9 @@ void stepper_tick(void) {
         case HOME1:
             step_delay = 1; // home at a reduced speed
 
-            if (!at_home()) {
+            if (!hal_at_home()) {
                 loc_y--; // moving the carriage toward the home location
+                phase_y--;
             } else {
                 ActionState = HOME2; // home switch touched -- now move the other way
             }
@@ -561,8 +1027,9 @@ void stepper_tick(void) {
         case HOME2:
             step_delay = 4;
 
-            if (at_home()) {
+            if (hal_at_home()) {
                 ++loc_y; // move the other way until the switch opens
+                ++phase_y;
             } else {
                 loc_y = 0; // now this is home on Y axis
                 ofs_x = ofs_y = 0;
@@ -571,13 +1038,57 @@ void stepper_tick(void) {
             break;
 
         case READY:
-            if ((ActionState = do_next_command()) == READY) {
-                break;
+        case LINE:
+            if (stopped) {
+                break; // leave what is left of the segment for stepper_flush()
             }
-            // else fall through to LINE
 
-        case LINE:
-            ActionState = bresenham_step(); // this gets the next loc_x and loc_y, incremented, decremented or left unchanged for the single step motion below
+            if (!seg.count) {
+                // take the next segment, straight away so joined lines don't stall
+                if (seg_head == seg_tail) {
+                    ActionState = READY;
+                    timer_set_step_period(IDLE_PERIOD);
+                    break;
+                }
+
+                seg = seg_queue[seg_tail % SEG_QUEUE_SIZE];
+                ++seg_tail;
+                timer_set_step_period(seg.period);
+
+                switch (seg.action) {
+                    case SEG_PEN_UP:
+                        hal_pen_up();
+                        step_delay = 50;
+                        break;
+
+                    case SEG_PEN_DOWN:
+                        hal_pen_down();
+                        step_delay = 50;
+                        break;
+
+                    case SEG_PRESSURE:
+                        timer_set_pen_pressure(seg.period);
+                        break;
+                }
+
+                if (!seg.count) {
+                    break;
+                }
+
+                ActionState = LINE;
+            }
+
+            if (seg.xmask & 1) {
+                phase_x += seg.dx;
+            }
+
+            if (seg.ymask & 1) {
+                phase_y += seg.dy;
+            }
+
+            seg.xmask >>= 1;
+            seg.ymask >>= 1;
+            --seg.count;
             break;
     }
 
@@ -585,7 +1096,7 @@ void stepper_tick(void) {
     if (ActionState == READY) {
         /* *
          * The motors get quite hot when powered on, so we turn them off after a certain time of idling.
-         * Note this time is tied to the stepper speed, i.e. at high motor speed this time is shorter
+         * Note this time is counted in ISR ticks at IDLE_PERIOD
          */
         if (motor_off_delay) {
             motor_off_delay--;
@@ -594,8 +1105,7 @@ void stepper_tick(void) {
         }
     } else {
         // this is where the motion happens, command the stepper drives to the next step phase (1 out of 16)
-        PORTA = StepperPhaseTable[ loc_x & 0x0f ]; // low 4 bits determine phase
-        PORTC = StepperPhaseTable[ loc_y & 0x0f ];
+        hal_motors(StepperPhaseTable[ phase_x & 0x0f ], StepperPhaseTable[ phase_y & 0x0f ]); // low 4 bits determine phase
         motor_off_delay = MOTOR_OFF_DEL; // reset the timeout for the stepper motor power down
     }
 }
@@ -605,9 +1115,6 @@ void stepper_tick(void) {
  */
 void stepper_init(void) {
     stepper_off();
-    DDRA = 0xff;
-    DDRC = 0xff;
-    DDRE |= PEN;
-    PORTD |= HOME; // enable pull-up
+    hal_stepper_init(); // motor and pen outputs, pull-up on the home switch
     stepper_home(); // Find the X home via switch
 }
@@ -24,21 +24,36 @@
 #ifndef STEPPER_H
 #define STEPPER_H
 
+#include <inttypes.h>
+
+#include "shvars.h"
+
+#define MAX_Y           4800        // This is the width of the carriage 4800 == 12"
+#define MAX_X           32000       // That's 80 inches of vinyl cutting --
+#define MAX_X_ROLL      2000000L    // in roll feed mode, about 127 m
+
 void stepper_init(void);
 void stepper_tick(void);
-void stepper_move(int x, int y);
-void stepper_draw(int x, int y);
+void stepper_move(STEPPER_COORD x, STEPPER_COORD y);
+void stepper_draw(STEPPER_COORD x, STEPPER_COORD y);
+void stepper_page(void);
+void stepper_roll_mode(uint8_t on);
+uint8_t stepper_get_roll_mode(void);
 void stepper_speed(int delay);
 void stepper_pressure(int pressure);
 void stepper_home(void);
 void stepper_set_origin00(void);
+void stepper_set_offset(STEPPER_COORD x, STEPPER_COORD y);
+void stepper_get_offset(STEPPER_COORD *x, STEPPER_COORD *y);
+STEPPER_COORD stepper_max_x(void);
 void stepper_unload_paper(void);
 void stepper_load_paper(void);
 void pen_up(void);
 void pen_down(void);
 void stepper_jog_manual(int direction, int dist);
 void stepper_off(void);
-enum state do_next_command(void);
+void stepper_prep(void);
+uint8_t stepper_queue_room(void);
 
 // These values are opposite of their named meaning
 // 1023 is "no pressure applied" and represents a very long
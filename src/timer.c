@@ -25,13 +25,10 @@
  *
  */
 #include "avrlib.h"
-#include <avr/interrupt.h>
-#include <avr/io.h>
-#include <avr/iom1281.h>
-#include <avr/wdt.h>
 #include <string.h>
 #include <stdio.h>
 
+#include "hal.h"
 #include "timer.h"
 #include "stepper.h"
 #include "display.h"
@@ -50,7 +47,7 @@ static int current_stepper_speed;
  *       OCR2A  = 249;  // value to count to, CTC interrupts when this value is met
  *       TIMSK2 = (1 << OCIE2A); // enable interrupt
  */
-ISR(TIMER2_COMPA_vect) {
+HAL_ISR(HAL_TICK_VECT) {
     if (--count_25Hz == 0) {
         count_25Hz = 10;
         flag_25Hz = 1;
@@ -69,7 +66,7 @@ ISR(TIMER2_COMPA_vect) {
  *       OCR0A  = 99;  // value to count to, CTC interrupts when this value is met
  *       TIMSK0 = (1 << OCIE0A); // enable interrupt
  */
-ISR(TIMER0_COMPA_vect) {
+HAL_ISR(HAL_STEP_VECT) {
     stepper_tick();
 }
 
@@ -77,12 +74,11 @@ ISR(TIMER0_COMPA_vect) {
  * Turn on beeper. Hz specifies frequency of the tone.
  */
 void beeper_on(int Hz) {
-    DDRE |= (1 << DDE3);
-    OCR3A = (F_CPU + Hz / 2) / Hz - 1;
+    hal_beeper_on((F_CPU + Hz / 2) / Hz - 1);
 }
 
 void beeper_off(void) {
-    DDRE &= ~(1 << DDE3);
+    hal_beeper_off();
 }
 
 /**
@@ -91,10 +87,10 @@ void beeper_off(void) {
  * milliseconds . For longer delays, use msleep().
  */
 void usleep(int usecs) {
-    signed char end = TCNT2 + usecs / 16;
+    signed char end = hal_tick_count() + usecs / 16;
 
-    while ((signed char) (TCNT2 - end) < 0) {
-        continue;
+    while ((signed char) (hal_tick_count() - end) < 0) {
+        hal_idle();
     }
 }
 
@@ -116,7 +112,8 @@ void beep() {
 
 void timer_set_stepper_speed(int delay) {
     // delay is displayed in single increment steps 1 through  MAX_STEPPER_SPEED_RANGES
-    // but internally each step represents ~25 usecs delay in timer
+    // the planner turns it into a cruise rate for every line it puts in the queue,
+    // Timer0 itself is reprogrammed by the stepper ISR through timer_set_step_period()
 
     if (delay > MAX_STEPPER_SPEED_RANGES) {
         delay = MAX_STEPPER_SPEED_RANGES;
@@ -125,10 +122,23 @@ void timer_set_stepper_speed(int delay) {
     }
 
     current_stepper_speed = delay;
-    delay = (255 - (delay * 25)); // inverse
-    TCCR0B &= ~7; // stop timer, and clear prescaler bit
-    OCR0A = delay - 1;
-    TCCR0B |= 4; // default 1:64 prescaler
+}
+
+/**
+ * Set the time until the next stepper tick, in 4 usec units (clk/64). Periods up to
+ * 256 ticks run at clk/64, longer ones at clk/256 with the period rounded to 4 ticks.
+ * Called from the stepper ISR, right after the compare match reset TCNT0.
+ */
+void timer_set_step_period(uint16_t period) {
+    if (period <= 256) {
+        hal_step_timer(0, period - 1); // 1:64 prescaler
+    } else {
+        if (period > 1024) {
+            period = 1024;
+        }
+
+        hal_step_timer(1, ((period + 2) >> 2) - 1); // 1:256 prescaler
+    }
 }
 
 int timer_get_pen_pressure() {
@@ -159,7 +169,7 @@ void timer_set_pen_pressure(int pressure) {
 
 
     unsigned pwm = (pressure) * ((MAX_PEN_PWM - MIN_PEN_PWM) / MAX_CUTTER_P_RANGES);
-    OCR1B = (MAX_PEN_PWM - pwm);
+    hal_pen_pwm(MAX_PEN_PWM - pwm);
 }
 
 /**
@@ -167,28 +177,5 @@ void timer_set_pen_pressure(int pressure) {
  */
 void timer_init(void) {
     //ATMega1281 - Used in Cricut Expression CREX001
-    // set timer 0, variable period for stepper
-    TCCR0A = (1 << WGM01); // CTC
-    TCCR0B = (1 << CS00) | (1 << CS01); // prescaler 1/256 -> 250 kHz << this doesnt compute @16mhz/256=62500
-    OCR0A = 99; // value to count to, CTC interrupts when this value is met
-    TIMSK0 = (1 << OCIE0A); // enable interrupt
-
-    // set timer 2 for 250 Hz period
-    TCCR2A = (1 << WGM21); // CTC
-    TCCR2B = (1 << CS21) | (1 << CS20); //timer2's prescaler is different than the rest... set two bits instead of one
-    OCR2A = 249; // value to count to, CTC interrupts when this value is met
-    TIMSK2 = (1 << OCIE2A); // enable interrupt
-
-    DDRB |= (1 << PB6); // PB6 is PWM output, oc1b
-    // set timer 1, WGM mode 7, fast PWM 10 bit
-    // PWM, Phase Correct, 10-bit
-    //Clear OCnA/OCnB/OCnC on compare match, set OCnA/OCnB/OCnC at BOTTOM (non-inverting mode)
-    TCCR1A = (1 << WGM11) | (1 << WGM10) | (1 << COM1B1);
-    OCR1B = 1023;
-    TCCR1B = (1 << WGM12) | (1 << CS10); // 00001001 wave form generation mode,CLKio no prescaling
-
-    // Timer 3, WGM mode 15 (1111), Fast PWM using OCR3A
-    // this is used by the beeper, OCR3A is set in beeper_on(hz)
-    TCCR3A = (1 << COM3A0) | (1 << WGM31) | (1 << WGM30);
-    TCCR3B = (1 << WGM33) | (1 << WGM32) | 1;
+    hal_timer_init(); // see hal.h for the registers
 }
@@ -26,6 +26,7 @@ void msleep(unsigned msecs);
 void beeper_on(int Hz);
 void beeper_off(void);
 void timer_set_stepper_speed(int delay);
+void timer_set_step_period(uint16_t period);
 void timer_set_pen_pressure(int pressure);
 int timer_get_pen_pressure(void);
 int timer_get_stepper_speed(void);
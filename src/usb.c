@@ -22,6 +22,7 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/wdt.h>
+#include <avr/pgmspace.h>
 #include <inttypes.h>
 #include <stdio.h>
 
@@ -38,6 +39,10 @@ void usb_putc(uint8_t c) {
     serial_write(c);
 }
 
+void usb_putpair(uint8_t code, uint8_t c) {
+    serial_write_pair(code, c);
+}
+
 uint8_t usb_getc() {
     return serial_read();
 }
@@ -47,7 +52,28 @@ int usb_haschar(void) {
 }
 
 /**
- * initialize USB UART. Assume fixed baudrate of 115200, and default 8N1.
+ * Switch to another baud rate (BD command). The answer goes out at the old
+ * rate: "BD<rate>" when the host should follow, "BD0" when the rate can't
+ * be made, in which case nothing changes.
+ */
+void usb_set_baud(uint32_t baud) {
+    char s[16];
+
+    if (!serial_baud_valid(baud)) {
+        baud = 0;
+    }
+
+    sprintf_P(s, PSTR("BD%lu\r"), (unsigned long) baud);
+    usb_puts(s);
+
+    if (baud) {
+        serial_set_baud(baud);
+    }
+}
+
+/**
+ * initialize USB UART at BAUD_RATE, and default 8N1. The host can go faster
+ * with BD.
  */
 void usb_init(void) {
     serial_init();
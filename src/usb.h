@@ -27,7 +27,9 @@
 void usb_init(void);
 int usb_haschar(void);
 void usb_putc(uint8_t c);
+void usb_putpair(uint8_t code, uint8_t c);
 uint8_t usb_getc(void);
 void usb_puts(const char *s);
+void usb_set_baud(uint32_t baud);
 
 #endif
@@ -0,0 +1,267 @@
+#!/usr/bin/env python3
+"""
+hpgl_send.py - send a HPGL file to FreeExpression with credit flow control.
+
+The cutter is asked for credits with ENQ. It answers ACK <n>, and after that
+DC2 <n> every time it has read n more bytes. We never have more bytes in
+flight than we have credits for, so the cutter's receive buffer can't overflow
+at any baud rate. Any other bytes from the cutter are printed.
+
+With --binary, PU/PD/PA are turned into the framed binary stream of
+src/bincmd.c instead, which takes about a quarter of the bytes. Frames the
+cutter asks for again (NAK), or doesn't acknowledge in time, are resent.
+
+Only the Python standard library is used (termios), so this also runs against
+a pty, e.g. one end of "socat -d -d pty,raw,echo=0 pty,raw,echo=0".
+
+usage: hpgl_send.py [-b BAUD] [--switch BAUD] [--binary] PORT FILE
+"""
+import argparse
+import os
+import re
+import select
+import sys
+import termios
+import time
+import tty
+
+ENQ = 0x05
+ACK = 0x06
+DC2 = 0x12
+
+# binary stream, see src/bincmd.h
+BIN_END = 0xC0
+BIN_ESC = 0xDB
+BIN_ESCAPES = {BIN_END: 0xDC, BIN_ESC: 0xDD, ENQ: 0xDE}
+BIN_FRAME_MAX = 128
+FRAME_ACK = 0x17
+FRAME_NAK = 0x15
+EOT = 0x04
+BIN_MOVE, BIN_DRAW, BIN_SPEED, BIN_PRESSURE, BIN_EXIT = range(5)
+WINDOW = 64  # frames in flight, less than half the sequence numbers
+
+BAUDS = {
+    9600: termios.B9600,
+    19200: termios.B19200,
+    38400: termios.B38400,
+    57600: termios.B57600,
+    115200: termios.B115200,
+}
+for rate in (230400, 460800, 500000, 1000000):
+    if hasattr(termios, "B%d" % rate):
+        BAUDS[rate] = getattr(termios, "B%d" % rate)
+
+
+def set_baud(fd, baud):
+    attr = termios.tcgetattr(fd)
+    attr[4] = attr[5] = BAUDS[baud]
+    termios.tcsetattr(fd, termios.TCSADRAIN, attr)
+
+
+def open_port(port, baud):
+    fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    attr = termios.tcgetattr(fd)
+    attr[0] &= ~(termios.IXON | termios.IXOFF)  # no XON/XOFF, we do our own flow control
+    termios.tcsetattr(fd, termios.TCSANOW, attr)
+    set_baud(fd, baud)
+    return fd
+
+
+class Link:
+    def __init__(self, fd):
+        self.fd = fd
+        self.credit = None  # unknown until ACK arrives
+        self.pending = None  # reply waiting for its second byte
+        self.text = bytearray()
+        self.acked = []  # sequence numbers of acknowledged frames
+        self.nak = None  # frame the cutter wants again
+        self.eot = False
+
+    def poll(self, timeout):
+        """Read whatever the cutter sent, and update the credits.
+
+        ACK, DC2, and the frame ACK and NAK are all followed right away by
+        their count or sequence number, the cutter never puts anything in
+        between. So the byte after one of them always belongs to it.
+        """
+        if not select.select([self.fd], [], [], timeout)[0]:
+            return
+        for c in os.read(self.fd, 256):
+            if self.pending is not None:
+                if self.pending == ACK:
+                    self.credit = c
+                elif self.pending == DC2:
+                    if self.credit is not None:
+                        self.credit += c  # DC2 before the ACK belongs to an older ENQ
+                elif self.pending == FRAME_ACK:
+                    self.acked.append(c)
+                elif self.pending == FRAME_NAK:
+                    self.nak = c
+                self.pending = None
+            elif c in (ACK, DC2, FRAME_ACK, FRAME_NAK):
+                self.pending = c
+            elif c == EOT:
+                self.eot = True
+            else:
+                self.text.append(c)
+                if c in (0x0a, 0x0d):
+                    self.flush_text()
+
+    def flush_text(self):
+        if self.text.strip():
+            sys.stderr.write("cutter: %s\n" % self.text.decode("ascii", "replace").strip())
+        self.text.clear()
+
+    def sync(self):
+        self.credit = None
+        os.write(self.fd, bytes([ENQ]))
+        while self.credit is None:
+            self.poll(1.0)
+
+    def send(self, data):
+        while data:
+            n = min(self.credit, len(data))
+            if n:
+                n = os.write(self.fd, data[:n])
+                self.credit -= n
+                data = data[n:]
+            self.poll(0 if self.credit else 1.0)
+
+
+def varint(v):
+    out = bytearray()
+    while v > 0x7f:
+        out.append(0x80 | (v & 0x7f))
+        v >>= 7
+    out.append(v)
+    return out
+
+
+def zigzag(v):
+    return (v << 1) if v >= 0 else ((-v << 1) - 1)
+
+
+def crc_ccitt(data):
+    """Same as _crc_ccitt_update() in avr-libc, starting at 0xffff."""
+    crc = 0xffff
+    for b in data:
+        b ^= crc & 0xff
+        b = (b ^ (b << 4)) & 0xff
+        crc = ((b << 8) | (crc >> 8)) ^ (b >> 4) ^ (b << 3)
+        crc &= 0xffff
+    return crc
+
+
+def hpgl_records(data):
+    """Turn PU/PD/PA into binary records. Anything else can't be sent this way."""
+    records = []
+    x = y = 0
+    down = False
+    for cmd in data.split(b";"):
+        cmd = cmd.strip()
+        if not cmd:
+            continue
+        op, args = cmd[:2].upper(), [int(round(float(v))) for v in re.split(rb"[ ,]+", cmd[2:].strip()) if v]
+        if op in (b"PU", b"PD"):
+            down = op == b"PD"
+        elif op in (b"IN", b"SP"):
+            down = False
+            continue
+        elif op != b"PA":
+            sys.exit("%s can't be sent in binary mode" % op.decode("ascii", "replace"))
+        for nx, ny in zip(args[0::2], args[1::2]):
+            records.append(varint(zigzag(nx - x) << 3 | (BIN_DRAW if down else BIN_MOVE)) + varint(zigzag(ny - y)))
+            x, y = nx, ny
+    records.append(varint(BIN_EXIT))
+    return records
+
+
+def frames(records):
+    """Pack records into frames: sequence number, records, CRC, escaped and closed by END."""
+    out, body = [], bytearray()
+    for rec in records + [None]:
+        if rec is None or len(body) + len(rec) > BIN_FRAME_MAX - 3:
+            raw = bytes([len(out) & 0xff]) + body
+            raw += crc_ccitt(raw).to_bytes(2, "little")
+            esc = bytearray()
+            for b in raw:
+                esc += bytes([BIN_ESC, BIN_ESCAPES[b]]) if b in BIN_ESCAPES else bytes([b])
+            out.append(bytes(esc) + bytes([BIN_END]))
+            body = bytearray()
+        if rec is not None:
+            body += rec
+    return out
+
+
+def send_binary(link, data):
+    todo = frames(hpgl_records(data))
+    base = 0  # oldest frame not acknowledged
+    nxt = 0  # next frame to send
+    last = time.time()
+    link.send(b"BN;" + bytes([BIN_END]))
+    while base < len(todo) or not link.eot:
+        link.poll(0 if link.credit and nxt < len(todo) else 0.05)
+        for seq in link.acked:
+            if (seq - base) & 0xff < WINDOW:
+                base += ((seq - base) & 0xff) + 1  # frames are executed in order
+                last = time.time()
+        link.acked = []
+        if link.nak is not None:
+            nxt = base + ((link.nak - base) & 0xff)  # go back to that frame
+            link.nak = None
+        if base < len(todo) and time.time() - last > 2.0:
+            nxt = base  # nothing heard for a while, start over from the oldest
+            last = time.time()
+        if nxt < len(todo) and nxt - base < WINDOW:
+            link.send(todo[nxt])
+            nxt += 1
+        elif base >= len(todo) and not link.eot and time.time() - last > 2.0:
+            sys.exit("no EOT from the cutter")
+
+
+def switch_baud(link, baud):
+    """Ask for another rate with BD, and follow once the cutter agrees."""
+    os.write(link.fd, b"BD%d;" % baud)
+    answer = bytearray()
+    while not (answer.endswith(b"\r") and b"BD" in answer):
+        if not select.select([link.fd], [], [], 2.0)[0]:
+            sys.exit("no answer to BD")
+        answer += os.read(link.fd, 1)
+    if answer[answer.rindex(b"BD"):].strip() != b"BD%d" % baud:
+        sys.exit("cutter refused %d baud" % baud)
+    set_baud(link.fd, baud)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Send HPGL to FreeExpression with credit flow control.")
+    parser.add_argument("-b", "--baud", type=int, default=9600, help="current baud rate of the cutter")
+    parser.add_argument("--switch", type=int, metavar="BAUD", help="switch to this rate with BD before sending")
+    parser.add_argument("--binary", action="store_true", help="send PU/PD/PA as the binary stream")
+    parser.add_argument("port")
+    parser.add_argument("file")
+    args = parser.parse_args()
+
+    for rate in (args.baud, args.switch):
+        if rate and rate not in BAUDS:
+            sys.exit("baud rate %d not supported here" % rate)
+
+    with open(args.file, "rb") as f:
+        data = f.read()
+
+    link = Link(open_port(args.port, args.baud))
+    if args.switch:
+        switch_baud(link, args.switch)
+    link.sync()
+    if args.binary:
+        send_binary(link, data)
+    else:
+        link.send(data)
+    termios.tcdrain(link.fd)
+    link.poll(0.1)
+    link.flush_text()
+    os.close(link.fd)
+
+
+if __name__ == "__main__":
+    main()